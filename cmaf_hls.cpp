@@ -0,0 +1,1104 @@
+//
+// Low latency HLS (CMAF) output of the RTSP ingest, see cmaf_hls.h.
+//
+
+#include "cmaf_hls.h"
+#include "compressed_tap.h"
+#include "metrics.h"
+
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_HLS_PART_MS 200
+#define DEFAULT_HLS_SEGMENT_MS 2000
+#define DEFAULT_HLS_WINDOW 6
+#define HLS_TIMESCALE 90000
+/* Compressed data waiting for the segmenter before the tap drops a GOP */
+#define HLS_MAX_QUEUED_BYTES (4 * 1024 * 1024)
+/* Complete segments still listed with their parts, the spec asks for the
+ * last three target durations */
+#define HLS_PART_SEGMENTS 2
+
+static gint hls_port = 0;
+static gint hls_part_ms = DEFAULT_HLS_PART_MS;
+static gint hls_segment_ms = DEFAULT_HLS_SEGMENT_MS;
+static gint hls_window = DEFAULT_HLS_WINDOW;
+
+static GOptionEntry hls_entries[] = {
+        {"hls-port", 0, 0, G_OPTION_ARG_INT, &hls_port,
+                "Serve the ingest as low latency HLS on this port, without re-encoding", "PORT"},
+        {"hls-part-ms", 0, 0, G_OPTION_ARG_INT, &hls_part_ms,
+                "Target duration of HLS partial segments in ms (default: 200)", "MS"},
+        {"hls-segment-ms", 0, 0, G_OPTION_ARG_INT, &hls_segment_ms,
+                "Minimum duration of HLS segments in ms, they start on keyframes (default: 2000)", "MS"},
+        {"hls-window", 0, 0, G_OPTION_ARG_INT, &hls_window,
+                "Complete HLS segments kept in the playlist (default: 6)", "N"},
+        {NULL}
+};
+
+typedef struct
+{
+    GstBuffer *buffer;
+    guint64 dts;                /* HLS_TIMESCALE */
+    gint64 cts;                 /* pts - dts */
+    guint32 duration;
+    gboolean keyframe;
+} HlsSample;
+
+typedef struct
+{
+    GBytes *data;
+    guint32 duration;
+    gboolean independent;
+} HlsPart;
+
+typedef struct
+{
+    guint64 msn;
+    guint init_id;
+    gboolean discontinuity;
+    GPtrArray *parts;
+    guint64 duration;
+    gboolean complete;
+} HlsSegment;
+
+typedef enum
+{
+    HLS_REQUEST_PLAYLIST,
+    HLS_REQUEST_INIT,
+    HLS_REQUEST_SEGMENT,
+    HLS_REQUEST_PART
+} HlsRequestType;
+
+typedef struct
+{
+    HlsRequestType type;
+    guint64 msn;                /* G_MAXUINT64 for a playlist without _HLS_msn */
+    gint part;                  /* -1 for a whole segment */
+    guint init_id;
+} HlsRequest;
+
+/* A paused request, until its part exists or the deadline passed */
+typedef struct
+{
+    SoupMessage *msg;
+    HlsRequest request;
+    gint64 deadline;
+} HlsWaiter;
+
+/* Segmenter state, written by the appsink thread, read by the server */
+static GMutex hls_lock;
+static GQueue hls_segments = G_QUEUE_INIT;      /* oldest first, the tail may be open */
+static GHashTable *hls_inits = NULL;    /* init id -> GBytes */
+static guint hls_init_id = 0;
+static GstBuffer *hls_codec_data = NULL;
+static gboolean hls_discont = FALSE;
+static guint64 hls_next_msn = 0;
+static guint64 hls_disc_seq = 0;
+static guint32 hls_fragment_seq = 0;
+static GArray *hls_pending = NULL;      /* HlsSample of the part being built */
+static guint64 hls_pending_duration = 0;
+static HlsSample hls_prev;
+static gboolean hls_have_prev = FALSE;
+static gint hls_wake_queued = 0;
+
+static GstElement *hls_pipeline = NULL;
+static GstElement *hls_src = NULL;
+static SoupServer *hls_server = NULL;
+static GList *hls_waiters = NULL;       /* main context only */
+static guint hls_timeout_id = 0;
+
+static CompressedTap *hls_tap = NULL;
+
+static MetricsCounter *parts_metric;
+static MetricsCounter *dropped_metric;
+
+/*
+ * ISO BMFF boxes. Sizes are written once the box is complete.
+ */
+static void
+put_u8 (GByteArray * b, guint8 v)
+{
+    g_byte_array_append (b, &v, 1);
+}
+
+static void
+put_u16 (GByteArray * b, guint16 v)
+{
+    guint8 d[2];
+
+    GST_WRITE_UINT16_BE (d, v);
+    g_byte_array_append (b, d, 2);
+}
+
+static void
+put_u32 (GByteArray * b, guint32 v)
+{
+    guint8 d[4];
+
+    GST_WRITE_UINT32_BE (d, v);
+    g_byte_array_append (b, d, 4);
+}
+
+static void
+put_u64 (GByteArray * b, guint64 v)
+{
+    guint8 d[8];
+
+    GST_WRITE_UINT64_BE (d, v);
+    g_byte_array_append (b, d, 8);
+}
+
+static void
+put_zeros (GByteArray * b, guint n)
+{
+    while (n--)
+        put_u8 (b, 0);
+}
+
+static guint
+box_start (GByteArray * b, const gchar * type)
+{
+    guint pos = b->len;
+
+    put_u32 (b, 0);
+    g_byte_array_append (b, (const guint8 *) type, 4);
+    return pos;
+}
+
+static guint
+full_box_start (GByteArray * b, const gchar * type, guint8 version, guint32 flags)
+{
+    guint pos = box_start (b, type);
+
+    put_u32 (b, ((guint32) version << 24) | (flags & 0xffffff));
+    return pos;
+}
+
+static void
+box_end (GByteArray * b, guint pos)
+{
+    GST_WRITE_UINT32_BE (b->data + pos, b->len - pos);
+}
+
+static void
+put_matrix (GByteArray * b)
+{
+    put_u32 (b, 0x00010000);
+    put_zeros (b, 12);
+    put_u32 (b, 0x00010000);
+    put_zeros (b, 12);
+    put_u32 (b, 0x40000000);
+}
+
+/*
+ * ftyp and moov of a single H.264 track with the stream's avcC.
+ */
+static GBytes *
+hls_build_init (GstBuffer * codec_data, gint width, gint height)
+{
+    GByteArray *b = g_byte_array_new ();
+    GstMapInfo map;
+    guint moov, trak, mdia, minf, dinf, dref, stbl, stsd, avc1, avcc, mvex, box;
+
+    box = box_start (b, "ftyp");
+    g_byte_array_append (b, (const guint8 *) "iso6", 4);
+    put_u32 (b, 0);
+    g_byte_array_append (b, (const guint8 *) "iso6cmfcmp41", 12);
+    box_end (b, box);
+
+    moov = box_start (b, "moov");
+    box = full_box_start (b, "mvhd", 0, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 1000);
+    put_u32 (b, 0);
+    put_u32 (b, 0x00010000);
+    put_u16 (b, 0x0100);
+    put_zeros (b, 10);
+    put_matrix (b);
+    put_zeros (b, 24);
+    put_u32 (b, 2);
+    box_end (b, box);
+
+    trak = box_start (b, "trak");
+    box = full_box_start (b, "tkhd", 0, 3);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 1);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    put_zeros (b, 8);
+    put_u16 (b, 0);
+    put_u16 (b, 0);
+    put_u16 (b, 0);
+    put_u16 (b, 0);
+    put_matrix (b);
+    put_u32 (b, (guint32) width << 16);
+    put_u32 (b, (guint32) height << 16);
+    box_end (b, box);
+
+    mdia = box_start (b, "mdia");
+    box = full_box_start (b, "mdhd", 0, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    put_u32 (b, HLS_TIMESCALE);
+    put_u32 (b, 0);
+    put_u16 (b, 0x55c4);        /* und */
+    put_u16 (b, 0);
+    box_end (b, box);
+    box = full_box_start (b, "hdlr", 0, 0);
+    put_u32 (b, 0);
+    g_byte_array_append (b, (const guint8 *) "vide", 4);
+    put_zeros (b, 12);
+    g_byte_array_append (b, (const guint8 *) "VideoHandler", 13);
+    box_end (b, box);
+
+    minf = box_start (b, "minf");
+    box = full_box_start (b, "vmhd", 0, 1);
+    put_zeros (b, 8);
+    box_end (b, box);
+    dinf = box_start (b, "dinf");
+    dref = full_box_start (b, "dref", 0, 0);
+    put_u32 (b, 1);
+    box = full_box_start (b, "url ", 0, 1);
+    box_end (b, box);
+    box_end (b, dref);
+    box_end (b, dinf);
+
+    stbl = box_start (b, "stbl");
+    stsd = full_box_start (b, "stsd", 0, 0);
+    put_u32 (b, 1);
+    avc1 = box_start (b, "avc1");
+    put_zeros (b, 6);
+    put_u16 (b, 1);
+    put_zeros (b, 16);
+    put_u16 (b, width);
+    put_u16 (b, height);
+    put_u32 (b, 0x00480000);
+    put_u32 (b, 0x00480000);
+    put_u32 (b, 0);
+    put_u16 (b, 1);
+    put_zeros (b, 32);
+    put_u16 (b, 0x0018);
+    put_u16 (b, 0xffff);
+    avcc = box_start (b, "avcC");
+    gst_buffer_map (codec_data, &map, GST_MAP_READ);
+    g_byte_array_append (b, map.data, map.size);
+    gst_buffer_unmap (codec_data, &map);
+    box_end (b, avcc);
+    box_end (b, avc1);
+    box_end (b, stsd);
+    box = full_box_start (b, "stts", 0, 0);
+    put_u32 (b, 0);
+    box_end (b, box);
+    box = full_box_start (b, "stsc", 0, 0);
+    put_u32 (b, 0);
+    box_end (b, box);
+    box = full_box_start (b, "stsz", 0, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    box_end (b, box);
+    box = full_box_start (b, "stco", 0, 0);
+    put_u32 (b, 0);
+    box_end (b, box);
+    box_end (b, stbl);
+    box_end (b, minf);
+    box_end (b, mdia);
+    box_end (b, trak);
+
+    mvex = box_start (b, "mvex");
+    box = full_box_start (b, "trex", 0, 0);
+    put_u32 (b, 1);
+    put_u32 (b, 1);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    put_u32 (b, 0);
+    box_end (b, box);
+    box_end (b, mvex);
+    box_end (b, moov);
+
+    return g_byte_array_free_to_bytes (b);
+}
+
+/*
+ * One moof and mdat holding the pending samples. The frame data is copied
+ * once, into the part that is served.
+ */
+static GBytes *
+hls_build_fragment (void)
+{
+    GByteArray *b = g_byte_array_new ();
+    guint moof, traf, trun, mdat, box, data_offset, i;
+    HlsSample *first = &g_array_index (hls_pending, HlsSample, 0);
+
+    moof = box_start (b, "moof");
+    box = full_box_start (b, "mfhd", 0, 0);
+    put_u32 (b, ++hls_fragment_seq);
+    box_end (b, box);
+
+    traf = box_start (b, "traf");
+    box = full_box_start (b, "tfhd", 0, 0x020000);      /* default-base-is-moof */
+    put_u32 (b, 1);
+    box_end (b, box);
+    box = full_box_start (b, "tfdt", 1, 0);
+    put_u64 (b, first->dts);
+    box_end (b, box);
+    /* data offset, duration, size, flags and composition offset per sample */
+    trun = full_box_start (b, "trun", 1, 0x000f01);
+    put_u32 (b, hls_pending->len);
+    data_offset = b->len;
+    put_u32 (b, 0);
+    for (i = 0; i < hls_pending->len; i++) {
+        HlsSample *s = &g_array_index (hls_pending, HlsSample, i);
+
+        put_u32 (b, s->duration);
+        put_u32 (b, gst_buffer_get_size (s->buffer));
+        put_u32 (b, s->keyframe ? 0x02000000 : 0x01010000);
+        put_u32 (b, (guint32) (gint32) s->cts);
+    }
+    box_end (b, trun);
+    box_end (b, traf);
+    box_end (b, moof);
+
+    mdat = box_start (b, "mdat");
+    GST_WRITE_UINT32_BE (b->data + data_offset, b->len - moof);
+    for (i = 0; i < hls_pending->len; i++) {
+        HlsSample *s = &g_array_index (hls_pending, HlsSample, i);
+        gsize size = gst_buffer_get_size (s->buffer);
+        guint pos = b->len;
+
+        g_byte_array_set_size (b, pos + size);
+        gst_buffer_extract (s->buffer, 0, b->data + pos, size);
+    }
+    box_end (b, mdat);
+
+    return g_byte_array_free_to_bytes (b);
+}
+
+static void
+hls_segment_free (HlsSegment * seg)
+{
+    g_ptr_array_unref (seg->parts);
+    g_free (seg);
+}
+
+static void
+hls_part_free (gpointer data)
+{
+    HlsPart *part = (HlsPart *) data;
+
+    g_bytes_unref (part->data);
+    g_free (part);
+}
+
+static HlsSegment *
+hls_open_segment (void)
+{
+    HlsSegment *seg = (HlsSegment *) g_queue_peek_tail (&hls_segments);
+
+    if (seg && !seg->complete)
+        return seg;
+
+    seg = g_new0 (HlsSegment, 1);
+    seg->msn = hls_next_msn++;
+    seg->init_id = hls_init_id;
+    seg->discontinuity = hls_discont;
+    seg->parts = g_ptr_array_new_with_free_func (hls_part_free);
+    hls_discont = FALSE;
+    g_queue_push_tail (&hls_segments, seg);
+    return seg;
+}
+
+static gboolean hls_wake_waiters (gpointer user_data);
+
+/* The server answers the requests waiting for new parts from the main context */
+static void
+hls_notify (void)
+{
+    if (g_atomic_int_compare_and_exchange (&hls_wake_queued, 0, 1))
+        g_idle_add (hls_wake_waiters, NULL);
+}
+
+static void
+hls_close_part (void)
+{
+    HlsSegment *seg;
+    HlsPart *part;
+    guint i;
+
+    if (hls_pending->len == 0)
+        return;
+
+    part = g_new0 (HlsPart, 1);
+    part->data = hls_build_fragment ();
+    part->duration = (guint32) hls_pending_duration;
+    part->independent = g_array_index (hls_pending, HlsSample, 0).keyframe;
+
+    seg = hls_open_segment ();
+    g_ptr_array_add (seg->parts, part);
+    seg->duration += hls_pending_duration;
+
+    for (i = 0; i < hls_pending->len; i++)
+        gst_buffer_unref (g_array_index (hls_pending, HlsSample, i).buffer);
+    g_array_set_size (hls_pending, 0);
+    hls_pending_duration = 0;
+
+    metrics_counter_add (parts_metric, 1);
+    hls_notify ();
+}
+
+static void
+hls_close_segment (void)
+{
+    HlsSegment *seg = (HlsSegment *) g_queue_peek_tail (&hls_segments);
+    guint complete = 0;
+    GList *l;
+
+    if (!seg || seg->complete)
+        return;
+    seg->complete = TRUE;
+
+    for (l = hls_segments.head; l; l = l->next)
+        complete += ((HlsSegment *) l->data)->complete;
+    while (complete > (guint) MAX (hls_window, 1)) {
+        HlsSegment *old = (HlsSegment *) g_queue_pop_head (&hls_segments);
+        HlsSegment *head = (HlsSegment *) g_queue_peek_head (&hls_segments);
+        guint id;
+
+        if (old->discontinuity)
+            hls_disc_seq++;
+        /* Init segments nobody refers to any more */
+        for (id = old->init_id; head && id < head->init_id; id++)
+            g_hash_table_remove (hls_inits, GUINT_TO_POINTER (id));
+        hls_segment_free (old);
+        complete--;
+    }
+    hls_notify ();
+}
+
+/*
+ * Appends the previous frame, whose duration is known now, and cuts parts
+ * and segments in front of the new one.
+ */
+static void
+hls_add_sample (GstBuffer * buffer)
+{
+    GstClockTime dts = GST_BUFFER_DTS_OR_PTS (buffer);
+    GstClockTime pts = GST_BUFFER_PTS (buffer);
+    HlsSegment *seg;
+    HlsSample s;
+
+    if (!GST_CLOCK_TIME_IS_VALID (dts))
+        return;
+    if (!GST_CLOCK_TIME_IS_VALID (pts))
+        pts = dts;
+
+    s.buffer = gst_buffer_ref (buffer);
+    s.dts = gst_util_uint64_scale (dts, HLS_TIMESCALE, GST_SECOND);
+    s.cts = (gint64) gst_util_uint64_scale (pts, HLS_TIMESCALE, GST_SECOND) - (gint64) s.dts;
+    s.duration = 0;
+    s.keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (!hls_have_prev) {
+        /* Every segment starts on a keyframe */
+        if (!s.keyframe) {
+            gst_buffer_unref (s.buffer);
+            return;
+        }
+        hls_prev = s;
+        hls_have_prev = TRUE;
+        return;
+    }
+
+    hls_prev.duration = s.dts > hls_prev.dts ? (guint32) (s.dts - hls_prev.dts) : 1;
+    if (hls_pending->len > 0
+        && hls_pending_duration + hls_prev.duration > (guint64) hls_part_ms * HLS_TIMESCALE / 1000)
+        hls_close_part ();
+    g_array_append_val (hls_pending, hls_prev);
+    hls_pending_duration += hls_prev.duration;
+
+    seg = (HlsSegment *) g_queue_peek_tail (&hls_segments);
+    if (s.keyframe && (seg && !seg->complete ? seg->duration : 0) + hls_pending_duration
+        >= (guint64) hls_segment_ms * HLS_TIMESCALE / 1000) {
+        hls_close_part ();
+        hls_close_segment ();
+    }
+    hls_prev = s;
+}
+
+/*
+ * New SPS/PPS, e.g. after the camera reconnected with other settings: the
+ * open segment is finished and the next one starts a discontinuity with
+ * its own init segment.
+ */
+static void
+hls_set_caps (GstCaps * caps)
+{
+    GstStructure *st = gst_caps_get_structure (caps, 0);
+    const GValue *value = gst_structure_get_value (st, "codec_data");
+    GstBuffer *codec_data;
+    gint width = 0, height = 0;
+
+    if (!value || !GST_VALUE_HOLDS_BUFFER (value))
+        return;
+    codec_data = gst_value_get_buffer (value);
+    if (hls_codec_data && gst_buffer_get_size (hls_codec_data) == gst_buffer_get_size (codec_data)) {
+        GstMapInfo map;
+        gboolean same;
+
+        gst_buffer_map (hls_codec_data, &map, GST_MAP_READ);
+        same = gst_buffer_memcmp (codec_data, 0, map.data, map.size) == 0;
+        gst_buffer_unmap (hls_codec_data, &map);
+        if (same)
+            return;
+    }
+
+    if (hls_codec_data) {
+        if (hls_have_prev) {
+            /* Its duration is unknown, assume the one before it */
+            hls_prev.duration = hls_pending->len ?
+                g_array_index (hls_pending, HlsSample, hls_pending->len - 1).duration : 1;
+            g_array_append_val (hls_pending, hls_prev);
+            hls_pending_duration += hls_prev.duration;
+            hls_have_prev = FALSE;
+        }
+        hls_close_part ();
+        hls_close_segment ();
+        hls_discont = TRUE;
+        gst_buffer_unref (hls_codec_data);
+    }
+    hls_codec_data = gst_buffer_ref (codec_data);
+
+    gst_structure_get_int (st, "width", &width);
+    gst_structure_get_int (st, "height", &height);
+    hls_init_id++;
+    g_hash_table_insert (hls_inits, GUINT_TO_POINTER (hls_init_id),
+                         hls_build_init (codec_data, width, height));
+}
+
+static void
+hls_push_sample (GstSample * sample)
+{
+    g_mutex_lock (&hls_lock);
+    hls_set_caps (gst_sample_get_caps (sample));
+    if (hls_codec_data)
+        hls_add_sample (gst_sample_get_buffer (sample));
+    g_mutex_unlock (&hls_lock);
+}
+
+static GstFlowReturn
+hls_new_sample_cb (GstElement * sink, gpointer user_data)
+{
+    GstSample *sample = NULL;
+
+    g_signal_emit_by_name (sink, "pull-sample", &sample);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    hls_push_sample (sample);
+    gst_sample_unref (sample);
+
+    return GST_FLOW_OK;
+}
+
+static void
+hls_segmenter_setup (void)
+{
+    if (!parts_metric) {
+        parts_metric = metrics_counter_new ("hls_parts_total", "LL-HLS partial segments written");
+        dropped_metric = metrics_counter_new ("hls_dropped_frames_total",
+                                              "Ingest frames the HLS segmenter could not keep up with");
+    }
+    hls_inits = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) g_bytes_unref);
+    hls_pending = g_array_new (FALSE, FALSE, sizeof (HlsSample));
+}
+
+static void
+hls_segmenter_clear (void)
+{
+    guint i;
+
+    g_mutex_lock (&hls_lock);
+    while (!g_queue_is_empty (&hls_segments))
+        hls_segment_free ((HlsSegment *) g_queue_pop_head (&hls_segments));
+    for (i = 0; i < hls_pending->len; i++)
+        gst_buffer_unref (g_array_index (hls_pending, HlsSample, i).buffer);
+    g_array_free (hls_pending, TRUE);
+    hls_pending = NULL;
+    hls_pending_duration = 0;
+    if (hls_have_prev)
+        gst_buffer_unref (hls_prev.buffer);
+    hls_have_prev = FALSE;
+    gst_clear_buffer (&hls_codec_data);
+    g_clear_pointer (&hls_inits, g_hash_table_unref);
+    hls_init_id = 0;
+    hls_next_msn = 0;
+    hls_disc_seq = 0;
+    hls_discont = FALSE;
+    hls_fragment_seq = 0;
+    g_mutex_unlock (&hls_lock);
+}
+
+void
+cmaf_hls_tap (GstElement * parser)
+{
+    if (hls_tap)
+        compressed_tap_attach (hls_tap, parser);
+}
+
+/*
+ * HTTP side, main context only.
+ */
+static HlsSegment *
+hls_find_segment (guint64 msn)
+{
+    GList *l;
+
+    for (l = hls_segments.head; l; l = l->next) {
+        HlsSegment *seg = (HlsSegment *) l->data;
+
+        if (seg->msn == msn)
+            return seg;
+    }
+    return NULL;
+}
+
+static guint64
+hls_oldest_msn (void)
+{
+    HlsSegment *seg = (HlsSegment *) g_queue_peek_head (&hls_segments);
+
+    return seg ? seg->msn : hls_next_msn;
+}
+
+/* Whether the part (or the whole segment for part -1) exists or never will */
+static gboolean
+hls_available (guint64 msn, gint part)
+{
+    HlsSegment *seg = hls_find_segment (msn);
+
+    if (!seg)
+        return msn < hls_oldest_msn ();
+    if (part < 0)
+        return seg->complete;
+    return seg->complete || seg->parts->len > (guint) part;
+}
+
+static gchar *
+hls_build_playlist (void)
+{
+    GString *m3u8 = g_string_new ("#EXTM3U\n#EXT-X-VERSION:9\n");
+    guint64 target = (guint64) hls_segment_ms * HLS_TIMESCALE / 1000;
+    guint complete = 0, listed = 0;
+    guint prev_init = 0;
+    HlsSegment *tail = (HlsSegment *) g_queue_peek_tail (&hls_segments);
+    GList *l;
+
+    for (l = hls_segments.head; l; l = l->next) {
+        HlsSegment *seg = (HlsSegment *) l->data;
+
+        target = MAX (target, seg->duration);
+        complete += seg->complete;
+    }
+    g_string_append_printf (m3u8, "#EXT-X-TARGETDURATION:%u\n",
+                            (guint) ((target + HLS_TIMESCALE - 1) / HLS_TIMESCALE));
+    g_string_append_printf (m3u8, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", hls_part_ms / 1000.0);
+    g_string_append_printf (m3u8, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n",
+                            3 * hls_part_ms / 1000.0);
+    g_string_append_printf (m3u8, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n", hls_oldest_msn ());
+    g_string_append_printf (m3u8, "#EXT-X-DISCONTINUITY-SEQUENCE:%" G_GUINT64_FORMAT "\n", hls_disc_seq);
+
+    for (l = hls_segments.head; l; l = l->next) {
+        HlsSegment *seg = (HlsSegment *) l->data;
+        guint i;
+
+        if (seg->discontinuity && l != hls_segments.head)
+            g_string_append (m3u8, "#EXT-X-DISCONTINUITY\n");
+        if (seg->init_id != prev_init)
+            g_string_append_printf (m3u8, "#EXT-X-MAP:URI=\"init%u.mp4\"\n", seg->init_id);
+        prev_init = seg->init_id;
+
+        if (seg->complete)
+            listed++;
+        if (!seg->complete || complete - listed < HLS_PART_SEGMENTS) {
+            for (i = 0; i < seg->parts->len; i++) {
+                HlsPart *part = (HlsPart *) g_ptr_array_index (seg->parts, i);
+
+                g_string_append_printf (m3u8, "#EXT-X-PART:DURATION=%.5f,URI=\"seg%" G_GUINT64_FORMAT
+                                        ".%u.m4s\"%s\n", part->duration / (gdouble) HLS_TIMESCALE,
+                                        seg->msn, i, part->independent ? ",INDEPENDENT=YES" : "");
+            }
+        }
+        if (seg->complete)
+            g_string_append_printf (m3u8, "#EXTINF:%.5f,\nseg%" G_GUINT64_FORMAT ".m4s\n",
+                                    seg->duration / (gdouble) HLS_TIMESCALE, seg->msn);
+    }
+
+    if (tail && !tail->complete)
+        g_string_append_printf (m3u8, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"seg%" G_GUINT64_FORMAT ".%u.m4s\"\n",
+                                tail->msn, tail->parts->len);
+    else
+        g_string_append_printf (m3u8, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"seg%" G_GUINT64_FORMAT ".0.m4s\"\n",
+                                hls_next_msn);
+
+    return g_string_free (m3u8, FALSE);
+}
+
+/* live.m3u8, initN.mp4, segM.m4s, segM.P.m4s */
+static gboolean
+hls_parse_request (const gchar * name, GHashTable * query, HlsRequest * req)
+{
+    const gchar *value;
+    gchar *end;
+
+    req->msn = G_MAXUINT64;
+    req->part = -1;
+
+    if (g_strcmp0 (name, "live.m3u8") == 0) {
+        req->type = HLS_REQUEST_PLAYLIST;
+        if (query && (value = (const gchar *) g_hash_table_lookup (query, "_HLS_msn"))) {
+            req->msn = g_ascii_strtoull (value, &end, 10);
+            if (*end)
+                return FALSE;
+            if ((value = (const gchar *) g_hash_table_lookup (query, "_HLS_part"))) {
+                req->part = (gint) g_ascii_strtoll (value, &end, 10);
+                if (*end || req->part < 0)
+                    return FALSE;
+            }
+        }
+        return TRUE;
+    }
+    if (g_str_has_prefix (name, "init") && g_str_has_suffix (name, ".mp4")) {
+        req->type = HLS_REQUEST_INIT;
+        req->init_id = (guint) g_ascii_strtoull (name + 4, &end, 10);
+        return g_strcmp0 (end, ".mp4") == 0;
+    }
+    if (g_str_has_prefix (name, "seg") && g_str_has_suffix (name, ".m4s")) {
+        req->msn = g_ascii_strtoull (name + 3, &end, 10);
+        if (end == name + 3)
+            return FALSE;
+        if (*end == '.' && g_ascii_isdigit (end[1])) {
+            req->type = HLS_REQUEST_PART;
+            req->part = (gint) g_ascii_strtoll (end + 1, &end, 10);
+        } else {
+            req->type = HLS_REQUEST_SEGMENT;
+        }
+        return g_strcmp0 (end, ".m4s") == 0;
+    }
+    return FALSE;
+}
+
+static gboolean
+hls_request_ready (const HlsRequest * req)
+{
+    if (req->type == HLS_REQUEST_PART || (req->type == HLS_REQUEST_PLAYLIST && req->msn != G_MAXUINT64))
+        return hls_available (req->msn, req->part);
+    return TRUE;
+}
+
+static void
+hls_respond (SoupMessage * msg, const HlsRequest * req)
+{
+    const gchar *type = "video/mp4";
+    HlsSegment *seg;
+    GBytes *bytes;
+    guint i;
+
+    soup_message_headers_replace (msg->response_headers, "Access-Control-Allow-Origin", "*");
+    switch (req->type) {
+    case HLS_REQUEST_PLAYLIST:{
+        gchar *playlist = hls_build_playlist ();
+
+        soup_message_headers_replace (msg->response_headers, "Cache-Control", "no-cache");
+        soup_message_set_response (msg, "application/vnd.apple.mpegurl", SOUP_MEMORY_TAKE,
+                                   playlist, strlen (playlist));
+        soup_message_set_status (msg, SOUP_STATUS_OK);
+        return;
+    }
+    case HLS_REQUEST_INIT:
+        bytes = (GBytes *) g_hash_table_lookup (hls_inits, GUINT_TO_POINTER (req->init_id));
+        if (!bytes)
+            break;
+        soup_message_headers_set_content_type (msg->response_headers, type, NULL);
+        soup_message_body_append_bytes (msg->response_body, bytes);
+        soup_message_set_status (msg, SOUP_STATUS_OK);
+        return;
+    case HLS_REQUEST_SEGMENT:
+        seg = hls_find_segment (req->msn);
+        if (!seg || !seg->complete)
+            break;
+        /* A segment is the concatenation of its parts */
+        soup_message_headers_set_content_type (msg->response_headers, type, NULL);
+        for (i = 0; i < seg->parts->len; i++)
+            soup_message_body_append_bytes (msg->response_body,
+                                            ((HlsPart *) g_ptr_array_index (seg->parts, i))->data);
+        soup_message_set_status (msg, SOUP_STATUS_OK);
+        return;
+    case HLS_REQUEST_PART:
+        seg = hls_find_segment (req->msn);
+        if (!seg || seg->parts->len <= (guint) req->part)
+            break;
+        soup_message_headers_set_content_type (msg->response_headers, type, NULL);
+        soup_message_body_append_bytes (msg->response_body,
+                                        ((HlsPart *) g_ptr_array_index (seg->parts, req->part))->data);
+        soup_message_set_status (msg, SOUP_STATUS_OK);
+        return;
+    }
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+}
+
+static void
+hls_waiter_finished_cb (SoupMessage * msg, gpointer user_data)
+{
+    /* The client went away while waiting */
+    hls_waiters = g_list_remove (hls_waiters, user_data);
+    g_free (user_data);
+}
+
+/* Answers the waiting requests that can be answered, 503 past their deadline */
+static gboolean
+hls_wake_waiters (gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time ();
+    GList *l, *next;
+
+    g_atomic_int_set (&hls_wake_queued, 0);
+
+    g_mutex_lock (&hls_lock);
+    for (l = hls_waiters; l; l = next) {
+        HlsWaiter *w = (HlsWaiter *) l->data;
+
+        next = l->next;
+        if (hls_request_ready (&w->request))
+            hls_respond (w->msg, &w->request);
+        else if (now >= w->deadline)
+            soup_message_set_status (w->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+        else
+            continue;
+        g_signal_handlers_disconnect_by_data (w->msg, w);
+        soup_server_unpause_message (hls_server, w->msg);
+        hls_waiters = g_list_delete_link (hls_waiters, l);
+        g_free (w);
+    }
+    g_mutex_unlock (&hls_lock);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+hls_timeout_cb (gpointer user_data)
+{
+    hls_wake_waiters (NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+hls_handler (SoupServer * server, SoupMessage * msg, const char *path, GHashTable * query,
+             SoupClientContext * client, gpointer user_data)
+{
+    HlsRequest req;
+    guint64 open_msn;
+
+    if (msg->method != SOUP_METHOD_GET) {
+        soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+    if (!g_str_has_prefix (path, "/hls/") || !hls_parse_request (path + strlen ("/hls/"), query, &req)) {
+        soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+        return;
+    }
+
+    g_mutex_lock (&hls_lock);
+    if (hls_request_ready (&req)) {
+        hls_respond (msg, &req);
+    } else {
+        HlsSegment *tail = (HlsSegment *) g_queue_peek_tail (&hls_segments);
+
+        open_msn = tail && !tail->complete ? tail->msn : hls_next_msn;
+        if (req.msn > open_msn + 2) {
+            /* Too far in the future to be waited for */
+            soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+        } else {
+            HlsWaiter *w = g_new0 (HlsWaiter, 1);
+
+            w->msg = msg;
+            w->request = req;
+            w->deadline = g_get_monotonic_time () + 3 * (gint64) hls_segment_ms * 1000;
+            hls_waiters = g_list_append (hls_waiters, w);
+            g_signal_connect (msg, "finished", G_CALLBACK (hls_waiter_finished_cb), w);
+            soup_server_pause_message (server, msg);
+        }
+    }
+    g_mutex_unlock (&hls_lock);
+}
+
+static gboolean
+hls_bus_cb (GstBus * bus, GstMessage * msg, gpointer user_data)
+{
+    if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gchar *debug = NULL;
+
+        gst_message_parse_error (msg, &error, &debug);
+        g_printerr ("HLS segmenter error: %s (%s)\n", error->message, GST_STR_NULL (debug));
+        g_clear_error (&error);
+        g_free (debug);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+GOptionGroup *
+cmaf_hls_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("hls", "Low latency HLS options", "Show low latency HLS options", NULL, NULL);
+    g_option_group_add_entries (group, hls_entries);
+    return group;
+}
+
+gboolean
+cmaf_hls_enabled (void)
+{
+    return hls_port > 0;
+}
+
+gboolean
+cmaf_hls_start (void)
+{
+    GError *error = NULL;
+    GstElement *sink;
+    GstBus *bus;
+
+    if (!cmaf_hls_enabled () || hls_pipeline)
+        return TRUE;
+    if (hls_part_ms <= 0 || hls_segment_ms < hls_part_ms) {
+        g_printerr ("--hls-segment-ms must be at least --hls-part-ms\n");
+        return FALSE;
+    }
+
+    hls_segmenter_setup ();
+
+    /* h264parse converts whatever the ingest parser negotiated to avc/au */
+    hls_pipeline = gst_parse_launch ("appsrc name=hlssrc is-live=true format=time ! h264parse ! "
+                                     "video/x-h264,stream-format=avc,alignment=au ! "
+                                     "appsink name=hlssink emit-signals=true sync=false", &error);
+    if (error) {
+        g_printerr ("Can't create the HLS segmenter: %s\n", error->message);
+        g_clear_error (&error);
+        if (hls_pipeline)
+            gst_object_unref (hls_pipeline);
+        hls_pipeline = NULL;
+        return FALSE;
+    }
+    hls_src = gst_bin_get_by_name (GST_BIN (hls_pipeline), "hlssrc");
+    g_object_set (hls_src, "max-bytes", (guint64) HLS_MAX_QUEUED_BYTES * 2, NULL);
+    hls_tap = compressed_tap_new (hls_src, HLS_MAX_QUEUED_BYTES, dropped_metric);
+    sink = gst_bin_get_by_name (GST_BIN (hls_pipeline), "hlssink");
+    g_signal_connect (sink, "new-sample", G_CALLBACK (hls_new_sample_cb), NULL);
+    gst_object_unref (sink);
+
+    bus = gst_pipeline_get_bus (GST_PIPELINE (hls_pipeline));
+    gst_bus_add_watch (bus, hls_bus_cb, NULL);
+    gst_object_unref (bus);
+    gst_element_set_state (hls_pipeline, GST_STATE_PLAYING);
+
+    hls_server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "rtsp2webrtc", NULL);
+    soup_server_add_handler (hls_server, "/hls", hls_handler, NULL, NULL);
+    if (!soup_server_listen_all (hls_server, hls_port, (SoupServerListenOptions) 0, &error)) {
+        g_printerr ("Can't serve HLS on port %d: %s\n", hls_port, error->message);
+        g_clear_error (&error);
+        cmaf_hls_stop ();
+        return FALSE;
+    }
+    hls_timeout_id = g_timeout_add_seconds (1, hls_timeout_cb, NULL);
+    g_print ("HLS at http://127.0.0.1:%d/hls/live.m3u8\n", hls_port);
+
+    return TRUE;
+}
+
+void
+cmaf_hls_stop (void)
+{
+    if (!hls_pipeline)
+        return;
+
+    if (hls_timeout_id)
+        g_source_remove (hls_timeout_id);
+    hls_timeout_id = 0;
+    if (hls_server) {
+        soup_server_disconnect (hls_server);
+        g_clear_object (&hls_server);
+    }
+    gst_element_set_state (hls_pipeline, GST_STATE_NULL);
+    g_clear_pointer (&hls_tap, compressed_tap_free);
+    gst_clear_object (&hls_src);
+    gst_clear_object (&hls_pipeline);
+
+    hls_segmenter_clear ();
+}
+
+void
+cmaf_hls_segmenter_start (gint part_ms, gint segment_ms)
+{
+    g_return_if_fail (!hls_pipeline && !hls_pending);
+
+    hls_part_ms = part_ms;
+    hls_segment_ms = segment_ms;
+    hls_segmenter_setup ();
+}
+
+void
+cmaf_hls_segmenter_push (GstSample * sample)
+{
+    hls_push_sample (sample);
+}
+
+gint
+cmaf_hls_segmenter_get_parts (guint64 msn, gboolean * complete)
+{
+    HlsSegment *seg;
+    gint parts = -1;
+
+    g_mutex_lock (&hls_lock);
+    seg = hls_find_segment (msn);
+    if (seg) {
+        parts = seg->parts->len;
+        if (complete)
+            *complete = seg->complete;
+    }
+    g_mutex_unlock (&hls_lock);
+    return parts;
+}
+
+GBytes *
+cmaf_hls_segmenter_get_part (guint64 msn, guint part, GBytes ** init, gboolean * independent)
+{
+    HlsSegment *seg;
+    GBytes *data = NULL;
+
+    g_mutex_lock (&hls_lock);
+    seg = hls_find_segment (msn);
+    if (seg && part < seg->parts->len) {
+        HlsPart *p = (HlsPart *) g_ptr_array_index (seg->parts, part);
+
+        data = g_bytes_ref (p->data);
+        if (independent)
+            *independent = p->independent;
+        if (init)
+            *init = g_bytes_ref ((GBytes *) g_hash_table_lookup (hls_inits, GUINT_TO_POINTER (seg->init_id)));
+    }
+    g_mutex_unlock (&hls_lock);
+    return data;
+}
+
+void
+cmaf_hls_segmenter_stop (void)
+{
+    g_return_if_fail (!hls_pipeline);
+
+    if (hls_pending)
+        hls_segmenter_clear ();
+}
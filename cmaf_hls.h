@@ -0,0 +1,85 @@
+//
+// Low latency HLS (CMAF) output of the RTSP ingest in rtsp2webrtc.
+//
+
+#ifndef CMAF_HLS_H
+#define CMAF_HLS_H
+
+#include <gst/gst.h>
+
+/*
+ * The camera's H.264 is taken from the parser inside the ingest's
+ * decodebin, before the decoder, and cut into fragmented MP4 partial
+ * segments without re-encoding. A segment starts on a keyframe once the
+ * previous one reached --hls-segment-ms; parts are cut at frame boundaries
+ * every --hls-part-ms. Recent segments are kept in memory and served with
+ * an LL-HLS playlist (blocking reload, preload hints) by a libsoup server:
+ *
+ *   http://HOST:PORT/hls/live.m3u8
+ */
+
+/*
+ * Returns the option group with the HLS options.
+ */
+GOptionGroup *cmaf_hls_get_option_group (void);
+
+/*
+ * @return TRUE if --hls-port was given.
+ */
+gboolean cmaf_hls_enabled (void);
+
+/*
+ * Starts the segmenter and the HTTP server on the default main context.
+ * @return FALSE if either can't be started.
+ */
+gboolean cmaf_hls_start (void);
+
+/*
+ * Feeds the compressed output of an H.264 parser to the segmenter. To be
+ * called for every parser the ingest plugs, e.g. after a reconnect.
+ * @param parser An h264parse element.
+ */
+void cmaf_hls_tap (GstElement * parser);
+
+void cmaf_hls_stop (void);
+
+/*
+ * The segmenter alone, without the tap, its pipeline and the HTTP server,
+ * for tests. Not to be used together with cmaf_hls_start().
+ */
+
+/*
+ * Starts an empty segmenter with the given part and segment targets.
+ */
+void cmaf_hls_segmenter_start (gint part_ms, gint segment_ms);
+
+/*
+ * Adds a frame as it leaves the segmenter's parser: H.264 avc/au with the
+ * codec_data in the sample's caps. A frame is only cut into a part once
+ * the next one arrived, its duration is not known before.
+ */
+void cmaf_hls_segmenter_push (GstSample * sample);
+
+/*
+ * @param complete Set to whether segment msn is finished, may be NULL.
+ * @return The number of parts of segment msn so far, -1 if it doesn't
+ * exist.
+ */
+gint cmaf_hls_segmenter_get_parts (guint64 msn, gboolean * complete);
+
+/*
+ * @param init Set to a new reference on the init segment the part needs,
+ * may be NULL.
+ * @param independent Set to whether the part starts on a keyframe, may be
+ * NULL.
+ * @return A new reference on the moof and mdat of the part, NULL if it
+ * doesn't exist.
+ */
+GBytes *cmaf_hls_segmenter_get_part (guint64 msn, guint part, GBytes ** init, gboolean * independent);
+
+/*
+ * Drops all segments and resets the sequence numbers.
+ */
+void cmaf_hls_segmenter_stop (void);
+
+#endif //CMAF_HLS_H
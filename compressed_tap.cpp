@@ -0,0 +1,90 @@
+//
+// Compressed video tap into an appsrc, see compressed_tap.h.
+//
+
+#include "compressed_tap.h"
+
+struct _CompressedTap
+{
+    GstElement *appsrc;
+    guint64 max_queued_bytes;
+    MetricsCounter *dropped;
+    /* Only touched by the ingest streaming thread */
+    GstCaps *caps;
+    gboolean resync;
+};
+
+CompressedTap *
+compressed_tap_new (GstElement * appsrc, guint64 max_queued_bytes, MetricsCounter * dropped)
+{
+    CompressedTap *tap = g_new0 (CompressedTap, 1);
+
+    tap->appsrc = (GstElement *) gst_object_ref (appsrc);
+    tap->max_queued_bytes = max_queued_bytes;
+    tap->dropped = dropped;
+    return tap;
+}
+
+static GstPadProbeReturn
+compressed_tap_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    CompressedTap *tap = (CompressedTap *) user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstEvent *event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+    GstCaps *caps = gst_pad_get_current_caps (pad);
+    const GstSegment *segment;
+    GstBuffer *copy;
+    guint64 level = 0;
+    GstFlowReturn ret;
+
+    if (!event || !caps)
+        goto done;
+    gst_event_parse_segment (event, &segment);
+
+    /* The consumer is behind, drop up to the next keyframe */
+    g_object_get (tap->appsrc, "current-level-bytes", &level, NULL);
+    if (level > tap->max_queued_bytes)
+        tap->resync = TRUE;
+    if (tap->resync) {
+        if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) || level > tap->max_queued_bytes / 2) {
+            metrics_counter_add (tap->dropped, 1);
+            goto done;
+        }
+        tap->resync = FALSE;
+    }
+
+    if (!tap->caps || !gst_caps_is_equal (tap->caps, caps)) {
+        gst_caps_replace (&tap->caps, caps);
+        g_object_set (tap->appsrc, "caps", caps, NULL);
+    }
+
+    copy = gst_buffer_copy (buffer);
+    GST_BUFFER_PTS (copy) = gst_segment_to_running_time (segment, GST_FORMAT_TIME, GST_BUFFER_PTS (buffer));
+    GST_BUFFER_DTS (copy) = gst_segment_to_running_time (segment, GST_FORMAT_TIME, GST_BUFFER_DTS (buffer));
+    g_signal_emit_by_name (tap->appsrc, "push-buffer", copy, &ret);
+    gst_buffer_unref (copy);
+
+done:
+    if (event)
+        gst_event_unref (event);
+    if (caps)
+        gst_caps_unref (caps);
+    return GST_PAD_PROBE_OK;
+}
+
+void
+compressed_tap_attach (CompressedTap * tap, GstElement * parser)
+{
+    GstPad *pad = gst_element_get_static_pad (parser, "src");
+
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, compressed_tap_probe_cb, tap, NULL);
+    gst_object_unref (pad);
+}
+
+void
+compressed_tap_free (CompressedTap * tap)
+{
+    gst_object_unref (tap->appsrc);
+    gst_clear_caps (&tap->caps);
+    g_free (tap);
+}
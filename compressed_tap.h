@@ -0,0 +1,42 @@
+//
+// Tap of the ingest's compressed video into the appsrc of a separate
+// pipeline, shared by the HLS output and the recorder.
+//
+
+#ifndef COMPRESSED_TAP_H
+#define COMPRESSED_TAP_H
+
+#include <gst/gst.h>
+
+#include "metrics.h"
+
+/*
+ * A probe on a parser's src pad passes every frame on with running time
+ * stamps, so they continue across ingest reconnects; the frame data itself
+ * is shared, not copied. The appsrc's caps follow the parser's. When the
+ * consumer falls behind and more than max_queued_bytes wait in the appsrc,
+ * frames are dropped up to the next keyframe that finds the level below
+ * half of that, the ingest never waits for the consumer.
+ */
+typedef struct _CompressedTap CompressedTap;
+
+/*
+ * @param appsrc The appsrc to push into, the tap holds a reference.
+ * @param max_queued_bytes Level of the appsrc at which a GOP is dropped.
+ * @param dropped Counts the dropped frames.
+ */
+CompressedTap *compressed_tap_new (GstElement * appsrc, guint64 max_queued_bytes, MetricsCounter * dropped);
+
+/*
+ * Feeds the tap from a parser. To be called for every parser the ingest
+ * plugs, e.g. after a reconnect; only one may run at a time.
+ * @param parser The parser, e.g. an h264parse element.
+ */
+void compressed_tap_attach (CompressedTap * tap, GstElement * parser);
+
+/*
+ * Frees the tap. The parsers it is attached to must be gone or stopped.
+ */
+void compressed_tap_free (CompressedTap * tap);
+
+#endif //COMPRESSED_TAP_H
@@ -0,0 +1,589 @@
+//
+// Disk ring buffer recorder and reader, see dvr.h.
+//
+
+#include "dvr.h"
+#include "compressed_tap.h"
+#include "metrics.h"
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEFAULT_DVR_SEGMENTS 64
+#define DEFAULT_DVR_SEGMENT_MB 64
+#define DEFAULT_DVR_INDEX_ENTRIES (256 * 1024)
+/* Compressed data waiting for the disk before the tap drops a GOP */
+#define DVR_MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+static gchar *dvr_dir = NULL;
+static gint dvr_segments = DEFAULT_DVR_SEGMENTS;
+static gint dvr_segment_mb = DEFAULT_DVR_SEGMENT_MB;
+static gint dvr_index_entries = DEFAULT_DVR_INDEX_ENTRIES;
+
+static GOptionEntry dvr_entries[] = {
+        {"dvr-dir", 0, 0, G_OPTION_ARG_FILENAME, &dvr_dir,
+                "Directory of the ingest's ring buffer recording", "DIR"},
+        {"dvr-segments", 0, 0, G_OPTION_ARG_INT, &dvr_segments,
+                "Recording files in the ring (default: 64)", "N"},
+        {"dvr-segment-size", 0, 0, G_OPTION_ARG_INT, &dvr_segment_mb,
+                "Size of every recording file in MB, allocated up front (default: 64)", "MB"},
+        {"dvr-index-entries", 0, 0, G_OPTION_ARG_INT, &dvr_index_entries,
+                "Keyframes the seek index holds (default: 262144)", "N"},
+        {NULL}
+};
+
+#define dvr_load(p) ((guint64) g_atomic_pointer_get ((p)))
+#define dvr_store(p, v) g_atomic_pointer_set ((p), (v))
+
+/*
+ * The index file, mapped by the writer and the readers.
+ */
+typedef struct
+{
+    gint fd;
+    DvrIndexHeader *header;
+    DvrIndexEntry *entries;
+    gsize size;
+} DvrIndex;
+
+static gsize
+dvr_index_size (guint64 capacity)
+{
+    return sizeof (DvrIndexHeader) + capacity * sizeof (DvrIndexEntry);
+}
+
+static gboolean
+dvr_index_map (DvrIndex * index, const gchar * path, gboolean writable, GError ** error)
+{
+    struct stat st;
+
+    index->fd = open (path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (index->fd < 0 || fstat (index->fd, &st) != 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
+                     g_strerror (errno));
+        return FALSE;
+    }
+    if (!writable) {
+        if ((gsize) st.st_size < sizeof (DvrIndexHeader)) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a recording index", path);
+            return FALSE;
+        }
+        index->size = st.st_size;
+    }
+    index->header = (DvrIndexHeader *) mmap (NULL, index->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                             MAP_SHARED, index->fd, 0);
+    if (index->header == MAP_FAILED) {
+        index->header = NULL;
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't map %s: %s", path,
+                     g_strerror (errno));
+        return FALSE;
+    }
+    index->entries = (DvrIndexEntry *) (index->header + 1);
+    return TRUE;
+}
+
+static void
+dvr_index_unmap (DvrIndex * index)
+{
+    if (index->header)
+        munmap (index->header, index->size);
+    if (index->fd >= 0)
+        close (index->fd);
+    index->header = NULL;
+    index->fd = -1;
+}
+
+static gchar *
+dvr_segment_path (const gchar * dir, guint segment)
+{
+    gchar name[32];
+
+    g_snprintf (name, sizeof (name), "seg%04u.dvr", segment);
+    return g_build_filename (dir, name, NULL);
+}
+
+/*
+ * Writer. One per process, fed from the recording pipeline's appsink
+ * thread.
+ */
+typedef struct
+{
+    DvrIndex index;
+    gint *fds;
+    guint n_segments;
+    guint64 segment_size;
+    guint segment;
+    guint64 offset;
+    gboolean started;           /* writing into segment */
+    gint64 base;                /* wall clock minus running time */
+} DvrWriter;
+
+static DvrWriter writer = { {-1, NULL, NULL, 0}, NULL, 0, 0, 0, 0, FALSE, G_MININT64 };
+static GstElement *rec_pipeline = NULL;
+static GstElement *rec_src = NULL;
+static CompressedTap *rec_tap = NULL;
+
+static MetricsCounter *written_metric;
+static MetricsCounter *dropped_metric;
+
+/*
+ * Moves to the next file of the ring. Readers learn from the generation
+ * that it is being overwritten, and from the tail that its keyframes are
+ * gone.
+ */
+static void
+dvr_writer_next_segment (void)
+{
+    DvrIndexHeader *h = writer.index.header;
+    guint64 tail = dvr_load (&h->tail), head = dvr_load (&h->head);
+
+    writer.segment = (guint) (dvr_load (&h->write_segment) % writer.n_segments);
+    dvr_store (&h->seg_gen[writer.segment], dvr_load (&h->seg_gen[writer.segment]) + 1);
+    while (tail < head && writer.index.entries[tail % h->capacity].segment == writer.segment)
+        tail++;
+    dvr_store (&h->tail, tail);
+    dvr_store (&h->write_segment, dvr_load (&h->write_segment) + 1);
+    writer.offset = 0;
+    writer.started = TRUE;
+}
+
+static void
+dvr_writer_write (gint64 time, GstBuffer * buffer, gboolean keyframe)
+{
+    DvrIndexHeader *h = writer.index.header;
+    gsize size = gst_buffer_get_size (buffer);
+    guint64 need = sizeof (DvrFrame) + size;
+    guint64 seq = dvr_load (&h->next_seq);
+    DvrFrame frame;
+    GstMapInfo map;
+    gboolean ok;
+
+    /* Room for the record and an end marker */
+    if (need + sizeof (DvrFrame) > writer.segment_size) {
+        metrics_counter_add (dropped_metric, 1);
+        return;
+    }
+    /* A continued recording starts in a fresh file as well */
+    if (!writer.started || writer.offset + need + sizeof (DvrFrame) > writer.segment_size) {
+        if (writer.started) {
+            memset (&frame, 0, sizeof (frame));
+            if (pwrite (writer.fds[writer.segment], &frame, sizeof (frame), writer.offset) != sizeof (frame))
+                g_printerr ("DVR: can't end segment %u: %s\n", writer.segment, g_strerror (errno));
+        }
+        dvr_writer_next_segment ();
+    }
+
+    frame.size = (guint32) size;
+    frame.flags = keyframe ? DVR_FRAME_KEYFRAME : 0;
+    frame.seq = seq;
+    frame.time = time;
+    gst_buffer_map (buffer, &map, GST_MAP_READ);
+    ok = pwrite (writer.fds[writer.segment], &frame, sizeof (frame), writer.offset) == sizeof (frame)
+         && pwrite (writer.fds[writer.segment], map.data, map.size, writer.offset + sizeof (frame)) == (gssize) map.size;
+    gst_buffer_unmap (buffer, &map);
+    if (!ok) {
+        g_printerr ("DVR: write to segment %u failed: %s\n", writer.segment, g_strerror (errno));
+        metrics_counter_add (dropped_metric, 1);
+        return;
+    }
+
+    /* Published only once the data is in the file */
+    dvr_store (&h->next_seq, seq + 1);
+    if (keyframe) {
+        guint64 head = dvr_load (&h->head);
+        DvrIndexEntry *entry = &writer.index.entries[head % h->capacity];
+
+        if (head - dvr_load (&h->tail) >= h->capacity)
+            dvr_store (&h->tail, dvr_load (&h->tail) + 1);
+        entry->time = time;
+        entry->seq = seq;
+        entry->segment = writer.segment;
+        entry->offset = (guint32) writer.offset;
+        dvr_store (&h->head, head + 1);
+    }
+    writer.offset += need;
+    metrics_counter_add (written_metric, 1);
+}
+
+/*
+ * Opens or creates the recording. An existing recording with the same
+ * geometry is continued in its next file, anything else starts over.
+ */
+static gboolean
+dvr_writer_open (GError ** error)
+{
+    guint64 capacity = (guint64) MAX (dvr_index_entries, 16);
+    gchar *path;
+    DvrIndexHeader *h;
+    struct stat st;
+    gboolean resume;
+    guint i;
+
+    writer.n_segments = (guint) CLAMP (dvr_segments, 2, DVR_MAX_SEGMENTS);
+    writer.segment_size = (guint64) MAX (dvr_segment_mb, 1) * 1024 * 1024;
+    if (writer.segment_size > G_MAXUINT32) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "--dvr-segment-size must be below 4096 MB");
+        return FALSE;
+    }
+    if (g_mkdir_with_parents (dvr_dir, 0755) != 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create %s: %s", dvr_dir,
+                     g_strerror (errno));
+        return FALSE;
+    }
+
+    path = g_build_filename (dvr_dir, "dvr.index", NULL);
+    writer.index.size = dvr_index_size (capacity);
+    resume = g_stat (path, &st) == 0 && (gsize) st.st_size == writer.index.size;
+    if (!dvr_index_map (&writer.index, path, TRUE, error)) {
+        g_free (path);
+        return FALSE;
+    }
+    g_free (path);
+    h = writer.index.header;
+    if (resume)
+        resume = memcmp (h->magic, DVR_INDEX_MAGIC, 8) == 0 && h->version == DVR_INDEX_VERSION
+                 && h->n_segments == writer.n_segments && h->segment_size == writer.segment_size
+                 && h->capacity == capacity;
+    if (!resume) {
+        if (ftruncate (writer.index.fd, writer.index.size) != 0) {
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't size the index: %s",
+                         g_strerror (errno));
+            return FALSE;
+        }
+        memset (h, 0, sizeof (DvrIndexHeader));
+        memcpy (h->magic, DVR_INDEX_MAGIC, 8);
+        h->version = DVR_INDEX_VERSION;
+        h->n_segments = writer.n_segments;
+        h->segment_size = writer.segment_size;
+        h->capacity = capacity;
+    }
+
+    writer.fds = g_new (gint, writer.n_segments);
+    for (i = 0; i < writer.n_segments; i++)
+        writer.fds[i] = -1;
+    for (i = 0; i < writer.n_segments; i++) {
+        gchar *seg_path = dvr_segment_path (dvr_dir, i);
+        gint err;
+
+        writer.fds[i] = open (seg_path, O_RDWR | O_CREAT, 0644);
+        /* The disk space is taken up front, the ring never grows */
+        err = writer.fds[i] < 0 ? errno : posix_fallocate (writer.fds[i], 0, writer.segment_size);
+        if (err != 0) {
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (err), "Can't allocate %s: %s",
+                         seg_path, g_strerror (err));
+            g_free (seg_path);
+            return FALSE;
+        }
+        g_free (seg_path);
+    }
+
+    g_print ("Recording to %s, %u x %u MB%s\n", dvr_dir, writer.n_segments, (guint) (writer.segment_size >> 20),
+             resume ? ", continuing the previous recording" : "");
+    return TRUE;
+}
+
+static void
+dvr_writer_close (void)
+{
+    guint i;
+
+    for (i = 0; writer.fds && i < writer.n_segments; i++) {
+        if (writer.fds[i] >= 0)
+            close (writer.fds[i]);
+    }
+    g_clear_pointer (&writer.fds, g_free);
+    dvr_index_unmap (&writer.index);
+    writer.started = FALSE;
+}
+
+static GstFlowReturn
+rec_new_sample_cb (GstElement * sink, gpointer user_data)
+{
+    GstSample *sample = NULL;
+    GstBuffer *buffer;
+
+    g_signal_emit_by_name (sink, "pull-sample", &sample);
+    if (!sample)
+        return GST_FLOW_EOS;
+
+    buffer = gst_sample_get_buffer (sample);
+    if (GST_BUFFER_PTS_IS_VALID (buffer)) {
+        /* Running time keeps going across ingest reconnects, one mapping
+         * to the wall clock is enough */
+        if (writer.base == G_MININT64)
+            writer.base = g_get_real_time () * 1000 - (gint64) GST_BUFFER_PTS (buffer);
+        dvr_writer_write (writer.base + (gint64) GST_BUFFER_PTS (buffer), buffer,
+                          !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+    }
+    gst_sample_unref (sample);
+
+    return GST_FLOW_OK;
+}
+
+GOptionGroup *
+dvr_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("dvr", "Ring buffer recording options", "Show ring buffer recording options",
+                                NULL, NULL);
+    g_option_group_add_entries (group, dvr_entries);
+    return group;
+}
+
+const gchar *
+dvr_get_dir (void)
+{
+    return dvr_dir;
+}
+
+gboolean
+dvr_record_start (void)
+{
+    GError *error = NULL;
+    GstElement *sink;
+
+    if (!dvr_dir || rec_pipeline)
+        return TRUE;
+
+    if (!dvr_writer_open (&error)) {
+        g_printerr ("Can't record: %s\n", error->message);
+        g_clear_error (&error);
+        dvr_writer_close ();
+        return FALSE;
+    }
+    written_metric = metrics_counter_new ("dvr_frames_written_total", "Frames recorded to the ring buffer");
+    dropped_metric = metrics_counter_new ("dvr_frames_dropped_total",
+                                          "Ingest frames the recorder could not keep up with");
+
+    /* Byte-stream with SPS/PPS on every keyframe, so playback can start at
+     * any indexed keyframe */
+    rec_pipeline = gst_parse_launch ("appsrc name=recsrc is-live=true format=time ! h264parse config-interval=-1 ! "
+                                     "video/x-h264,stream-format=byte-stream,alignment=au ! "
+                                     "appsink name=recsink emit-signals=true sync=false", &error);
+    if (error) {
+        g_printerr ("Can't create the recorder: %s\n", error->message);
+        g_clear_error (&error);
+        if (rec_pipeline)
+            gst_object_unref (rec_pipeline);
+        rec_pipeline = NULL;
+        dvr_writer_close ();
+        return FALSE;
+    }
+    rec_src = gst_bin_get_by_name (GST_BIN (rec_pipeline), "recsrc");
+    g_object_set (rec_src, "max-bytes", (guint64) DVR_MAX_QUEUED_BYTES * 2, NULL);
+    /* A dropped GOP rather than a stalled ingest when the disk is slow */
+    rec_tap = compressed_tap_new (rec_src, DVR_MAX_QUEUED_BYTES, dropped_metric);
+    sink = gst_bin_get_by_name (GST_BIN (rec_pipeline), "recsink");
+    g_signal_connect (sink, "new-sample", G_CALLBACK (rec_new_sample_cb), NULL);
+    gst_object_unref (sink);
+    gst_element_set_state (rec_pipeline, GST_STATE_PLAYING);
+
+    return TRUE;
+}
+
+void
+dvr_record_tap (GstElement * parser)
+{
+    if (rec_tap)
+        compressed_tap_attach (rec_tap, parser);
+}
+
+void
+dvr_record_stop (void)
+{
+    if (!rec_pipeline)
+        return;
+    gst_element_set_state (rec_pipeline, GST_STATE_NULL);
+    g_clear_pointer (&rec_tap, compressed_tap_free);
+    gst_clear_object (&rec_src);
+    gst_clear_object (&rec_pipeline);
+    dvr_writer_close ();
+}
+
+/*
+ * Reader, any number per process and across processes.
+ */
+struct _DvrReader
+{
+    DvrIndex index;
+    gchar *dir;
+    gint *fds;                  /* opened on first use */
+    guint n_segments;
+    guint64 segment_size;
+    guint segment;
+    guint64 offset;
+    guint64 seq;
+    guint64 gen;
+};
+
+DvrReader *
+dvr_reader_open (const gchar * dir, GError ** error)
+{
+    DvrReader *reader = g_new0 (DvrReader, 1);
+    gchar *path = g_build_filename (dir, "dvr.index", NULL);
+    DvrIndexHeader *h;
+    guint i;
+
+    reader->index.fd = -1;
+    if (!dvr_index_map (&reader->index, path, FALSE, error)) {
+        g_free (path);
+        dvr_reader_close (reader);
+        return NULL;
+    }
+    h = reader->index.header;
+    if (memcmp (h->magic, DVR_INDEX_MAGIC, 8) != 0 || h->version != DVR_INDEX_VERSION
+        || h->n_segments == 0 || h->n_segments > DVR_MAX_SEGMENTS
+        || reader->index.size < dvr_index_size (h->capacity)) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a recording index", path);
+        g_free (path);
+        dvr_reader_close (reader);
+        return NULL;
+    }
+    g_free (path);
+
+    reader->dir = g_strdup (dir);
+    reader->n_segments = h->n_segments;
+    reader->segment_size = h->segment_size;
+    reader->fds = g_new (gint, reader->n_segments);
+    for (i = 0; i < reader->n_segments; i++)
+        reader->fds[i] = -1;
+
+    return reader;
+}
+
+gboolean
+dvr_reader_seek (DvrReader * reader, gint64 time, gint64 * keyframe_time)
+{
+    DvrIndexHeader *h = reader->index.header;
+    guint attempt;
+
+    /* The writer may drop the entry we picked meanwhile, pick again */
+    for (attempt = 0; attempt < 3; attempt++) {
+        guint64 tail = dvr_load (&h->tail), head = dvr_load (&h->head);
+        guint64 lo, hi;
+        DvrIndexEntry entry;
+
+        if (tail >= head)
+            return FALSE;
+
+        /* Last entry at or before time, entries are in time order */
+        lo = tail;
+        hi = head - 1;
+        if (reader->index.entries[lo % h->capacity].time <= time) {
+            while (lo < hi) {
+                guint64 mid = lo + (hi - lo + 1) / 2;
+
+                if (reader->index.entries[mid % h->capacity].time <= time)
+                    lo = mid;
+                else
+                    hi = mid - 1;
+            }
+        }
+        entry = reader->index.entries[lo % h->capacity];
+        if (entry.segment >= reader->n_segments)
+            continue;
+        reader->gen = dvr_load (&h->seg_gen[entry.segment]);
+        if (dvr_load (&h->tail) > lo)
+            continue;
+
+        reader->segment = entry.segment;
+        reader->offset = entry.offset;
+        reader->seq = entry.seq;
+        if (keyframe_time)
+            *keyframe_time = entry.time;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static gint
+dvr_reader_fd (DvrReader * reader, guint segment)
+{
+    if (reader->fds[segment] < 0) {
+        gchar *path = dvr_segment_path (reader->dir, segment);
+
+        reader->fds[segment] = open (path, O_RDONLY);
+        g_free (path);
+    }
+    return reader->fds[segment];
+}
+
+GstBuffer *
+dvr_reader_next (DvrReader * reader, gint64 * time, gboolean * lost)
+{
+    DvrIndexHeader *h = reader->index.header;
+    DvrFrame frame;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gssize n;
+
+    *lost = FALSE;
+    for (;;) {
+        /* Not written yet, the reader caught up with the recording */
+        if (reader->seq >= dvr_load (&h->next_seq))
+            return NULL;
+        if (dvr_load (&h->seg_gen[reader->segment]) != reader->gen) {
+            *lost = TRUE;
+            return NULL;
+        }
+
+        if (reader->offset + sizeof (frame) > reader->segment_size
+            || pread (dvr_reader_fd (reader, reader->segment), &frame, sizeof (frame), reader->offset)
+               != sizeof (frame)) {
+            *lost = TRUE;
+            return NULL;
+        }
+        if (frame.size == 0) {
+            /* End of this file, the recording continues in the next one */
+            reader->segment = (reader->segment + 1) % reader->n_segments;
+            reader->offset = 0;
+            reader->gen = dvr_load (&h->seg_gen[reader->segment]);
+            continue;
+        }
+        if (frame.seq != reader->seq || reader->offset + sizeof (frame) + frame.size > reader->segment_size) {
+            *lost = TRUE;
+            return NULL;
+        }
+        break;
+    }
+
+    buffer = gst_buffer_new_allocate (NULL, frame.size, NULL);
+    gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+    n = pread (reader->fds[reader->segment], map.data, frame.size, reader->offset + sizeof (frame));
+    gst_buffer_unmap (buffer, &map);
+    /* Overwritten while we read it */
+    if (n != (gssize) frame.size || dvr_load (&h->seg_gen[reader->segment]) != reader->gen) {
+        gst_buffer_unref (buffer);
+        *lost = TRUE;
+        return NULL;
+    }
+
+    if (!(frame.flags & DVR_FRAME_KEYFRAME))
+        GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    reader->offset += sizeof (frame) + frame.size;
+    reader->seq++;
+    *time = frame.time;
+
+    return buffer;
+}
+
+void
+dvr_reader_close (DvrReader * reader)
+{
+    guint i;
+
+    for (i = 0; reader->fds && i < reader->n_segments; i++) {
+        if (reader->fds[i] >= 0)
+            close (reader->fds[i]);
+    }
+    g_free (reader->fds);
+    dvr_index_unmap (&reader->index);
+    g_free (reader->dir);
+    g_free (reader);
+}
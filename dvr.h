@@ -0,0 +1,114 @@
+//
+// Disk ring buffer recorder of the RTSP ingest (rtsp2webrtc) and its
+// reader, used by the RTSP server binaries for playback.
+//
+
+#ifndef DVR_H
+#define DVR_H
+
+#include <gst/gst.h>
+
+/*
+ * A recording directory holds --dvr-segments files of --dvr-segment-size
+ * bytes, written round robin, so the disk use is fixed and the oldest
+ * footage is overwritten. Each file is a sequence of records, a DvrFrame
+ * followed by one H.264 access unit in byte-stream format (with SPS/PPS on
+ * every keyframe); a record of size 0 ends a file early.
+ *
+ * dvr.index is memory mapped by the writer and every reader. It holds a
+ * ring of DvrIndexEntry, one per keyframe in time order, so seeking to a
+ * wall clock time is a binary search. Entries pointing into a file are
+ * dropped before the file is overwritten, and its generation is bumped so
+ * a reader still inside it notices.
+ *
+ * Only the 64 bit header fields published by the writer (head, tail,
+ * next_seq, seg_gen) are shared between processes, through atomics.
+ */
+
+#define DVR_INDEX_MAGIC "GSTDVR01"
+#define DVR_INDEX_VERSION 1
+#define DVR_MAX_SEGMENTS 4096
+
+typedef struct
+{
+    gchar magic[8];
+    guint32 version;
+    guint32 n_segments;
+    guint64 segment_size;
+    guint64 capacity;           /* index entries */
+    guint64 head;               /* entries ever written */
+    guint64 tail;               /* oldest valid entry */
+    guint64 next_seq;           /* frames ever written */
+    guint64 write_segment;      /* segments ever started */
+    guint64 seg_gen[DVR_MAX_SEGMENTS];
+} DvrIndexHeader;
+
+typedef struct
+{
+    gint64 time;                /* wall clock, ns since the epoch */
+    guint64 seq;
+    guint32 segment;
+    guint32 offset;
+} DvrIndexEntry;
+
+typedef struct
+{
+    guint32 size;
+    guint32 flags;              /* DVR_FRAME_KEYFRAME */
+    guint64 seq;
+    gint64 time;
+} DvrFrame;
+
+#define DVR_FRAME_KEYFRAME 1
+
+/*
+ * Returns the option group with the recording options, --dvr-dir is also
+ * used by the readers.
+ */
+GOptionGroup *dvr_get_option_group (void);
+
+/*
+ * @return The recording directory given by --dvr-dir or NULL.
+ */
+const gchar *dvr_get_dir (void);
+
+/*
+ * Starts the recorder, to be fed by dvr_record_tap().
+ * @return FALSE if the recording directory can't be set up.
+ */
+gboolean dvr_record_start (void);
+
+/*
+ * Records the compressed output of an H.264 parser of the ingest.
+ * @param parser An h264parse element.
+ */
+void dvr_record_tap (GstElement * parser);
+
+void dvr_record_stop (void);
+
+typedef struct _DvrReader DvrReader;
+
+DvrReader *dvr_reader_open (const gchar * dir, GError ** error);
+
+/*
+ * Positions the reader on the last keyframe at or before time, or on the
+ * oldest one if time is older than the recording.
+ * @param time Wall clock time in ns since the epoch.
+ * @param keyframe_time Returns the wall clock time of that keyframe, may
+ * be NULL.
+ * @return FALSE if nothing is recorded.
+ */
+gboolean dvr_reader_seek (DvrReader * reader, gint64 time, gint64 * keyframe_time);
+
+/*
+ * Reads the next frame.
+ * @param time Returns the frame's wall clock time.
+ * @param lost Set to TRUE when the frame was overwritten before it could
+ * be read, the reader has to seek again.
+ * @return The access unit, or NULL if none is available (yet).
+ */
+GstBuffer *dvr_reader_next (DvrReader * reader, gint64 * time, gboolean * lost);
+
+void dvr_reader_close (DvrReader * reader);
+
+#endif //DVR_H
@@ -3,127 +3,1356 @@
 //
 
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <ges/ges.h>
 #include <gst/pbutils/gstdiscoverer.h>
 #include <gst/pbutils/encoding-profile.h>
 
+typedef struct _RenderJob RenderJob;
+
 static void
-bus_message_cb (GstBus * bus, GstMessage * message, GMainLoop * mainloop);
+bus_message_cb (GstBus * bus, GstMessage * message, RenderJob * job);
+
+static GstEncodingProfile *make_profile_from_info (GstDiscovererInfo * info, gboolean encode);
+
+#define DEFAULT_MAX_DISCOVERY 4
+#define DEFAULT_BATCH_JOBS 4
+#define DEFAULT_PROGRESS_INTERVAL 1
+
+static gint max_discovery = DEFAULT_MAX_DISCOVERY;
+static gchar *discovery_cache_path = NULL;
+static gboolean no_discovery_cache = FALSE;
+static gboolean strict = FALSE;
+static gint segments = 0;
+static gint render_jobs = 0;
+static gchar *batch_file = NULL;
+static gint batch_jobs = DEFAULT_BATCH_JOBS;
+static gint progress_interval = DEFAULT_PROGRESS_INTERVAL;
+static gchar **inputs = NULL;
+
+static GOptionEntry entries[] = {
+        {"max-discovery", 'j', 0, G_OPTION_ARG_INT, &max_discovery,
+                "Maximum number of inputs discovered at the same time (default: 4)", "N"},
+        {"discovery-cache", 0, 0, G_OPTION_ARG_FILENAME, &discovery_cache_path,
+                "Discovery cache file (default: $XDG_CACHE_HOME/gsteditor/discovery.cache)", "FILE"},
+        {"no-discovery-cache", 0, 0, G_OPTION_ARG_NONE, &no_discovery_cache,
+                "Always discover the inputs", NULL},
+        {"strict", 0, 0, G_OPTION_ARG_NONE, &strict,
+                "Fail instead of re-encoding clips that don't match the output format", NULL},
+        {"segments", 's', 0, G_OPTION_ARG_INT, &segments,
+                "When clips have to be re-encoded, encode them as about N segments in parallel", "N"},
+        {"render-jobs", 0, 0, G_OPTION_ARG_INT, &render_jobs,
+                "Maximum number of segments rendered at the same time, over all jobs (default: number of CPUs)", "N"},
+        {"batch", 'b', 0, G_OPTION_ARG_FILENAME, &batch_file,
+                "Run the jobs listed in FILE, one '<output uri> <list of files>' per line", "FILE"},
+        {"jobs", 0, 0, G_OPTION_ARG_INT, &batch_jobs,
+                "Maximum number of batch jobs running at the same time (default: 4)", "N"},
+        {"progress", 'p', 0, G_OPTION_ARG_INT, &progress_interval,
+                "Seconds between render progress reports, 0 to disable (default: 1)", "SECONDS"},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL,
+                "<output uri> <list of files>"},
+        {NULL}
+};
+
+/*
+ * One concatenation, an output and its inputs. A run without --batch is a
+ * batch of one job.
+ */
+typedef struct
+{
+    guint index;
+    gchar *output_uri;
+    gchar **input_uris;
+    GESAsset **assets;
+    guint assetsCount;
+    guint assetsLoaded;
+    guint assetsFailed;
+    guint64 input_bytes;
+    GstClockTime duration;
+    gint64 start_time;
+    RenderJob *output_job;
+    /* Segmented rendering, info is the output format, owned by its clip */
+    GstDiscovererInfo *info;
+    gboolean *reencode_clips;
+    guint segments_count;
+    guint *segment_clips;
+    RenderJob **segment_jobs;
+    guint segments_started;
+    guint segments_running;
+    guint segments_done;
+    guint segments_failed;
+    gchar *segment_dir;
+    gchar **segment_uris;
+} Concat;
+
+typedef struct
+{
+    Concat *concat;
+    guint index;
+} AssetRequest;
+
+static GMainLoop *mainloop = NULL;
+static GPtrArray *concats = NULL;
+static guint concatsStarted = 0;
+static guint concatsRunning = 0;
+static guint concatsDone = 0;
+static guint concatsFailed = 0;
+static guint segmentsRunning = 0;
+static GstClockTime batch_duration = 0;
+static GQueue assetRequests = G_QUEUE_INIT;
+static guint assetsPending = 0;
+
+/*
+ * Discovery cache. One group per URI holding the file size and mtime it
+ * was discovered with and the serialized GstDiscovererInfo (caps,
+ * duration, container and streams). An entry only counts when size and
+ * mtime still match. Lookups can come from a discoverer thread.
+ */
+static GKeyFile *discovery_cache = NULL;
+static GMutex discovery_cache_lock;
+static gboolean discovery_cache_dirty = FALSE;
+static guint discovery_cache_hits = 0;
+
+static gboolean
+uri_file_stat (const gchar * uri, guint64 * size, gint64 * mtime)
+{
+    GFile *file = g_file_new_for_uri (uri);
+    GFileInfo *finfo = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                          G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                          G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                                          G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    g_object_unref (file);
+    if (!finfo)
+        return FALSE;
+    *size = g_file_info_get_size (finfo);
+    *mtime = g_file_info_get_attribute_uint64 (finfo, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+             g_file_info_get_attribute_uint32 (finfo, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+    g_object_unref (finfo);
+    return TRUE;
+}
 
-static GstEncodingProfile *make_profile_from_info (GstDiscovererInfo * info);
+static void
+discovery_cache_load (void)
+{
+    GError *error = NULL;
 
-GESPipeline *pipeline = NULL;
-gchar *output_uri = NULL;
-guint assetsCount = 0;
-guint assetsLoaded = 0;
+    if (!discovery_cache_path)
+        discovery_cache_path = g_build_filename (g_get_user_cache_dir (), "gsteditor",
+                                                 "discovery.cache", NULL);
+    discovery_cache = g_key_file_new ();
+    if (!g_key_file_load_from_file (discovery_cache, discovery_cache_path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_printerr ("Ignoring discovery cache %s: %s\n", discovery_cache_path, error->message);
+        g_clear_error (&error);
+    }
+}
 
 static void
-asset_loaded_cb (GObject * source_object, GAsyncResult * res,
-                 GMainLoop * mainloop)
+discovery_cache_save (void)
 {
     GError *error = NULL;
+    gchar *dir;
 
-    GESUriClipAsset *mfs =
-            GES_URI_CLIP_ASSET (ges_asset_request_finish (res, &error));
+    if (!discovery_cache || !discovery_cache_dirty)
+        return;
+    dir = g_path_get_dirname (discovery_cache_path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+    if (!g_key_file_save_to_file (discovery_cache, discovery_cache_path, &error)) {
+        g_printerr ("Can't save discovery cache %s: %s\n", discovery_cache_path, error->message);
+        g_clear_error (&error);
+    }
+}
 
-    if (error) {
-        GST_WARNING ("error creating asseti %s", error->message);
+/*
+ * @return The cached info for uri, or NULL when it is missing or the file
+ * changed since it was discovered.
+ */
+static GstDiscovererInfo *
+discovery_cache_lookup (const gchar * uri)
+{
+    GstDiscovererInfo *info = NULL;
+    guint64 size;
+    gint64 mtime;
+    gchar *type, *data;
+
+    if (!discovery_cache || !uri_file_stat (uri, &size, &mtime))
+        return NULL;
+
+    g_mutex_lock (&discovery_cache_lock);
+    if (g_key_file_get_uint64 (discovery_cache, uri, "size", NULL) == size &&
+        g_key_file_get_int64 (discovery_cache, uri, "mtime", NULL) == mtime &&
+        (type = g_key_file_get_string (discovery_cache, uri, "type", NULL))) {
+        data = g_key_file_get_string (discovery_cache, uri, "info", NULL);
+        if (data && g_variant_type_string_is_valid (type)) {
+            gsize len;
+            guchar *bytes = g_base64_decode (data, &len);
+            GVariant *variant = g_variant_new_from_data (G_VARIANT_TYPE (type), bytes, len,
+                                                         FALSE, g_free, bytes);
+
+            info = gst_discoverer_info_from_variant (g_variant_ref_sink (variant));
+            g_variant_unref (variant);
+        }
+        g_free (data);
+        g_free (type);
+    }
+    if (info)
+        discovery_cache_hits++;
+    g_mutex_unlock (&discovery_cache_lock);
+
+    return info;
+}
+
+static void
+discovery_cache_store (const gchar * uri, GstDiscovererInfo * info)
+{
+    guint64 size;
+    gint64 mtime;
+    GVariant *variant;
+    gchar *data;
+
+    if (!discovery_cache || !uri_file_stat (uri, &size, &mtime))
+        return;
+
+    g_mutex_lock (&discovery_cache_lock);
+    if (g_key_file_get_uint64 (discovery_cache, uri, "size", NULL) == size &&
+        g_key_file_get_int64 (discovery_cache, uri, "mtime", NULL) == mtime) {
+        g_mutex_unlock (&discovery_cache_lock);
+        return;
+    }
+    g_mutex_unlock (&discovery_cache_lock);
+
+    variant = gst_discoverer_info_to_variant (info, GST_DISCOVERER_SERIALIZE_ALL);
+    if (!variant)
+        return;
+    data = g_base64_encode ((const guchar *) g_variant_get_data (variant), g_variant_get_size (variant));
+
+    g_mutex_lock (&discovery_cache_lock);
+    g_key_file_set_uint64 (discovery_cache, uri, "size", size);
+    g_key_file_set_int64 (discovery_cache, uri, "mtime", mtime);
+    g_key_file_set_string (discovery_cache, uri, "type", g_variant_get_type_string (variant));
+    g_key_file_set_string (discovery_cache, uri, "info", data);
+    discovery_cache_dirty = TRUE;
+    g_mutex_unlock (&discovery_cache_lock);
+
+    g_free (data);
+    g_variant_unref (variant);
+}
+
+#if GES_VERSION_MAJOR > 1 || (GES_VERSION_MAJOR == 1 && GES_VERSION_MINOR >= 24)
+/*
+ * GES asks before running its discoverer, a cache hit skips discovery of
+ * that input entirely.
+ */
+static GstDiscovererInfo *
+load_serialized_info_cb (GESDiscovererManager * manager, const gchar * uri, gpointer user_data)
+{
+    return discovery_cache_lookup (uri);
+}
+#endif
+
+/*
+ * The cache is only read through GES' load-serialized-info signal. Without
+ * it every input is discovered anyway, so no cache is written either.
+ */
+static void
+discovery_cache_setup (void)
+{
+#if GES_VERSION_MAJOR > 1 || (GES_VERSION_MAJOR == 1 && GES_VERSION_MINOR >= 24)
+    GESDiscovererManager *manager = ges_discoverer_manager_get_default ();
+
+    if (g_signal_lookup ("load-serialized-info", G_OBJECT_TYPE (manager))) {
+        discovery_cache_load ();
+        g_signal_connect (manager, "load-serialized-info", G_CALLBACK (load_serialized_info_cb), NULL);
+        return;
+    }
+#endif
+    g_printerr ("WARNING: this GES can't load discovery results (needs 1.24), "
+                "the discovery cache is disabled\n");
+}
+
+static void
+asset_loaded_cb (GObject * source_object, GAsyncResult * res, gpointer user_data);
+
+/*
+ * Starts discovery of queued inputs, of all batch jobs, while fewer than
+ * --max-discovery are in flight, so thousands of clips don't all hold
+ * file handles and discoverer state at the same time.
+ */
+static void
+request_next_assets (void)
+{
+    AssetRequest *req;
+
+    while (assetsPending < (guint) max_discovery &&
+           (req = (AssetRequest *) g_queue_pop_head (&assetRequests))) {
+        g_print ("Loading asset %s \n", req->concat->input_uris[req->index]);
+        ges_asset_request_async (GES_TYPE_URI_CLIP, req->concat->input_uris[req->index], NULL,
+                                 asset_loaded_cb, req);
+        assetsPending++;
+    }
+}
+
+/*
+ * @return A timeline with the clips back to back, in the given order.
+ */
+static GESTimeline *
+build_timeline (GESAsset ** clips, guint n)
+{
+    GESTimeline *timeline = ges_timeline_new_audio_video ();
+    GESLayer *layer = ges_timeline_append_layer (timeline);
+    GstClockTime start = 0;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        GstClockTime duration = ges_uri_clip_asset_get_duration (GES_URI_CLIP_ASSET (clips[i]));
+
+        ges_layer_add_asset (layer, clips[i], start, 0, duration, GES_TRACK_TYPE_UNKNOWN);
+        start += duration;
+    }
+
+    return timeline;
+}
+
+/*
+ * One GESPipeline rendering a timeline to a file. done is called from the
+ * main loop once the render ended, and may free the job.
+ */
+typedef void (*RenderJobDoneFunc) (RenderJob * job);
+
+struct _RenderJob
+{
+    GESPipeline *pipeline;
+    GstBus *bus;
+    gchar *output_uri;
+    gboolean finished;
+    gboolean failed;
+    RenderJobDoneFunc done;
+    gpointer user_data;
+    gint64 start_time;
+    guint progress_id;
+};
+
+static RenderJob *
+render_job_new (GESTimeline * timeline, const gchar * uri, GstEncodingProfile * profile,
+                GESPipelineFlags mode, RenderJobDoneFunc done, gpointer user_data)
+{
+    RenderJob *job = g_new0 (RenderJob, 1);
+
+    job->pipeline = ges_pipeline_new ();
+    job->output_uri = g_strdup (uri);
+    job->done = done;
+    job->user_data = user_data;
+
+    /* Add the timeline to that pipeline, we want it to render (without any preview) */
+    if (!ges_pipeline_set_timeline (job->pipeline, timeline) ||
+        !ges_pipeline_set_render_settings (job->pipeline, uri, profile) ||
+        !ges_pipeline_set_mode (job->pipeline, mode)) {
+        g_printerr ("Can't set up rendering to %s\n", uri);
+        gst_object_unref (job->pipeline);
+        g_free (job->output_uri);
+        g_free (job);
+        return NULL;
+    }
+
+    job->bus = gst_pipeline_get_bus (GST_PIPELINE (job->pipeline));
+    gst_bus_add_signal_watch (job->bus);
+    g_signal_connect (job->bus, "message", G_CALLBACK (bus_message_cb), job);
+
+    return job;
+}
+
+/*
+ * Prints how far the render got, how much faster than realtime it runs
+ * and when it will be done at that speed.
+ */
+static gboolean
+render_job_progress_cb (gpointer user_data)
+{
+    RenderJob *job = (RenderJob *) user_data;
+    gint64 position, duration;
+    gdouble elapsed, speed;
+
+    if (!gst_element_query_position (GST_ELEMENT (job->pipeline), GST_FORMAT_TIME, &position) ||
+        !gst_element_query_duration (GST_ELEMENT (job->pipeline), GST_FORMAT_TIME, &duration) ||
+        duration <= 0 || position < 0)
+        return G_SOURCE_CONTINUE;
+
+    elapsed = (g_get_monotonic_time () - job->start_time) / (gdouble) G_USEC_PER_SEC;
+    speed = elapsed > 0 ? ((gdouble) position / GST_SECOND) / elapsed : 0;
+    if (speed > 0)
+        g_print ("Progress %s: %.1f%% %" GST_TIME_FORMAT " / %" GST_TIME_FORMAT
+                 ", realtime factor %.2fx, ETA %.1f s\n", job->output_uri,
+                 100.0 * position / duration, GST_TIME_ARGS (position), GST_TIME_ARGS (duration),
+                 speed, ((gdouble) (duration - position) / GST_SECOND) / speed);
+    else
+        g_print ("Progress %s: %.1f%% %" GST_TIME_FORMAT " / %" GST_TIME_FORMAT "\n", job->output_uri,
+                 100.0 * position / duration, GST_TIME_ARGS (position), GST_TIME_ARGS (duration));
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+render_job_start (RenderJob * job)
+{
+    g_print ("Rendering %s \n", job->output_uri);
+    job->start_time = g_get_monotonic_time ();
+    if (progress_interval > 0)
+        job->progress_id = g_timeout_add_seconds (progress_interval, render_job_progress_cb, job);
+    gst_element_set_state (GST_ELEMENT (job->pipeline), GST_STATE_PLAYING);
+}
+
+static void
+render_job_free (RenderJob * job)
+{
+    if (job->progress_id)
+        g_source_remove (job->progress_id);
+    gst_element_set_state (GST_ELEMENT (job->pipeline), GST_STATE_NULL);
+    gst_bus_remove_signal_watch (job->bus);
+    gst_object_unref (job->bus);
+    gst_object_unref (job->pipeline);
+    g_free (job->output_uri);
+    g_free (job);
+}
+
+static gboolean
+render_job_done_idle (gpointer user_data)
+{
+    RenderJob *job = (RenderJob *) user_data;
+
+    job->done (job);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Bus handlers can't tear down their own pipeline, the done callback runs
+ * from an idle instead.
+ */
+static void
+render_job_finish (RenderJob * job, gboolean job_failed)
+{
+    if (job->finished)
+        return;
+    job->finished = TRUE;
+    job->failed = job_failed;
+    if (job->progress_id) {
+        g_source_remove (job->progress_id);
+        job->progress_id = 0;
+    }
+    g_idle_add (render_job_done_idle, job);
+}
+
+/*
+ * Output format selection. Smart render only passes a clip through when
+ * its streams match the profile, so the profile is made from the clip
+ * whose video and audio caps are shared by most inputs, and every other
+ * clip is reported with the caps fields that force it to be re-encoded.
+ */
+typedef struct
+{
+    GstCaps *video;
+    GstCaps *audio;
+} ClipFormat;
+
+/*
+ * Drops the fields describing one particular encoded stream, codec_data
+ * and streamheader differ between files of the same format.
+ */
+static GstCaps *
+strip_stream_fields (GstCaps * caps)
+{
+    guint i;
+
+    caps = gst_caps_make_writable (caps);
+    for (i = 0; i < gst_caps_get_size (caps); i++)
+        gst_structure_remove_fields (gst_caps_get_structure (caps, i), "codec_data", "streamheader", NULL);
+    return caps;
+}
+
+static GstCaps *
+first_stream_caps (GList * streams)
+{
+    GstCaps *caps;
+
+    if (!streams)
+        return NULL;
+    caps = gst_discoverer_stream_info_get_caps (GST_DISCOVERER_STREAM_INFO (streams->data));
+    return caps ? strip_stream_fields (caps) : NULL;
+}
+
+static void
+clip_format_init (ClipFormat * format, GstDiscovererInfo * info)
+{
+    GList *streams;
+
+    streams = gst_discoverer_info_get_video_streams (info);
+    format->video = first_stream_caps (streams);
+    gst_discoverer_stream_info_list_free (streams);
+
+    streams = gst_discoverer_info_get_audio_streams (info);
+    format->audio = first_stream_caps (streams);
+    gst_discoverer_stream_info_list_free (streams);
+}
+
+static void
+clip_format_clear (ClipFormat * format)
+{
+    if (format->video)
+        gst_caps_unref (format->video);
+    if (format->audio)
+        gst_caps_unref (format->audio);
+}
+
+static gchar *
+clip_format_signature (ClipFormat * format)
+{
+    gchar *video = format->video ? gst_caps_to_string (format->video) : g_strdup ("none");
+    gchar *audio = format->audio ? gst_caps_to_string (format->audio) : g_strdup ("none");
+    gchar *signature = g_strconcat (video, "|", audio, NULL);
+
+    g_free (video);
+    g_free (audio);
+    return signature;
+}
+
+static gchar *
+value_to_string (const GValue * value)
+{
+    gchar *str;
+
+    if (!value)
+        return g_strdup ("unset");
+    if (G_VALUE_TYPE (value) == GST_TYPE_BUFFER)
+        return g_strdup ("<buffer>");
+    str = gst_value_serialize (value);
+    return str ? str : g_strdup ("?");
+}
+
+/*
+ * Appends why caps don't match the output caps ref, nothing if they do.
+ */
+static void
+append_caps_diff (GString * reasons, const gchar * what, GstCaps * ref, GstCaps * caps)
+{
+    const GstStructure *rs, *cs;
+    guint i;
+
+    if ((!ref && !caps) || (ref && caps && gst_caps_is_equal (ref, caps)))
+        return;
 
+    if (reasons->len)
+        g_string_append (reasons, "; ");
+    if (!caps) {
+        g_string_append_printf (reasons, "no %s stream", what);
         return;
     }
+    if (!ref) {
+        g_string_append_printf (reasons, "%s stream not in the output", what);
+        return;
+    }
+
+    rs = gst_caps_get_structure (ref, 0);
+    cs = gst_caps_get_structure (caps, 0);
+    if (!gst_structure_has_name (cs, gst_structure_get_name (rs))) {
+        g_string_append_printf (reasons, "%s is %s instead of %s", what,
+                                gst_structure_get_name (cs), gst_structure_get_name (rs));
+        return;
+    }
+
+    g_string_append_printf (reasons, "%s", what);
+    for (i = 0; i < (guint) gst_structure_n_fields (rs); i++) {
+        const gchar *field = gst_structure_nth_field_name (rs, i);
+        const GValue *rv = gst_structure_get_value (rs, field);
+        const GValue *cv = gst_structure_get_value (cs, field);
+
+        if (!cv || gst_value_compare (rv, cv) != GST_VALUE_EQUAL) {
+            gchar *a = value_to_string (cv), *b = value_to_string (rv);
+
+            g_string_append_printf (reasons, " %s=%s (output %s)", field, a, b);
+            g_free (a);
+            g_free (b);
+        }
+    }
+    for (i = 0; i < (guint) gst_structure_n_fields (cs); i++) {
+        const gchar *field = gst_structure_nth_field_name (cs, i);
+
+        if (!gst_structure_has_field (rs, field)) {
+            gchar *a = value_to_string (gst_structure_get_value (cs, field));
+
+            g_string_append_printf (reasons, " %s=%s (output unset)", field, a);
+            g_free (a);
+        }
+    }
+}
+
+/*
+ * @return The info to build the output profile from. reencode_out is set
+ * to the number of clips that don't match it, and reencode_clips, when
+ * given, flags each of them.
+ */
+static GstDiscovererInfo *
+select_common_info (GESAsset ** clips, gchar ** uris, guint n, gboolean * reencode_clips,
+                    guint * reencode_out)
+{
+    ClipFormat *formats = g_new0 (ClipFormat, n);
+    GHashTable *counts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    GstDiscovererInfo *info;
+    guint i, best = 0, best_count = 0, reencode = 0;
+
+    for (i = 0; i < n; i++) {
+        gchar *signature;
+        guint count;
+
+        clip_format_init (&formats[i], ges_uri_clip_asset_get_info (GES_URI_CLIP_ASSET (clips[i])));
+        signature = clip_format_signature (&formats[i]);
+        count = GPOINTER_TO_UINT (g_hash_table_lookup (counts, signature)) + 1;
+        g_hash_table_insert (counts, signature, GUINT_TO_POINTER (count));
+        if (count > best_count) {
+            best = i;
+            best_count = count;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        GString *reasons = g_string_new (NULL);
+
+        append_caps_diff (reasons, "video", formats[best].video, formats[i].video);
+        append_caps_diff (reasons, "audio", formats[best].audio, formats[i].audio);
+        if (reasons->len) {
+            g_print ("Clip %u (%s) will be re-encoded: %s\n", i, uris[i], reasons->str);
+            reencode++;
+        }
+        if (reencode_clips)
+            reencode_clips[i] = reasons->len != 0;
+        g_string_free (reasons, TRUE);
+        clip_format_clear (&formats[i]);
+    }
+    g_free (formats);
+    g_hash_table_unref (counts);
+
+    g_print ("Output format of clip %u (%s), %u of %u clips pass through\n",
+             best, uris[best], n - reencode, n);
+
+    *reencode_out = reencode;
+    info = ges_uri_clip_asset_get_info (GES_URI_CLIP_ASSET (clips[best]));
+    return info;
+}
+
+/*
+ * @return TRUE if every clip has the format of info, the reasons of the
+ * others are printed.
+ */
+static gboolean
+clips_match_info (GESAsset ** clips, gchar ** uris, guint n, GstDiscovererInfo * info)
+{
+    ClipFormat ref, format;
+    gboolean match = TRUE;
+    guint i;
+
+    clip_format_init (&ref, info);
+    for (i = 0; i < n; i++) {
+        GString *reasons = g_string_new (NULL);
+
+        clip_format_init (&format, ges_uri_clip_asset_get_info (GES_URI_CLIP_ASSET (clips[i])));
+        append_caps_diff (reasons, "video", ref.video, format.video);
+        append_caps_diff (reasons, "audio", ref.audio, format.audio);
+        if (reasons->len) {
+            g_printerr ("%s doesn't match the output: %s\n", uris[i], reasons->str);
+            match = FALSE;
+        }
+        g_string_free (reasons, TRUE);
+        clip_format_clear (&format);
+    }
+    clip_format_clear (&ref);
+
+    return match;
+}
+
+static void concat_finish (Concat * c, gboolean concat_failed);
+
+static void
+output_done_cb (RenderJob * job)
+{
+    concat_finish ((Concat *) job->user_data, job->failed);
+}
+
+/*
+ * Segmented rendering (--segments). Only the runs of clips that have to be
+ * re-encoded are rendered ahead, cut into about --segments equal parts that
+ * parallel pipelines encode, so every part starts on a keyframe of its own.
+ * Clips that pass through are never cut, each file starts on a keyframe.
+ * The parts are encoded to the full caps of the passthrough clips, profile
+ * and level included, and scaled to their size and rate. One smart render
+ * concat then joins the original passthrough clips and the encoded parts
+ * in that format; a part that doesn't match fails the job rather than
+ * being re-encoded a second time.
+ */
+static void
+segments_cleanup (Concat * c)
+{
+    guint i;
+
+    for (i = 0; c->segment_jobs && i < c->segments_count; i++)
+        if (c->segment_jobs[i])
+            render_job_free (c->segment_jobs[i]);
+    g_free (c->segment_jobs);
+    c->segment_jobs = NULL;
+    g_free (c->segment_clips);
+    c->segment_clips = NULL;
+    g_free (c->reencode_clips);
+    c->reencode_clips = NULL;
+    c->segments_count = 0;
+    c->info = NULL;
+
+    for (i = 0; c->segment_uris && c->segment_uris[i]; i++) {
+        gchar *filename = g_filename_from_uri (c->segment_uris[i], NULL, NULL);
+
+        if (filename)
+            g_unlink (filename);
+        g_free (filename);
+    }
+    if (c->segment_dir)
+        g_rmdir (c->segment_dir);
+    g_strfreev (c->segment_uris);
+    c->segment_uris = NULL;
+    g_free (c->segment_dir);
+    c->segment_dir = NULL;
+}
+
+static GstClockTime
+asset_duration (GESAsset * asset)
+{
+    return ges_uri_clip_asset_get_duration (GES_URI_CLIP_ASSET (asset));
+}
+
+/*
+ * @return A timeline with the part [seg_start, seg_end) of the clips.
+ */
+static GESTimeline *
+build_segment_timeline (Concat * c, GstClockTime seg_start, GstClockTime seg_end)
+{
+    GESTimeline *timeline = ges_timeline_new_audio_video ();
+    GESLayer *layer = ges_timeline_append_layer (timeline);
+    GstClockTime clip_start = 0;
+    guint i;
+
+    for (i = 0; i < c->assetsCount; i++) {
+        GstClockTime clip_end = clip_start + asset_duration (c->assets[i]);
+
+        if (clip_end > seg_start && clip_start < seg_end) {
+            GstClockTime from = MAX (seg_start, clip_start);
+            GstClockTime to = MIN (seg_end, clip_end);
+
+            ges_layer_add_asset (layer, c->assets[i], from - seg_start, from - clip_start, to - from,
+                                 GES_TRACK_TYPE_UNKNOWN);
+        }
+        clip_start = clip_end;
+    }
+
+    return timeline;
+}
+
+/*
+ * Starts queued segments, of all batch jobs in order, while fewer than
+ * --render-jobs are running. A job stops starting segments after a
+ * failure.
+ */
+static void
+start_next_segments (void)
+{
+    guint i;
+
+    for (i = 0; i < concats->len && segmentsRunning < (guint) render_jobs; i++) {
+        Concat *c = (Concat *) g_ptr_array_index (concats, i);
+
+        while (c->segment_jobs && !c->segments_failed && c->segments_started < c->segments_count &&
+               segmentsRunning < (guint) render_jobs) {
+            render_job_start (c->segment_jobs[c->segments_started]);
+            c->segments_started++;
+            c->segments_running++;
+            segmentsRunning++;
+        }
+    }
+}
+
+/*
+ * All parts are encoded, joins them with the passthrough clips in timeline
+ * order.
+ */
+static void
+join_segments (Concat * c)
+{
+    GESAsset **parts = g_new0 (GESAsset *, c->segments_count);
+    GESAsset **pieces = g_new0 (GESAsset *, c->assetsCount + c->segments_count);
+    GstEncodingProfile *profile = NULL;
+    GError *error = NULL;
+    guint i, s, n = 0, loaded = 0;
+
+    for (i = 0; i < c->segments_count; i++) {
+        parts[i] = (GESAsset *) ges_uri_clip_asset_request_sync (c->segment_uris[i], &error);
+        if (!parts[i]) {
+            g_printerr ("Can't load segment %s: %s\n", c->segment_uris[i], error ? error->message : "?");
+            g_clear_error (&error);
+            break;
+        }
+        loaded++;
+    }
+
+    if (loaded == c->segments_count && !clips_match_info (parts, c->segment_uris, loaded, c->info))
+        g_printerr ("The encoded segments don't match the passthrough clips, not re-encoding them again\n");
+    else if (loaded == c->segments_count) {
+        for (i = 0, s = 0; i < c->assetsCount;) {
+            guint first = i;
+
+            if (!c->reencode_clips[i]) {
+                pieces[n++] = c->assets[i];
+                i++;
+                continue;
+            }
+            for (; s < c->segments_count && c->segment_clips[s] == first; s++)
+                pieces[n++] = parts[s];
+            while (i < c->assetsCount && c->reencode_clips[i])
+                i++;
+        }
+
+        profile = make_profile_from_info (c->info, FALSE);
+    }
+    if (profile) {
+        c->output_job = render_job_new (build_timeline (pieces, n), c->output_uri, profile,
+                                        GES_PIPELINE_MODE_SMART_RENDER, output_done_cb, c);
+        gst_encoding_profile_unref (profile);
+    }
+
+    for (i = 0; i < loaded; i++)
+        gst_object_unref (parts[i]);
+    g_free (parts);
+    g_free (pieces);
+
+    if (!c->output_job) {
+        concat_finish (c, TRUE);
+        return;
+    }
+    render_job_start (c->output_job);
+}
+
+static void
+segment_done_cb (RenderJob * job)
+{
+    Concat *c = (Concat *) job->user_data;
+    guint i;
+
+    for (i = 0; i < c->segments_count; i++)
+        if (c->segment_jobs[i] == job)
+            c->segment_jobs[i] = NULL;
+    c->segments_running--;
+    segmentsRunning--;
+    c->segments_done++;
+    if (job->failed)
+        c->segments_failed++;
+    render_job_free (job);
+    start_next_segments ();
+
+    /* Give up after a failure once the running segments ended */
+    if (c->segments_failed) {
+        if (!c->segments_running) {
+            g_printerr ("%u segments failed\n", c->segments_failed);
+            concat_finish (c, TRUE);
+        }
+        return;
+    }
+    if (c->segments_done == c->segments_count)
+        join_segments (c);
+}
+
+static gboolean
+add_segment_job (Concat * c, guint first_clip, GstClockTime seg_start, GstClockTime seg_end,
+                 GstEncodingProfile * profile)
+{
+    guint i = c->segments_count++;
+    gchar *name = g_strdup_printf ("part%03u", i);
+    gchar *path = g_build_filename (c->segment_dir, name, NULL);
+
+    c->segment_uris[i] = gst_filename_to_uri (path, NULL);
+    g_free (path);
+    g_free (name);
+
+    c->segment_clips[i] = first_clip;
+    c->segment_jobs[i] = render_job_new (build_segment_timeline (c, seg_start, seg_end), c->segment_uris[i],
+                                         profile, GES_PIPELINE_MODE_RENDER, segment_done_cb, c);
+    return c->segment_jobs[i] != NULL;
+}
+
+static gboolean
+start_segmented_render (Concat * c, GstDiscovererInfo * info)
+{
+    GstEncodingProfile *profile = make_profile_from_info (info, TRUE);
+    GstClockTime clip_start = 0, reencode_duration = 0;
+    GError *error = NULL;
+    guint i, passthrough = 0;
+
+    if (!profile)
+        return FALSE;
+
+    c->info = info;
+    c->segment_dir = g_dir_make_tmp ("gsteditor-XXXXXX", &error);
+    if (!c->segment_dir) {
+        g_printerr ("Can't create a directory for the segments: %s\n", error->message);
+        g_clear_error (&error);
+        gst_encoding_profile_unref (profile);
+        return FALSE;
+    }
+
+    for (i = 0; i < c->assetsCount; i++)
+        if (c->reencode_clips[i])
+            reencode_duration += asset_duration (c->assets[i]);
+
+    /* Every run gets at least one part, rounding can add one per run */
+    c->segment_jobs = g_new0 (RenderJob *, segments + c->assetsCount);
+    c->segment_clips = g_new0 (guint, segments + c->assetsCount);
+    c->segment_uris = g_new0 (gchar *, segments + c->assetsCount + 1);
+    for (i = 0; i < c->assetsCount;) {
+        GstClockTime run_start = clip_start, run_duration;
+        guint first = i, k, parts;
+
+        if (!c->reencode_clips[i]) {
+            clip_start += asset_duration (c->assets[i]);
+            passthrough++;
+            i++;
+            continue;
+        }
+        for (; i < c->assetsCount && c->reencode_clips[i]; i++)
+            clip_start += asset_duration (c->assets[i]);
+        run_duration = clip_start - run_start;
+
+        parts = MAX (1, (guint) gst_util_uint64_scale_round (run_duration, segments, MAX (reencode_duration, 1)));
+        for (k = 0; k < parts; k++) {
+            if (!add_segment_job (c, first, run_start + gst_util_uint64_scale (run_duration, k, parts),
+                                  run_start + gst_util_uint64_scale (run_duration, k + 1, parts), profile)) {
+                gst_encoding_profile_unref (profile);
+                return FALSE;
+            }
+        }
+    }
+    gst_encoding_profile_unref (profile);
+
+    g_print ("Re-encoding %u segments, %u clips pass through\n", c->segments_count, passthrough);
+    start_next_segments ();
+    return TRUE;
+}
+
+/*
+ * All inputs are loaded, pick the output format and start rendering.
+ */
+static void
+concat_render (Concat * c)
+{
+    GstEncodingProfile *profile;
+    GstDiscovererInfo *info;
+    guint i, reencode;
+
+    for (i = 0; i < c->assetsCount; i++)
+        c->duration += asset_duration (c->assets[i]);
+
+    if (segments > 1)
+        c->reencode_clips = g_new0 (gboolean, c->assetsCount);
+    info = select_common_info (c->assets, c->input_uris, c->assetsCount, c->reencode_clips, &reencode);
+    if (strict && reencode) {
+        g_printerr ("--strict: refusing to re-encode %u clips\n", reencode);
+        concat_finish (c, TRUE);
+        return;
+    }
+
+    if (segments > 1 && reencode) {
+        if (!start_segmented_render (c, info))
+            concat_finish (c, TRUE);
+        return;
+    }
+    if (segments > 1)
+        g_print ("All clips pass through, rendering in one pipeline\n");
+
+    profile = make_profile_from_info (info, FALSE);
+    if (profile) {
+        c->output_job = render_job_new (build_timeline (c->assets, c->assetsCount), c->output_uri, profile,
+                                        GES_PIPELINE_MODE_SMART_RENDER, output_done_cb, c);
+        gst_encoding_profile_unref (profile);
+    }
+    if (!c->output_job) {
+        concat_finish (c, TRUE);
+        return;
+    }
+    render_job_start (c->output_job);
+}
+
+static void
+asset_loaded_cb (GObject * source_object, GAsyncResult * res, gpointer user_data)
+{
+    AssetRequest *req = (AssetRequest *) user_data;
+    Concat *c = req->concat;
+    guint index = req->index;
+    GError *error = NULL;
+    GESAsset *asset = ges_asset_request_finish (res, &error);
+    guint64 size;
+    gint64 mtime;
+
+    g_free (req);
+    assetsPending--;
+    request_next_assets ();
+
+    c->assetsLoaded++;
+    if (error) {
+        g_printerr ("Error loading asset %s: %s\n", c->input_uris[index], error->message);
+        g_clear_error (&error);
+        c->assetsFailed++;
+    } else {
+        c->assets[index] = asset;
+        discovery_cache_store (c->input_uris[index],
+                               ges_uri_clip_asset_get_info (GES_URI_CLIP_ASSET (asset)));
+        if (uri_file_stat (c->input_uris[index], &size, &mtime))
+            c->input_bytes += size;
+    }
 
-    assetsLoaded++;
     /*
      * Check if we have loaded last asset and trigger concatenating
      */
-    if (assetsLoaded == assetsCount) {
-        GstDiscovererInfo *info = ges_uri_clip_asset_get_info (mfs);
-        GstEncodingProfile *profile = make_profile_from_info (info);
-        ges_pipeline_set_render_settings (pipeline, output_uri, profile);
-        /* We want the pipeline to render (without any preview) */
-        if (!ges_pipeline_set_mode (pipeline, GES_PIPELINE_MODE_SMART_RENDER)) {
-            g_main_loop_quit (mainloop);
-            return;
-        }
-        g_print ("Set pipeline PLAYING \n");
-        gst_element_set_state (GST_ELEMENT (pipeline), GST_STATE_PLAYING);
+    if (c->assetsLoaded < c->assetsCount)
+        return;
+
+    if (c->assetsFailed) {
+        g_printerr ("%u of %u assets failed to load\n", c->assetsFailed, c->assetsCount);
+        concat_finish (c, TRUE);
+        return;
     }
 
-    gst_object_unref (mfs);
+    concat_render (c);
 }
 
-int
-main (int argc, char **argv)
+/*
+ * GES wants URIs, plain file names are converted.
+ */
+static gchar *
+input_to_uri (const gchar * input)
+{
+    if (gst_uri_is_valid (input))
+        return g_strdup (input);
+    return gst_filename_to_uri (input, NULL);
+}
+
+static Concat *
+concat_new (gchar ** args, guint n_args)
 {
-    GMainLoop *mainloop = NULL;
-    GESTimeline *timeline;
-    GESLayer *layer = NULL;
-    GstBus *bus = NULL;
+    Concat *c = g_new0 (Concat, 1);
     guint i;
 
+    c->output_uri = input_to_uri (args[0]);
+    c->assetsCount = n_args - 1;
+    c->input_uris = g_new0 (gchar *, c->assetsCount + 1);
+    for (i = 0; i < c->assetsCount; i++)
+        c->input_uris[i] = input_to_uri (args[i + 1]);
+    c->assets = g_new0 (GESAsset *, c->assetsCount);
+    c->index = concats->len;
+    g_ptr_array_add (concats, c);
 
-    if (argc < 3) {
-        g_print ("Usage: %s <output uri> <list of files>\n", argv[0]);
-        return -1;
+    return c;
+}
+
+static void
+concat_free (gpointer data)
+{
+    Concat *c = (Concat *) data;
+    guint i;
+
+    if (c->output_job)
+        render_job_free (c->output_job);
+    segments_cleanup (c);
+    for (i = 0; i < c->assetsCount; i++)
+        if (c->assets[i])
+            gst_object_unref (c->assets[i]);
+    g_free (c->assets);
+    g_strfreev (c->input_uris);
+    g_free (c->output_uri);
+    g_free (c);
+}
+
+static void
+concat_start (Concat * c)
+{
+    guint i;
+
+    c->start_time = g_get_monotonic_time ();
+    for (i = 0; i < c->assetsCount; i++) {
+        AssetRequest *req = g_new0 (AssetRequest, 1);
+
+        req->concat = c;
+        req->index = i;
+        g_queue_push_tail (&assetRequests, req);
     }
+    request_next_assets ();
+}
 
-    gst_init (&argc, &argv);
-    ges_init ();
+static void
+start_next_concats (void)
+{
+    while (concatsRunning < (guint) batch_jobs && concatsStarted < concats->len) {
+        concat_start ((Concat *) g_ptr_array_index (concats, concatsStarted));
+        concatsStarted++;
+        concatsRunning++;
+    }
+}
 
-    timeline = ges_timeline_new_audio_video ();
+/*
+ * Reports the job and starts the next one. The realtime factor is the
+ * rendered media duration over the wall clock time of the job, discovery
+ * included.
+ */
+static void
+concat_finish (Concat * c, gboolean concat_failed)
+{
+    gdouble secs = (g_get_monotonic_time () - c->start_time) / (gdouble) G_USEC_PER_SEC;
+    gdouble media = (gdouble) c->duration / GST_SECOND;
 
-    layer = (GESLayer *) ges_layer_new ();
-    if (!ges_timeline_add_layer (timeline, layer))
-        return -1;
+    if (concat_failed) {
+        concatsFailed++;
+        g_print ("Job %u %s: failed after %.2f s\n", c->index, c->output_uri, secs);
+    } else {
+        batch_duration += c->duration;
+        g_print ("Job %u %s: %.2f s of media in %.2f s, realtime factor %.1fx, %.1f MB/s\n",
+                 c->index, c->output_uri, media, secs, secs > 0 ? media / secs : 0,
+                 secs > 0 ? c->input_bytes / secs / 1e6 : 0);
+    }
 
-    output_uri = argv[1];
-    assetsCount = argc - 2;
+    /* Release the pipelines and temporary files now, not at exit */
+    if (c->output_job) {
+        render_job_free (c->output_job);
+        c->output_job = NULL;
+    }
+    segments_cleanup (c);
 
-    for (i = 2; i < argc; i++) {
-        g_print ("Loading asset %s \n", argv[i]);
-        ges_asset_request_async (GES_TYPE_URI_CLIP, argv[i],
-                                 NULL, (GAsyncReadyCallback) asset_loaded_cb, mainloop);
+    concatsRunning--;
+    concatsDone++;
+    if (concatsDone == concats->len)
+        g_main_loop_quit (mainloop);
+    else
+        start_next_concats ();
+}
+
+/*
+ * Reads --batch, one job per line as '<output uri> <list of files>' with
+ * shell quoting. Empty lines and lines starting with # are skipped.
+ */
+static gboolean
+load_batch_file (const gchar * path)
+{
+    GError *error = NULL;
+    gchar *contents, **lines;
+    guint i;
+    gboolean ok = TRUE;
+
+    if (!g_file_get_contents (path, &contents, NULL, &error)) {
+        g_printerr ("Can't read %s: %s\n", path, error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] && ok; i++) {
+        gchar *line = g_strstrip (lines[i]);
+        gchar **args;
+        gint n_args;
+
+        if (!*line || *line == '#')
+            continue;
+        if (!g_shell_parse_argv (line, &n_args, &args, &error)) {
+            g_printerr ("%s:%u: %s\n", path, i + 1, error->message);
+            g_clear_error (&error);
+            ok = FALSE;
+            break;
+        }
+        if (n_args < 2) {
+            g_printerr ("%s:%u: expected an output and at least one input\n", path, i + 1);
+            ok = FALSE;
+        } else {
+            concat_new (args, n_args);
+        }
+        g_strfreev (args);
     }
+    g_strfreev (lines);
+    g_free (contents);
 
-    /* In order to view our timeline, let's grab a convenience pipeline to put
-     * our timeline in. */
-    pipeline = ges_pipeline_new ();
+    return ok;
+}
 
-    /* Add the timeline to that pipeline */
-    if (!ges_pipeline_set_timeline (pipeline, timeline))
+int
+main (int argc, char **argv)
+{
+    GOptionContext *optctx;
+    GError *error = NULL;
+    gint64 start_time;
+    guint n_inputs;
+
+    optctx = g_option_context_new ("- concatenate media files with GES");
+    g_option_context_add_main_entries (optctx, entries, NULL);
+    g_option_context_add_group (optctx, gst_init_get_option_group ());
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
+
+    n_inputs = inputs ? g_strv_length (inputs) : 0;
+    if ((batch_file ? n_inputs != 0 : n_inputs < 2) || max_discovery < 1 || batch_jobs < 1) {
+        g_print ("Usage: %s [--max-discovery=N] [--segments=N] <output uri> <list of files>\n"
+                 "       %s [--jobs=N] --batch=FILE\n", argv[0], argv[0]);
         return -1;
+    }
+    if (render_jobs < 1)
+        render_jobs = g_get_num_processors ();
+
+    concats = g_ptr_array_new_with_free_func (concat_free);
+    if (batch_file) {
+        if (!load_batch_file (batch_file) || concats->len == 0) {
+            g_ptr_array_unref (concats);
+            return -1;
+        }
+    } else {
+        concat_new (inputs, n_inputs);
+    }
+
+    ges_init ();
 
+    if (!no_discovery_cache)
+        discovery_cache_setup ();
+
+    /* The loop has to exist before any asset callback can run */
     mainloop = g_main_loop_new (NULL, FALSE);
 
-    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
-    gst_bus_add_signal_watch (bus);
-    g_signal_connect (bus, "message", G_CALLBACK (bus_message_cb), mainloop);
+    start_time = g_get_monotonic_time ();
+    start_next_concats ();
 
     g_main_loop_run (mainloop);
 
-    return 0;
+    if (concats->len > 1) {
+        gdouble secs = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+        gdouble media = (gdouble) batch_duration / GST_SECOND;
+
+        g_print ("Batch: %u jobs, %u failed, %.2f s of media in %.2f s, realtime factor %.1fx\n",
+                 concats->len, concatsFailed, media, secs, secs > 0 ? media / secs : 0);
+    }
+
+    if (discovery_cache) {
+        g_print ("Discovery cache: %u hits\n", discovery_cache_hits);
+        discovery_cache_save ();
+        g_key_file_free (discovery_cache);
+    }
+
+    g_ptr_array_unref (concats);
+    g_free (discovery_cache_path);
+    g_free (batch_file);
+    g_strfreev (inputs);
+    g_main_loop_unref (mainloop);
+
+    return concatsFailed ? -1 : 0;
 
 }
 
 static void
-bus_message_cb (GstBus * bus, GstMessage * message, GMainLoop * mainloop)
+bus_message_cb (GstBus * bus, GstMessage * message, RenderJob * job)
 {
     switch (GST_MESSAGE_TYPE (message)) {
         case GST_MESSAGE_ERROR:
-            g_print ("ERROR\n");
-            g_main_loop_quit (mainloop);
+        case GST_MESSAGE_WARNING: {
+            gboolean is_error = GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR;
+            GError *err = NULL;
+            gchar *debug = NULL;
+            gchar *path = gst_object_get_path_string (GST_MESSAGE_SRC (message));
+
+            if (is_error)
+                gst_message_parse_error (message, &err, &debug);
+            else
+                gst_message_parse_warning (message, &err, &debug);
+            g_printerr ("%s rendering %s from %s: %s (%s, %d)\n%s%s",
+                        is_error ? "ERROR" : "WARNING", job->output_uri, path, err->message,
+                        g_quark_to_string (err->domain), err->code,
+                        debug ? debug : "", debug ? "\n" : "");
+            g_free (path);
+            g_free (debug);
+            g_clear_error (&err);
+
+            if (is_error)
+                render_job_finish (job, TRUE);
             break;
-        case GST_MESSAGE_EOS:
-            g_print ("Done\n");
-            g_main_loop_quit (mainloop);
+        }
+        case GST_MESSAGE_EOS: {
+            gdouble elapsed = (g_get_monotonic_time () - job->start_time) / (gdouble) G_USEC_PER_SEC;
+            gint64 duration;
+
+            if (gst_element_query_duration (GST_ELEMENT (job->pipeline), GST_FORMAT_TIME, &duration) &&
+                duration > 0 && elapsed > 0)
+                g_print ("Done %s: %" GST_TIME_FORMAT " in %.2f s, realtime factor %.2fx\n",
+                         job->output_uri, GST_TIME_ARGS (duration), elapsed,
+                         ((gdouble) duration / GST_SECOND) / elapsed);
+            else
+                g_print ("Done %s\n", job->output_uri);
+            render_job_finish (job, FALSE);
             break;
+        }
         default:
             break;
     }
 }
 
+/*
+ * When encoding, fields describing one particular encoded stream are
+ * dropped so the encoder can produce its own. The rest, e.g. profile and
+ * level, still constrain the encoder.
+ */
+static GstCaps *
+stream_format (GstDiscovererStreamInfo * stream, gboolean encode)
+{
+    GstCaps *caps = gst_discoverer_stream_info_get_caps (stream);
+
+    if (!caps || !encode)
+        return caps;
+    return strip_stream_fields (caps);
+}
+
+/*
+ * When encoding, the raw size, rate and channels of the stream, so the
+ * clips re-encoded are scaled and resampled to it.
+ */
+static GstCaps *
+stream_restriction (GstDiscovererStreamInfo * stream, gboolean encode)
+{
+    if (!encode)
+        return NULL;
+    if (GST_IS_DISCOVERER_VIDEO_INFO (stream)) {
+        GstDiscovererVideoInfo *video = GST_DISCOVERER_VIDEO_INFO (stream);
+
+        return gst_caps_new_simple ("video/x-raw",
+                                    "width", G_TYPE_INT, gst_discoverer_video_info_get_width (video),
+                                    "height", G_TYPE_INT, gst_discoverer_video_info_get_height (video),
+                                    "framerate", GST_TYPE_FRACTION,
+                                    gst_discoverer_video_info_get_framerate_num (video),
+                                    gst_discoverer_video_info_get_framerate_denom (video),
+                                    "pixel-aspect-ratio", GST_TYPE_FRACTION,
+                                    gst_discoverer_video_info_get_par_num (video),
+                                    gst_discoverer_video_info_get_par_denom (video), NULL);
+    }
+    if (GST_IS_DISCOVERER_AUDIO_INFO (stream)) {
+        GstDiscovererAudioInfo *audio = GST_DISCOVERER_AUDIO_INFO (stream);
+
+        return gst_caps_new_simple ("audio/x-raw",
+                                    "rate", G_TYPE_INT, gst_discoverer_audio_info_get_sample_rate (audio),
+                                    "channels", G_TYPE_INT, gst_discoverer_audio_info_get_channels (audio),
+                                    NULL);
+    }
+    return NULL;
+}
+
 static GstEncodingProfile *
-make_profile_from_info (GstDiscovererInfo * info)
+make_profile_from_info (GstDiscovererInfo * info, gboolean encode)
 {
     GstEncodingContainerProfile *profile = NULL;
     GstDiscovererStreamInfo *sinfo = gst_discoverer_info_get_stream_info (info);
@@ -143,18 +1372,22 @@ make_profile_from_info (GstDiscovererInfo * info)
         for (tmp = substreams; tmp; tmp = tmp->next) {
             GstDiscovererStreamInfo *stream = GST_DISCOVERER_STREAM_INFO (tmp->data);
             GstEncodingProfile *sprof = NULL;
+            GstCaps *format = stream_format (stream, encode);
+            GstCaps *restriction = stream_restriction (stream, encode);
 
             if (GST_IS_DISCOVERER_VIDEO_INFO (stream)) {
                 sprof = (GstEncodingProfile *)
-                        gst_encoding_video_profile_new (gst_discoverer_stream_info_get_caps
-                                                                (stream), NULL, NULL, 1);
+                        gst_encoding_video_profile_new (format, NULL, restriction, 1);
             } else if (GST_IS_DISCOVERER_AUDIO_INFO (stream)) {
                 sprof = (GstEncodingProfile *)
-                        gst_encoding_audio_profile_new (gst_discoverer_stream_info_get_caps
-                                                                (stream), NULL, NULL, 1);
+                        gst_encoding_audio_profile_new (format, NULL, restriction, 1);
             } else {
                 GST_WARNING ("Unsupported streams");
             }
+            if (format)
+                gst_caps_unref (format);
+            if (restriction)
+                gst_caps_unref (restriction);
 
             if (sprof)
                 gst_encoding_container_profile_add_profile (profile, sprof);
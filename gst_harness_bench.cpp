@@ -0,0 +1,483 @@
+//
+// Per-element microbenchmarks driven by GstHarness.
+// Every case pushes pre-built buffers straight into a single element (no
+// pipeline, bus or main loop) and reports the time spent per input buffer.
+// Inputs are generated once: raw video/audio/KLV are synthesised, encoded
+// and RTP inputs are produced by running those through the encoder or
+// payloader in another harness.
+//
+
+#include <gst/gst.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DEFAULT_FRAMES 300
+#define DEFAULT_WIDTH 1280
+#define DEFAULT_HEIGHT 720
+#define DISTINCT_VIDEO_FRAMES 30
+#define AUDIO_RATE 48000
+#define AUDIO_CHANNELS 2
+#define AUDIO_FRAME_SAMPLES 960
+
+static gint frames = DEFAULT_FRAMES;
+static gint width = DEFAULT_WIDTH;
+static gint height = DEFAULT_HEIGHT;
+static gchar *filter = NULL;
+static gchar *output = NULL;
+
+static GOptionEntry entries[] = {
+        {"frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+                "Number of raw video, audio and KLV frames to generate (default: 300)", "N"},
+        {"width", 0, 0, G_OPTION_ARG_INT, &width,
+                "Raw video width (default: 1280)", "PIXELS"},
+        {"height", 0, 0, G_OPTION_ARG_INT, &height,
+                "Raw video height (default: 720)", "PIXELS"},
+        {"filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+                "Only run cases whose name contains this string", "TEXT"},
+        {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+                "Append JSON result lines to this file instead of stdout", "FILE"},
+        {NULL}
+};
+
+typedef enum
+{
+    INPUT_RAW_VIDEO,
+    INPUT_PCM_S16LE,
+    INPUT_PCM_S16BE,
+    INPUT_KLV,
+    INPUT_H264,
+    INPUT_H265,
+    INPUT_VP8,
+    INPUT_OPUS,
+    INPUT_RTP_H264,
+    INPUT_RTP_H265,
+    INPUT_RTP_VP8,
+    INPUT_RTP_OPUS,
+    INPUT_RTP_L16,
+    INPUT_RTP_KLV,
+    INPUT_LAST
+} InputKind;
+
+/*
+ * An input set. Generated inputs have no source, derived ones are the
+ * output of running the source input through launch.
+ */
+typedef struct
+{
+    const gchar *name;
+    InputKind source;
+    const gchar *factory;
+    const gchar *launch;
+    GPtrArray *buffers;
+    GstCaps *caps;
+    gboolean failed;
+} Input;
+
+static Input inputs[INPUT_LAST] = {
+        {"raw-video", INPUT_LAST, NULL, NULL},
+        {"pcm-s16le", INPUT_LAST, NULL, NULL},
+        {"pcm-s16be", INPUT_LAST, NULL, NULL},
+        {"klv", INPUT_LAST, NULL, NULL},
+        {"h264", INPUT_RAW_VIDEO, "x264enc",
+                "x264enc speed-preset=ultrafast tune=zerolatency key-int-max=30 "
+                "! video/x-h264,stream-format=byte-stream,alignment=au"},
+        {"h265", INPUT_RAW_VIDEO, "x265enc",
+                "x265enc speed-preset=ultrafast tune=zerolatency key-int-max=30 "
+                "! video/x-h265,stream-format=byte-stream,alignment=au"},
+        {"vp8", INPUT_RAW_VIDEO, "vp8enc", "vp8enc deadline=1 keyframe-max-dist=30"},
+        {"opus", INPUT_PCM_S16LE, "opusenc", "opusenc"},
+        {"rtp-h264", INPUT_H264, "rtph264pay", "rtph264pay config-interval=-1"},
+        {"rtp-h265", INPUT_H265, "rtph265pay", "rtph265pay config-interval=-1"},
+        {"rtp-vp8", INPUT_VP8, "rtpvp8pay", "rtpvp8pay"},
+        {"rtp-opus", INPUT_OPUS, "rtpopuspay", "rtpopuspay"},
+        {"rtp-l16", INPUT_PCM_S16BE, "rtpL16pay", "rtpL16pay"},
+        {"rtp-klv", INPUT_KLV, "rtpklvpay", "rtpklvpay"},
+};
+
+typedef struct
+{
+    const gchar *name;
+    const gchar *factory;
+    const gchar *launch;
+    InputKind input;
+} HarnessCase;
+
+static const HarnessCase cases[] = {
+        /* Payloaders */
+        {"rtph264pay", "rtph264pay", "rtph264pay config-interval=-1", INPUT_H264},
+        {"rtph265pay", "rtph265pay", "rtph265pay config-interval=-1", INPUT_H265},
+        {"rtpvp8pay", "rtpvp8pay", "rtpvp8pay", INPUT_VP8},
+        {"rtpopuspay", "rtpopuspay", "rtpopuspay", INPUT_OPUS},
+        {"rtpL16pay", "rtpL16pay", "rtpL16pay", INPUT_PCM_S16BE},
+        {"rtpklvpay", "rtpklvpay", "rtpklvpay", INPUT_KLV},
+        /* Depayloaders */
+        {"rtph264depay", "rtph264depay", "rtph264depay", INPUT_RTP_H264},
+        {"rtph265depay", "rtph265depay", "rtph265depay", INPUT_RTP_H265},
+        {"rtpvp8depay", "rtpvp8depay", "rtpvp8depay", INPUT_RTP_VP8},
+        {"rtpopusdepay", "rtpopusdepay", "rtpopusdepay", INPUT_RTP_OPUS},
+        {"rtpL16depay", "rtpL16depay", "rtpL16depay", INPUT_RTP_L16},
+        {"rtpklvdepay", "rtpklvdepay", "rtpklvdepay", INPUT_RTP_KLV},
+        /* Parsers */
+        {"h264parse", "h264parse", "h264parse", INPUT_H264},
+        {"h264parse-avc", "h264parse",
+                "h264parse ! video/x-h264,stream-format=avc,alignment=au", INPUT_H264},
+        {"h265parse", "h265parse", "h265parse", INPUT_H265},
+        /* Conversion */
+        {"videoconvert-rgba", "videoconvert",
+                "videoconvert ! video/x-raw,format=RGBA", INPUT_RAW_VIDEO},
+        {"videoconvert-nv12", "videoconvert",
+                "videoconvert ! video/x-raw,format=NV12", INPUT_RAW_VIDEO},
+        /* Encoders */
+        {"x264enc-ultrafast", "x264enc",
+                "x264enc speed-preset=ultrafast tune=zerolatency", INPUT_RAW_VIDEO},
+        {"x264enc-superfast", "x264enc",
+                "x264enc speed-preset=superfast tune=zerolatency", INPUT_RAW_VIDEO},
+        {"x264enc-veryfast", "x264enc",
+                "x264enc speed-preset=veryfast tune=zerolatency", INPUT_RAW_VIDEO},
+        {"x264enc-faster", "x264enc",
+                "x264enc speed-preset=faster tune=zerolatency", INPUT_RAW_VIDEO},
+        {"x264enc-fast", "x264enc",
+                "x264enc speed-preset=fast tune=zerolatency", INPUT_RAW_VIDEO},
+        {"x264enc-medium", "x264enc",
+                "x264enc speed-preset=medium tune=zerolatency", INPUT_RAW_VIDEO},
+};
+
+static gboolean
+have_factory (const gchar * name)
+{
+    GstElementFactory *factory = gst_element_factory_find (name);
+
+    if (!factory)
+        return FALSE;
+    gst_object_unref (factory);
+    return TRUE;
+}
+
+/*
+ * Moving diagonal bars. A set of distinct frames is cycled so encoders see
+ * motion instead of a static picture.
+ */
+static void
+generate_raw_video (Input * in)
+{
+    GstVideoInfo info;
+    GstBuffer *distinct[DISTINCT_VIDEO_FRAMES];
+    guint i, x, y, n_distinct = MIN (DISTINCT_VIDEO_FRAMES, frames);
+
+    gst_video_info_set_format (&info, GST_VIDEO_FORMAT_I420, width, height);
+    GST_VIDEO_INFO_FPS_N (&info) = 30;
+    GST_VIDEO_INFO_FPS_D (&info) = 1;
+    in->caps = gst_video_info_to_caps (&info);
+
+    for (i = 0; i < n_distinct; i++) {
+        GstVideoFrame frame;
+        guint8 *plane;
+        gint stride;
+
+        distinct[i] = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&info), NULL);
+        gst_video_frame_map (&frame, &info, distinct[i], GST_MAP_WRITE);
+        plane = (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&frame, 0);
+        stride = GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 0);
+        for (y = 0; y < (guint) height; y++)
+            for (x = 0; x < (guint) width; x++)
+                plane[y * stride + x] = (guint8) ((x + y + i * 8) & 0xff);
+        for (x = 1; x < 3; x++) {
+            plane = (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&frame, x);
+            stride = GST_VIDEO_FRAME_PLANE_STRIDE (&frame, x);
+            for (y = 0; y < (guint) GST_VIDEO_FRAME_COMP_HEIGHT (&frame, x); y++)
+                memset (plane + y * stride, 64 + x * 32 + i, GST_VIDEO_FRAME_COMP_WIDTH (&frame, x));
+        }
+        gst_video_frame_unmap (&frame);
+    }
+
+    for (i = 0; i < (guint) frames; i++) {
+        GstBuffer *buf = gst_buffer_copy (distinct[i % n_distinct]);
+
+        GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, 30);
+        GST_BUFFER_DURATION (buf) = GST_SECOND / 30;
+        g_ptr_array_add (in->buffers, buf);
+    }
+
+    for (i = 0; i < n_distinct; i++)
+        gst_buffer_unref (distinct[i]);
+}
+
+/*
+ * 20 ms frames of a 440 Hz tone.
+ */
+static void
+generate_pcm (Input * in, gboolean big_endian)
+{
+    gsize frame_size = AUDIO_FRAME_SAMPLES * AUDIO_CHANNELS * 2;
+    guint i, s, c;
+
+    in->caps = gst_caps_new_simple ("audio/x-raw",
+                                    "format", G_TYPE_STRING, big_endian ? "S16BE" : "S16LE",
+                                    "layout", G_TYPE_STRING, "interleaved",
+                                    "rate", G_TYPE_INT, AUDIO_RATE,
+                                    "channels", G_TYPE_INT, AUDIO_CHANNELS, NULL);
+
+    for (i = 0; i < (guint) frames; i++) {
+        GstBuffer *buf = gst_buffer_new_allocate (NULL, frame_size, NULL);
+        GstMapInfo map;
+
+        gst_buffer_map (buf, &map, GST_MAP_WRITE);
+        for (s = 0; s < AUDIO_FRAME_SAMPLES; s++) {
+            gdouble t = (gdouble) (i * AUDIO_FRAME_SAMPLES + s) / AUDIO_RATE;
+            gint16 v = (gint16) (8000 * sin (2 * G_PI * 440 * t));
+
+            for (c = 0; c < AUDIO_CHANNELS; c++) {
+                guint8 *p = map.data + (s * AUDIO_CHANNELS + c) * 2;
+                if (big_endian)
+                    GST_WRITE_UINT16_BE (p, (guint16) v);
+                else
+                    GST_WRITE_UINT16_LE (p, (guint16) v);
+            }
+        }
+        gst_buffer_unmap (buf, &map);
+
+        GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i * AUDIO_FRAME_SAMPLES, GST_SECOND, AUDIO_RATE);
+        GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (AUDIO_FRAME_SAMPLES, GST_SECOND, AUDIO_RATE);
+        g_ptr_array_add (in->buffers, buf);
+    }
+}
+
+/*
+ * One KLV local set per frame: 16 byte universal key, BER long form
+ * length and a 200 byte value.
+ */
+static void
+generate_klv (Input * in)
+{
+    static const guint8 key[16] = {
+            0x06, 0x0e, 0x2b, 0x34, 0x02, 0x0b, 0x01, 0x01,
+            0x0e, 0x01, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00
+    };
+    const guint value_size = 200;
+    guint i, j;
+
+    in->caps = gst_caps_new_simple ("meta/x-klv", "parsed", G_TYPE_BOOLEAN, TRUE, NULL);
+
+    for (i = 0; i < (guint) frames; i++) {
+        GstBuffer *buf = gst_buffer_new_allocate (NULL, 16 + 3 + value_size, NULL);
+        GstMapInfo map;
+
+        gst_buffer_map (buf, &map, GST_MAP_WRITE);
+        memcpy (map.data, key, 16);
+        map.data[16] = 0x82;
+        GST_WRITE_UINT16_BE (map.data + 17, value_size);
+        for (j = 0; j < value_size; j++)
+            map.data[19 + j] = (guint8) (i + j);
+        gst_buffer_unmap (buf, &map);
+
+        GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, 30);
+        GST_BUFFER_DURATION (buf) = GST_SECOND / 30;
+        g_ptr_array_add (in->buffers, buf);
+    }
+}
+
+/*
+ * Pushes a copy of every buffer of an input into a harness and collects
+ * what comes out, including what the element drains on EOS.
+ */
+static void
+harness_push_all (GstHarness * h, Input * in, GPtrArray * out)
+{
+    GstBuffer *buf;
+    guint i;
+
+    gst_harness_set_src_caps (h, gst_caps_ref (in->caps));
+    for (i = 0; i < in->buffers->len; i++) {
+        gst_harness_push (h, gst_buffer_copy ((GstBuffer *) g_ptr_array_index (in->buffers, i)));
+        while ((buf = gst_harness_try_pull (h)))
+            g_ptr_array_add (out, buf);
+    }
+    gst_harness_push_event (h, gst_event_new_eos ());
+    while ((buf = gst_harness_try_pull (h)))
+        g_ptr_array_add (out, buf);
+}
+
+/*
+ * @return The input, generating it on first use, or NULL if an element
+ * needed to produce it is missing.
+ */
+static Input *
+get_input (InputKind kind)
+{
+    Input *in = &inputs[kind];
+
+    if (in->buffers)
+        return in;
+    if (in->failed)
+        return NULL;
+
+    if (in->source != INPUT_LAST) {
+        Input *src;
+        GstHarness *h;
+
+        if (!have_factory (in->factory) || !(src = get_input (in->source))) {
+            in->failed = TRUE;
+            return NULL;
+        }
+
+        in->buffers = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+        h = gst_harness_new_parse (in->launch);
+        harness_push_all (h, src, in->buffers);
+        in->caps = gst_pad_get_current_caps (h->sinkpad);
+        gst_harness_teardown (h);
+
+        if (!in->caps || in->buffers->len == 0) {
+            g_printerr ("Producing %s input with '%s' failed\n", in->name, in->launch);
+            if (in->caps)
+                gst_caps_unref (in->caps);
+            in->caps = NULL;
+            g_ptr_array_unref (in->buffers);
+            in->buffers = NULL;
+            in->failed = TRUE;
+            return NULL;
+        }
+        return in;
+    }
+
+    in->buffers = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+    switch (kind) {
+        case INPUT_RAW_VIDEO:
+            generate_raw_video (in);
+            break;
+        case INPUT_PCM_S16LE:
+            generate_pcm (in, FALSE);
+            break;
+        case INPUT_PCM_S16BE:
+            generate_pcm (in, TRUE);
+            break;
+        case INPUT_KLV:
+            generate_klv (in);
+            break;
+        default:
+            g_assert_not_reached ();
+    }
+    return in;
+}
+
+static void
+report (const gchar * line)
+{
+    FILE *f = output ? fopen (output, "a") : stdout;
+
+    if (!f) {
+        g_printerr ("Can't open %s\n", output);
+        return;
+    }
+    fprintf (f, "%s\n", line);
+    if (f != stdout)
+        fclose (f);
+    else
+        fflush (f);
+}
+
+/*
+ * Runs one case. The input buffers are copied (metadata only, the memory
+ * is shared) before the clock starts, so an element that needs a writable
+ * buffer does not pay for the copy inside the measurement.
+ */
+static void
+run_case (const HarnessCase * c)
+{
+    GstHarness *h;
+    Input *in;
+    GstBuffer **bufs;
+    GstBuffer *buf;
+    guint i, n;
+    guint64 in_bytes = 0, out_buffers = 0, out_bytes = 0;
+    GstClockTime start, elapsed;
+    gdouble secs;
+    gchar *line;
+
+    if (!have_factory (c->factory) || !(in = get_input (c->input))) {
+        g_printerr ("Skipping %s: %s or its input is not available\n", c->name, c->factory);
+        return;
+    }
+
+    n = in->buffers->len;
+    bufs = g_new (GstBuffer *, n);
+    for (i = 0; i < n; i++) {
+        bufs[i] = gst_buffer_copy ((GstBuffer *) g_ptr_array_index (in->buffers, i));
+        in_bytes += gst_buffer_get_size (bufs[i]);
+    }
+
+    h = gst_harness_new_parse (c->launch);
+    gst_harness_set_src_caps (h, gst_caps_ref (in->caps));
+
+    start = gst_util_get_timestamp ();
+    for (i = 0; i < n; i++) {
+        gst_harness_push (h, bufs[i]);
+        while ((buf = gst_harness_try_pull (h))) {
+            out_buffers++;
+            out_bytes += gst_buffer_get_size (buf);
+            gst_buffer_unref (buf);
+        }
+    }
+    gst_harness_push_event (h, gst_event_new_eos ());
+    while ((buf = gst_harness_try_pull (h))) {
+        out_buffers++;
+        out_bytes += gst_buffer_get_size (buf);
+        gst_buffer_unref (buf);
+    }
+    elapsed = gst_util_get_timestamp () - start;
+
+    gst_harness_teardown (h);
+    g_free (bufs);
+
+    secs = (gdouble) elapsed / GST_SECOND;
+    line = g_strdup_printf ("{\"case\":\"%s\",\"launch\":\"%s\",\"input\":\"%s\","
+                            "\"buffers\":%u,\"input_bytes\":%" G_GUINT64_FORMAT ","
+                            "\"output_buffers\":%" G_GUINT64_FORMAT ",\"output_bytes\":%" G_GUINT64_FORMAT ","
+                            "\"seconds\":%.6f,\"ns_per_buffer\":%.1f,\"buffers_per_s\":%.1f,"
+                            "\"bytes_per_s\":%.1f}",
+                            c->name, c->launch, in->name, n, in_bytes, out_buffers, out_bytes,
+                            secs, (gdouble) elapsed / n, n / secs, in_bytes / secs);
+    report (line);
+    g_free (line);
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *optctx;
+    GError *error = NULL;
+    guint i;
+
+    optctx = g_option_context_new ("- per-element GstHarness microbenchmarks");
+    g_option_context_add_main_entries (optctx, entries, NULL);
+    g_option_context_add_group (optctx, gst_init_get_option_group ());
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
+
+    if (frames <= 0 || width <= 0 || height <= 0) {
+        g_printerr ("--frames, --width and --height must be positive\n");
+        return -1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+        if (filter && !strstr (cases[i].name, filter))
+            continue;
+        run_case (&cases[i]);
+    }
+
+    for (i = 0; i < INPUT_LAST; i++) {
+        if (inputs[i].buffers)
+            g_ptr_array_unref (inputs[i].buffers);
+        if (inputs[i].caps)
+            gst_caps_unref (inputs[i].caps);
+    }
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+//
+// Tests of the LL-HLS segmenter (cmaf_hls.cpp).
+//
+#include <gst/check/gstcheck.h>
+#include <string.h>
+
+#include "cmaf_hls.h"
+
+/*
+ * fMP4 output of the HLS segmenter (cmaf_hls.cpp), read back by qtdemux.
+ * 25 frames of 40 ms with a keyframe every 10, 200 ms parts and 400 ms
+ * segments give two complete segments of two 5 frame parts; the last 5
+ * frames are still pending. Every frame has its own size, so a demuxed
+ * sample tells which frame it is.
+ */
+#define HLS_TEST_FRAMES 25
+#define HLS_TEST_GOP 10
+#define HLS_TEST_PART_FRAMES 5
+#define HLS_TEST_FRAME_DURATION (40 * GST_MSECOND)
+#define HLS_TEST_PULL_TIMEOUT (5 * GST_SECOND)
+
+/* avcC of a 320x240 constrained baseline stream, one SPS and one PPS */
+static const guint8 hls_test_codec_data[] = {
+        0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x09,
+        0x67, 0x42, 0xc0, 0x1e, 0xda, 0x05, 0x07, 0xe8,
+        0x40, 0x01, 0x00, 0x04, 0x68, 0xce, 0x3c, 0x80
+};
+
+static gsize
+hls_test_frame_size (guint i)
+{
+    return 100 + i;
+}
+
+/* One length prefixed IDR or non-IDR slice */
+static GstBuffer *
+hls_test_frame (guint i)
+{
+    gsize size = hls_test_frame_size (i);
+    gboolean keyframe = i % HLS_TEST_GOP == 0;
+    GstBuffer *buf = gst_buffer_new_allocate (NULL, size, NULL);
+    GstMapInfo map;
+
+    gst_buffer_map (buf, &map, GST_MAP_WRITE);
+    memset (map.data, 0xaa, size);
+    GST_WRITE_UINT32_BE (map.data, size - 4);
+    map.data[4] = keyframe ? 0x65 : 0x41;
+    gst_buffer_unmap (buf, &map);
+
+    GST_BUFFER_PTS (buf) = GST_BUFFER_DTS (buf) = i * HLS_TEST_FRAME_DURATION;
+    GST_BUFFER_DURATION (buf) = HLS_TEST_FRAME_DURATION;
+    if (!keyframe)
+        GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    return buf;
+}
+
+/*
+ * @return The buffers qtdemux gets out of the chunks, pushed in order.
+ */
+static GPtrArray *
+hls_test_demux (GBytes ** chunks, guint n_chunks)
+{
+    GstElement *pipeline, *src, *sink;
+    GPtrArray *out = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+    GstFlowReturn ret;
+    gboolean eos = FALSE;
+    guint i;
+
+    pipeline = gst_parse_launch ("appsrc name=src ! qtdemux ! appsink name=sink sync=false", NULL);
+    fail_unless (pipeline != NULL);
+    src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+
+    for (i = 0; i < n_chunks; i++) {
+        GstBuffer *buf = gst_buffer_new_wrapped_bytes (chunks[i]);
+
+        g_signal_emit_by_name (src, "push-buffer", buf, &ret);
+        gst_buffer_unref (buf);
+        fail_unless_equals_int (ret, GST_FLOW_OK);
+    }
+    g_signal_emit_by_name (src, "end-of-stream", &ret);
+
+    while (TRUE) {
+        GstSample *sample = NULL;
+
+        g_signal_emit_by_name (sink, "try-pull-sample", HLS_TEST_PULL_TIMEOUT, &sample);
+        if (!sample)
+            break;
+        g_ptr_array_add (out, gst_buffer_ref (gst_sample_get_buffer (sample)));
+        gst_sample_unref (sample);
+    }
+    g_object_get (sink, "eos", &eos, NULL);
+    fail_unless (eos, "qtdemux did not get through the fragments");
+
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (src);
+    gst_object_unref (sink);
+    gst_object_unref (pipeline);
+    return out;
+}
+
+/*
+ * Checks that the demuxed buffers are frames first, first + 1, ... with
+ * their keyframe flags and 40 ms apart.
+ */
+static void
+hls_test_check_frames (GPtrArray * out, guint first)
+{
+    GstBuffer *head = (GstBuffer *) g_ptr_array_index (out, 0);
+    guint k;
+
+    for (k = 0; k < out->len; k++) {
+        GstBuffer *buf = (GstBuffer *) g_ptr_array_index (out, k);
+        guint i = first + k;
+
+        fail_unless_equals_int (gst_buffer_get_size (buf), hls_test_frame_size (i));
+        fail_unless_equals_int (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT),
+                                i % HLS_TEST_GOP != 0);
+        fail_unless_equals_uint64 (GST_BUFFER_DURATION (buf), HLS_TEST_FRAME_DURATION);
+        fail_unless_equals_uint64 (GST_BUFFER_PTS (buf) - GST_BUFFER_PTS (head), k * HLS_TEST_FRAME_DURATION);
+        fail_unless_equals_uint64 (GST_BUFFER_DTS (buf) - GST_BUFFER_DTS (head), k * HLS_TEST_FRAME_DURATION);
+    }
+}
+
+GST_START_TEST (hls_fragments)
+    {
+        GstBuffer *codec_data = gst_buffer_new_allocate (NULL, sizeof (hls_test_codec_data), NULL);
+        GBytes *chunks[1 + 2 * 2];
+        GstCaps *caps;
+        GPtrArray *out;
+        gboolean complete, independent;
+        guint i, msn, part;
+
+        gst_buffer_fill (codec_data, 0, hls_test_codec_data, sizeof (hls_test_codec_data));
+        caps = gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING, "avc",
+                                    "alignment", G_TYPE_STRING, "au", "width", G_TYPE_INT, 320,
+                                    "height", G_TYPE_INT, 240, "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+        gst_buffer_unref (codec_data);
+
+        cmaf_hls_segmenter_start (200, 400);
+        for (i = 0; i < HLS_TEST_FRAMES; i++) {
+            GstBuffer *frame = hls_test_frame (i);
+            GstSample *sample = gst_sample_new (frame, caps, NULL, NULL);
+
+            cmaf_hls_segmenter_push (sample);
+            gst_sample_unref (sample);
+            gst_buffer_unref (frame);
+        }
+        gst_caps_unref (caps);
+
+        /* Segments end in front of keyframes, the third is not open yet */
+        for (msn = 0; msn < 2; msn++) {
+            complete = FALSE;
+            fail_unless_equals_int (cmaf_hls_segmenter_get_parts (msn, &complete), 2);
+            fail_unless (complete);
+        }
+        fail_unless_equals_int (cmaf_hls_segmenter_get_parts (2, NULL), -1);
+
+        /* Each part with its init segment on its own */
+        for (msn = 0; msn < 2; msn++) {
+            for (part = 0; part < 2; part++) {
+                chunks[1] = cmaf_hls_segmenter_get_part (msn, part, &chunks[0], &independent);
+                fail_unless (chunks[1] != NULL);
+                fail_unless_equals_int (independent, part == 0);
+
+                out = hls_test_demux (chunks, 2);
+                fail_unless_equals_int (out->len, HLS_TEST_PART_FRAMES);
+                hls_test_check_frames (out, msn * HLS_TEST_GOP + part * HLS_TEST_PART_FRAMES);
+                g_ptr_array_unref (out);
+                g_bytes_unref (chunks[0]);
+                g_bytes_unref (chunks[1]);
+            }
+        }
+
+        /* All parts after one init, the decode times continue across cuts */
+        chunks[0] = NULL;
+        for (i = 0; i < 4; i++) {
+            GBytes *init = NULL;
+
+            chunks[1 + i] = cmaf_hls_segmenter_get_part (i / 2, i % 2, &init, NULL);
+            if (chunks[0]) {
+                fail_unless (g_bytes_equal (chunks[0], init));
+                g_bytes_unref (init);
+            } else {
+                chunks[0] = init;
+            }
+        }
+        out = hls_test_demux (chunks, G_N_ELEMENTS (chunks));
+        fail_unless_equals_int (out->len, 2 * HLS_TEST_GOP);
+        hls_test_check_frames (out, 0);
+        g_ptr_array_unref (out);
+        for (i = 0; i < G_N_ELEMENTS (chunks); i++)
+            g_bytes_unref (chunks[i]);
+
+        cmaf_hls_segmenter_stop ();
+    }
+
+GST_END_TEST;
+
+static Suite *
+hls_suite (void) {
+    Suite *s = suite_create("hls");
+
+    TCase *tc_chain = tcase_create("segmenter");
+
+    tcase_set_timeout(tc_chain, 60);
+
+    suite_add_tcase(s, tc_chain);
+    tcase_add_test (tc_chain, hls_fragments);
+
+    return s;
+}
+
+GST_CHECK_MAIN (hls);
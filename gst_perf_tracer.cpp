@@ -0,0 +1,568 @@
+//
+// perftrace, a low overhead tracer plugin.
+// Records per element processing time, per pad buffer inter-arrival time,
+// queue fill levels and the thread every record came from. Streaming
+// threads append fixed size records to their own single producer ring, a
+// writer thread drains the rings into a binary log (perf_log_format.h)
+// every interval, so the streaming threads never take a lock.
+//
+// GST_PLUGIN_PATH=<build dir> GST_TRACERS="perftrace(file=/tmp/x.perf,interval=500)" ./rtsp2webrtc ...
+// perflogreader /tmp/x.perf
+//
+
+#include <gst/gst.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "perf_log_format.h"
+
+#define PACKAGE "gstreamer-cpp-example"
+#define VERSION "1.0"
+
+#define DEFAULT_INTERVAL_MS 1000
+#define THREAD_RING_RECORDS (64 * 1024)     /* power of two */
+#define MAX_PUSH_DEPTH 64
+
+/*
+ * One streaming thread's ring. Only the owning thread writes head, only
+ * the writer thread writes tail.
+ */
+typedef struct
+{
+    guint32 tid;
+    PerfRecord *records;
+    volatile guint head;
+    volatile guint tail;
+    volatile gint dropped;
+    volatile gint dead;
+    /* Push stack, only touched by the owning thread */
+    struct
+    {
+        guint32 id;
+        guint32 buffers;
+        GstClockTime start;
+        GstClockTime child;
+    } stack[MAX_PUSH_DEPTH];
+    guint depth;
+} ThreadRing;
+
+typedef struct
+{
+    guint32 id;
+    GstClockTime last;
+} PadState;
+
+typedef struct
+{
+    GstTracer parent;
+
+    gchar *filename;
+    guint interval_ms;
+    FILE *file;
+    GThread *writer;
+    GMutex lock;                /* rings, names and queues lists */
+    GCond cond;
+    gboolean stopping;
+    GPtrArray *rings;
+    GPtrArray *names;           /* PerfRecord + name, pending for the writer */
+    GPtrArray *queues;          /* GWeakRef to queue elements */
+    volatile gint next_id;
+} PerfTracer;
+
+typedef struct
+{
+    GstTracerClass parent_class;
+} PerfTracerClass;
+
+G_DEFINE_TYPE (PerfTracer, perf_tracer, GST_TYPE_TRACER);
+
+static GQuark element_id_quark;
+static GQuark pad_state_quark;
+static PerfTracer *active_tracer = NULL;
+
+static void thread_ring_release (gpointer data);
+static GPrivate thread_ring = G_PRIVATE_INIT (thread_ring_release);
+
+static void
+thread_ring_release (gpointer data)
+{
+    ThreadRing *ring = (ThreadRing *) data;
+
+    /* The writer drains and frees it */
+    g_atomic_int_set (&ring->dead, 1);
+}
+
+static ThreadRing *
+thread_ring_get (PerfTracer * self)
+{
+    ThreadRing *ring = (ThreadRing *) g_private_get (&thread_ring);
+
+    if (G_LIKELY (ring))
+        return ring;
+
+    ring = g_new0 (ThreadRing, 1);
+    ring->tid = (guint32) syscall (SYS_gettid);
+    ring->records = g_new (PerfRecord, THREAD_RING_RECORDS);
+    g_private_set (&thread_ring, ring);
+
+    g_mutex_lock (&self->lock);
+    g_ptr_array_add (self->rings, ring);
+    g_mutex_unlock (&self->lock);
+
+    return ring;
+}
+
+static inline void
+thread_ring_append (ThreadRing * ring, guint8 type, GstClockTime ts, guint32 id, guint32 arg, guint64 value)
+{
+    guint head = ring->head;
+    PerfRecord *rec;
+
+    if (head - g_atomic_int_get (&ring->tail) >= THREAD_RING_RECORDS) {
+        g_atomic_int_inc (&ring->dropped);
+        return;
+    }
+    rec = &ring->records[head & (THREAD_RING_RECORDS - 1)];
+    rec->type = type;
+    rec->tid = ring->tid;
+    rec->ts = ts;
+    rec->id = id;
+    rec->arg = arg;
+    rec->value = value;
+    g_atomic_int_set (&ring->head, head + 1);
+}
+
+/*
+ * Names are rare, they go through the lock to the writer.
+ */
+static guint32
+perf_tracer_new_id (PerfTracer * self, const gchar * name)
+{
+    guint32 id = (guint32) g_atomic_int_add (&self->next_id, 1);
+    gsize len = strlen (name);
+    gsize padded = (len + 7) & ~((gsize) 7);
+    guint8 *entry = (guint8 *) g_malloc0 (sizeof (PerfRecord) + padded);
+    PerfRecord *rec = (PerfRecord *) entry;
+
+    rec->type = PERF_RECORD_NAME;
+    rec->ts = gst_util_get_timestamp ();
+    rec->id = id;
+    rec->arg = (guint32) len;
+    memcpy (entry + sizeof (PerfRecord), name, len);
+
+    g_mutex_lock (&self->lock);
+    g_ptr_array_add (self->names, entry);
+    g_mutex_unlock (&self->lock);
+
+    return id;
+}
+
+static guint32
+perf_tracer_element_id (PerfTracer * self, GstElement * element)
+{
+    guint32 id = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (element), element_id_quark));
+
+    if (G_LIKELY (id))
+        return id;
+
+    GST_OBJECT_LOCK (element);
+    id = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (element), element_id_quark));
+    if (!id) {
+        id = perf_tracer_new_id (self, GST_OBJECT_NAME (element));
+        g_object_set_qdata (G_OBJECT (element), element_id_quark, GUINT_TO_POINTER (id));
+    }
+    GST_OBJECT_UNLOCK (element);
+
+    return id;
+}
+
+static PadState *
+perf_tracer_pad_state (PerfTracer * self, GstPad * pad, GstElement * element)
+{
+    PadState *state = (PadState *) g_object_get_qdata (G_OBJECT (pad), pad_state_quark);
+
+    if (G_LIKELY (state))
+        return state;
+
+    GST_OBJECT_LOCK (pad);
+    state = (PadState *) g_object_get_qdata (G_OBJECT (pad), pad_state_quark);
+    if (!state) {
+        gchar *name = g_strdup_printf ("%s.%s", GST_OBJECT_NAME (element), GST_OBJECT_NAME (pad));
+
+        state = g_new0 (PadState, 1);
+        state->id = perf_tracer_new_id (self, name);
+        state->last = GST_CLOCK_TIME_NONE;
+        g_object_set_qdata_full (G_OBJECT (pad), pad_state_quark, state, g_free);
+        g_free (name);
+    }
+    GST_OBJECT_UNLOCK (pad);
+
+    return state;
+}
+
+/*
+ * A push enters the peer element's chain function. Ghost and proxy pads
+ * are followed through without a record of their own.
+ */
+static void
+perf_tracer_push_enter (PerfTracer * self, GstClockTime ts, GstPad * pad, guint buffers)
+{
+    ThreadRing *ring = thread_ring_get (self);
+    GstPad *peer = GST_PAD_PEER (pad);
+    GstObject *parent = peer ? GST_OBJECT_PARENT (peer) : NULL;
+    guint32 id = 0;
+
+    if (parent && GST_IS_ELEMENT (parent) && !GST_IS_BIN (parent)) {
+        PadState *state = perf_tracer_pad_state (self, peer, GST_ELEMENT (parent));
+
+        if (GST_CLOCK_TIME_IS_VALID (state->last))
+            thread_ring_append (ring, PERF_RECORD_ARRIVAL, ts, state->id, buffers, ts - state->last);
+        state->last = ts;
+        id = perf_tracer_element_id (self, GST_ELEMENT (parent));
+    }
+
+    if (ring->depth < MAX_PUSH_DEPTH) {
+        ring->stack[ring->depth].id = id;
+        ring->stack[ring->depth].buffers = buffers;
+        ring->stack[ring->depth].start = ts;
+        ring->stack[ring->depth].child = 0;
+    }
+    ring->depth++;
+}
+
+static void
+perf_tracer_push_leave (PerfTracer * self, GstClockTime ts)
+{
+    ThreadRing *ring = thread_ring_get (self);
+    GstClockTime inclusive;
+
+    if (ring->depth == 0)
+        return;
+    ring->depth--;
+    if (ring->depth >= MAX_PUSH_DEPTH)
+        return;
+
+    inclusive = ts - ring->stack[ring->depth].start;
+    if (ring->stack[ring->depth].id) {
+        GstClockTime child = ring->stack[ring->depth].child;
+
+        thread_ring_append (ring, PERF_RECORD_PROC, ring->stack[ring->depth].start,
+                            ring->stack[ring->depth].id, ring->stack[ring->depth].buffers,
+                            inclusive > child ? inclusive - child : 0);
+    }
+    if (ring->depth > 0 && ring->depth <= MAX_PUSH_DEPTH)
+        ring->stack[ring->depth - 1].child += inclusive;
+}
+
+static void
+perf_tracer_push_pre (GObject * self, GstClockTime ts, GstPad * pad, GstBuffer * buffer)
+{
+    perf_tracer_push_enter ((PerfTracer *) self, ts, pad, 1);
+}
+
+static void
+perf_tracer_push_list_pre (GObject * self, GstClockTime ts, GstPad * pad, GstBufferList * list)
+{
+    perf_tracer_push_enter ((PerfTracer *) self, ts, pad, gst_buffer_list_length (list));
+}
+
+static void
+perf_tracer_push_post (GObject * self, GstClockTime ts, GstPad * pad, GstFlowReturn res)
+{
+    perf_tracer_push_leave ((PerfTracer *) self, ts);
+}
+
+static void
+perf_tracer_element_new (GObject * object, GstClockTime ts, GstElement * element)
+{
+    PerfTracer *self = (PerfTracer *) object;
+    GstElementFactory *factory = gst_element_get_factory (element);
+    const gchar *name = factory ? GST_OBJECT_NAME (factory) : NULL;
+
+    if (g_strcmp0 (name, "queue") == 0 || g_strcmp0 (name, "queue2") == 0) {
+        GWeakRef *ref = g_new0 (GWeakRef, 1);
+
+        g_weak_ref_init (ref, element);
+        g_mutex_lock (&self->lock);
+        g_ptr_array_add (self->queues, ref);
+        g_mutex_unlock (&self->lock);
+    }
+}
+
+static void
+write_record (PerfTracer * self, guint8 type, guint32 tid, GstClockTime ts, guint32 id, guint32 arg,
+              guint64 value)
+{
+    PerfRecord rec;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.type = type;
+    rec.tid = tid;
+    rec.ts = ts;
+    rec.id = id;
+    rec.arg = arg;
+    rec.value = value;
+    fwrite (&rec, sizeof (rec), 1, self->file);
+}
+
+/*
+ * Writer thread work: pending names first, then every ring, then one
+ * sample of every queue still alive.
+ */
+static void
+perf_tracer_flush (PerfTracer * self)
+{
+    GPtrArray *names, *rings, *queues;
+    GstClockTime now = gst_util_get_timestamp ();
+    guint i;
+
+    g_mutex_lock (&self->lock);
+    names = self->names;
+    self->names = g_ptr_array_new_with_free_func (g_free);
+    rings = g_ptr_array_new ();
+    for (i = 0; i < self->rings->len; i++)
+        g_ptr_array_add (rings, g_ptr_array_index (self->rings, i));
+    queues = g_ptr_array_new ();
+    for (i = 0; i < self->queues->len; i++)
+        g_ptr_array_add (queues, g_ptr_array_index (self->queues, i));
+    g_mutex_unlock (&self->lock);
+
+    for (i = 0; i < names->len; i++) {
+        PerfRecord *rec = (PerfRecord *) g_ptr_array_index (names, i);
+
+        fwrite (rec, sizeof (PerfRecord) + ((rec->arg + 7) & ~7u), 1, self->file);
+    }
+    g_ptr_array_unref (names);
+
+    for (i = 0; i < rings->len; i++) {
+        ThreadRing *ring = (ThreadRing *) g_ptr_array_index (rings, i);
+        gboolean dead = g_atomic_int_get (&ring->dead);
+        guint head = g_atomic_int_get (&ring->head);
+        guint tail = ring->tail;
+        gint dropped;
+
+        while (tail != head) {
+            guint start = tail & (THREAD_RING_RECORDS - 1);
+            guint n = MIN (head - tail, THREAD_RING_RECORDS - start);
+
+            fwrite (&ring->records[start], sizeof (PerfRecord), n, self->file);
+            tail += n;
+        }
+        g_atomic_int_set (&ring->tail, tail);
+
+        dropped = g_atomic_int_and (&ring->dropped, 0);
+        if (dropped)
+            write_record (self, PERF_RECORD_DROPS, ring->tid, now, 0, (guint32) dropped, 0);
+
+        /* The thread is gone and its ring drained, nobody refers to it any more */
+        if (dead) {
+            g_mutex_lock (&self->lock);
+            g_ptr_array_remove_fast (self->rings, ring);
+            g_mutex_unlock (&self->lock);
+            g_free (ring->records);
+            g_free (ring);
+        }
+    }
+    g_ptr_array_unref (rings);
+
+    for (i = 0; i < queues->len; i++) {
+        GWeakRef *ref = (GWeakRef *) g_ptr_array_index (queues, i);
+        GstElement *queue = (GstElement *) g_weak_ref_get (ref);
+        guint buffers = 0;
+        guint64 time = 0;
+
+        if (!queue) {
+            g_mutex_lock (&self->lock);
+            g_ptr_array_remove_fast (self->queues, ref);
+            g_mutex_unlock (&self->lock);
+            g_weak_ref_clear (ref);
+            g_free (ref);
+            continue;
+        }
+        g_object_get (queue, "current-level-buffers", &buffers, "current-level-time", &time, NULL);
+        write_record (self, PERF_RECORD_QUEUE, 0, now, perf_tracer_element_id (self, queue), buffers, time);
+        gst_object_unref (queue);
+    }
+    g_ptr_array_unref (queues);
+
+    fflush (self->file);
+}
+
+static gpointer
+perf_tracer_writer (gpointer data)
+{
+    PerfTracer *self = (PerfTracer *) data;
+    gboolean stopping;
+
+    do {
+        gint64 end = g_get_monotonic_time () + self->interval_ms * G_TIME_SPAN_MILLISECOND;
+
+        g_mutex_lock (&self->lock);
+        while (!self->stopping && g_cond_wait_until (&self->cond, &self->lock, end));
+        stopping = self->stopping;
+        g_mutex_unlock (&self->lock);
+
+        perf_tracer_flush (self);
+    } while (!stopping);
+
+    return NULL;
+}
+
+static void
+perf_tracer_stop (PerfTracer * self)
+{
+    if (!self->writer)
+        return;
+    g_mutex_lock (&self->lock);
+    self->stopping = TRUE;
+    g_cond_signal (&self->cond);
+    g_mutex_unlock (&self->lock);
+    g_thread_join (self->writer);
+    self->writer = NULL;
+    fclose (self->file);
+    self->file = NULL;
+}
+
+/*
+ * Applications rarely call gst_deinit (), the last records are written
+ * at exit.
+ */
+static void
+perf_tracer_atexit (void)
+{
+    if (active_tracer)
+        perf_tracer_stop (active_tracer);
+}
+
+/*
+ * Parses the tracer parameters, e.g. perftrace(file=x.perf,interval=200).
+ */
+static void
+perf_tracer_parse_params (PerfTracer * self)
+{
+    gchar *params = NULL, *desc;
+    GstStructure *s;
+
+    g_object_get (self, "params", &params, NULL);
+    if (!params)
+        return;
+
+    desc = g_strdup_printf ("perftrace,%s", params);
+    s = gst_structure_from_string (desc, NULL);
+    if (s) {
+        const gchar *file = gst_structure_get_string (s, "file");
+        gint interval;
+
+        if (file) {
+            g_free (self->filename);
+            self->filename = g_strdup (file);
+        }
+        if (gst_structure_get_int (s, "interval", &interval) && interval > 0)
+            self->interval_ms = interval;
+        gst_structure_free (s);
+    } else {
+        g_printerr ("perftrace: can't parse parameters '%s'\n", params);
+    }
+    g_free (desc);
+    g_free (params);
+}
+
+static void
+perf_tracer_constructed (GObject * object)
+{
+    PerfTracer *self = (PerfTracer *) object;
+    GstTracer *tracer = GST_TRACER (self);
+    PerfLogHeader header;
+
+    G_OBJECT_CLASS (perf_tracer_parent_class)->constructed (object);
+
+    perf_tracer_parse_params (self);
+    self->file = fopen (self->filename, "wb");
+    if (!self->file) {
+        g_printerr ("perftrace: can't open %s\n", self->filename);
+        return;
+    }
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, PERF_LOG_MAGIC, sizeof (header.magic));
+    header.version = PERF_LOG_VERSION;
+    header.record_size = sizeof (PerfRecord);
+    header.start_ts = gst_util_get_timestamp ();
+    fwrite (&header, sizeof (header), 1, self->file);
+
+    gst_tracing_register_hook (tracer, "pad-push-pre", G_CALLBACK (perf_tracer_push_pre));
+    gst_tracing_register_hook (tracer, "pad-push-post", G_CALLBACK (perf_tracer_push_post));
+    gst_tracing_register_hook (tracer, "pad-push-list-pre", G_CALLBACK (perf_tracer_push_list_pre));
+    gst_tracing_register_hook (tracer, "pad-push-list-post", G_CALLBACK (perf_tracer_push_post));
+    gst_tracing_register_hook (tracer, "element-new", G_CALLBACK (perf_tracer_element_new));
+
+    self->writer = g_thread_new ("perftrace", perf_tracer_writer, self);
+    if (!active_tracer) {
+        active_tracer = self;
+        atexit (perf_tracer_atexit);
+    }
+}
+
+static void
+perf_tracer_finalize (GObject * object)
+{
+    PerfTracer *self = (PerfTracer *) object;
+    guint i;
+
+    perf_tracer_stop (self);
+    if (active_tracer == self)
+        active_tracer = NULL;
+
+    for (i = 0; i < self->queues->len; i++) {
+        GWeakRef *ref = (GWeakRef *) g_ptr_array_index (self->queues, i);
+
+        g_weak_ref_clear (ref);
+        g_free (ref);
+    }
+    g_ptr_array_unref (self->queues);
+    g_ptr_array_unref (self->names);
+    /* Rings of threads still alive are leaked on purpose, they may still write */
+    g_ptr_array_unref (self->rings);
+    g_mutex_clear (&self->lock);
+    g_cond_clear (&self->cond);
+    g_free (self->filename);
+
+    G_OBJECT_CLASS (perf_tracer_parent_class)->finalize (object);
+}
+
+static void
+perf_tracer_class_init (PerfTracerClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->constructed = perf_tracer_constructed;
+    gobject_class->finalize = perf_tracer_finalize;
+
+    element_id_quark = g_quark_from_static_string ("perftrace-element-id");
+    pad_state_quark = g_quark_from_static_string ("perftrace-pad-state");
+}
+
+static void
+perf_tracer_init (PerfTracer * self)
+{
+    self->filename = g_strdup_printf ("gstperf-%d.log", (gint) getpid ());
+    self->interval_ms = DEFAULT_INTERVAL_MS;
+    g_mutex_init (&self->lock);
+    g_cond_init (&self->cond);
+    self->rings = g_ptr_array_new ();
+    self->names = g_ptr_array_new_with_free_func (g_free);
+    self->queues = g_ptr_array_new ();
+    self->next_id = 1;
+}
+
+static gboolean
+plugin_init (GstPlugin * plugin)
+{
+    return gst_tracer_register (plugin, "perftrace", perf_tracer_get_type ());
+}
+
+GST_PLUGIN_DEFINE (GST_VERSION_MAJOR, GST_VERSION_MINOR, perftracer,
+                   "Per element processing time, inter-arrival and queue level tracer",
+                   plugin_init, VERSION, "LGPL", PACKAGE, "https://github.com/sampleref/gstreamer-cpp-example")
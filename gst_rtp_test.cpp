@@ -5,7 +5,9 @@
 #include <gst/check/gstharness.h>
 #include <gst/audio/audio.h>
 #include <gst/base/base.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define RELEASE_ELEMENT(x) if(x) {gst_object_unref(x); x = NULL;}
 
@@ -16,6 +18,119 @@ static guint chain_list_bytes_received;
 
 #define LOOP_COUNT 1
 
+/*
+ * Allocation counters, only counting while alloc_counting is set, which
+ * is from the first push of an allocation run until its EOS reaches the
+ * sink. Heap allocations are counted by interposing malloc/calloc/realloc,
+ * GstMemory, GstBuffer and GstBufferList creations through the
+ * mini-object-created tracer hook. Outside that window the interposers
+ * only forward to glibc.
+ */
+static volatile gint alloc_counting = 0;
+static volatile gint alloc_mallocs = 0;
+static volatile gint alloc_memories = 0;
+static volatile gint alloc_buffers = 0;
+static volatile gint alloc_buffer_lists = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t nmemb, size_t size);
+void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+    if (alloc_counting)
+        g_atomic_int_inc (&alloc_mallocs);
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    if (alloc_counting)
+        g_atomic_int_inc (&alloc_mallocs);
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    if (alloc_counting)
+        g_atomic_int_inc (&alloc_mallocs);
+    return __libc_realloc (ptr, size);
+}
+}
+#endif
+
+typedef struct
+{
+    GstTracer parent;
+} AllocTracer;
+
+typedef struct
+{
+    GstTracerClass parent_class;
+} AllocTracerClass;
+
+G_DEFINE_TYPE (AllocTracer, alloc_tracer, GST_TYPE_TRACER);
+
+static void
+alloc_tracer_mini_object_created (GObject * self, GstClockTime ts, GstMiniObject * object)
+{
+    if (!alloc_counting)
+        return;
+
+    if (GST_MINI_OBJECT_TYPE (object) == GST_TYPE_MEMORY)
+        g_atomic_int_inc (&alloc_memories);
+    else if (GST_MINI_OBJECT_TYPE (object) == GST_TYPE_BUFFER)
+        g_atomic_int_inc (&alloc_buffers);
+    else if (GST_MINI_OBJECT_TYPE (object) == GST_TYPE_BUFFER_LIST)
+        g_atomic_int_inc (&alloc_buffer_lists);
+}
+
+static void
+alloc_tracer_class_init (AllocTracerClass * klass)
+{
+}
+
+static void
+alloc_tracer_init (AllocTracer * self)
+{
+    gst_tracing_register_hook (GST_TRACER (self), "mini-object-created",
+                               G_CALLBACK (alloc_tracer_mini_object_created));
+}
+
+/*
+ * Resets the counters and starts or stops counting.
+ */
+static void
+alloc_counting_set (gboolean enable)
+{
+    if (enable) {
+        g_atomic_int_set (&alloc_mallocs, 0);
+        g_atomic_int_set (&alloc_memories, 0);
+        g_atomic_int_set (&alloc_buffers, 0);
+        g_atomic_int_set (&alloc_buffer_lists, 0);
+    }
+    g_atomic_int_set (&alloc_counting, enable);
+}
+
+/*
+ * Network impairment applied between payloader and depayloader.
+ * Probabilities are per packet, jitter is the largest arrival time
+ * offset.
+ */
+typedef struct
+{
+    gdouble loss;
+    gdouble reorder;
+    gdouble duplicate;
+    guint jitter_ms;
+    guint32 seed;
+} rtp_impairment;
+
 /*
  * RTP pipeline structure to store the required elements.
  */
@@ -29,7 +144,31 @@ typedef struct
     const guint8 *frame_data;
     int frame_data_size;
     int frame_count;
+    int loop_count;
     GstEvent *custom_event;
+    guint64 packets;
+    guint64 packet_bytes;
+    guint64 pay_pushes;
+    guint64 chain_calls;
+    gint64 start_time;
+    gint64 end_time;
+    guint rate;
+    GstClockTime *push_times;
+    GstClockTime *latencies;
+    guint n_latencies;
+    gboolean count_allocs;
+    GstElement *jitterbuffer;
+    GstPad *impair_sink;
+    rtp_impairment impairment;
+    GRand *rand;
+    GstBuffer *held;
+    guint64 impair_lost;
+    guint64 impair_reordered;
+    guint64 impair_duplicated;
+    guint64 depay_buffers;
+    const guint8 **packet_data;
+    const guint *packet_sizes;
+    GstBuffer **inputs;
 } rtp_pipeline;
 
 /*
@@ -38,7 +177,7 @@ typedef struct
  * @param frame_data_size Frame data size in bytes.
  * @param frame_count Frame count.
  * @param filtercaps Caps filters.
- * @param pay Payloader name.
+ * @param pay Payloader name, NULL to push RTP packets into the depayloader.
  * @param depay Depayloader name.
  * @return
  * Returns pointer to the RTP pipeline.
@@ -53,7 +192,7 @@ rtp_pipeline_create (const guint8 * frame_data, int frame_data_size,
     GstCaps *caps;
 
     /* Check parameters. */
-    if (!frame_data || !pay || !depay) {
+    if (!frame_data || !depay) {
         return NULL;
     }
 
@@ -63,19 +202,42 @@ rtp_pipeline_create (const guint8 * frame_data, int frame_data_size,
     p->frame_data = frame_data;
     p->frame_data_size = frame_data_size;
     p->frame_count = frame_count;
+    p->loop_count = LOOP_COUNT;
     p->custom_event = NULL;
+    p->packets = 0;
+    p->packet_bytes = 0;
+    p->pay_pushes = 0;
+    p->chain_calls = 0;
+    p->start_time = 0;
+    p->end_time = 0;
+    p->rate = 0;
+    p->push_times = NULL;
+    p->latencies = NULL;
+    p->n_latencies = 0;
+    p->count_allocs = FALSE;
+    p->jitterbuffer = NULL;
+    p->impair_sink = NULL;
+    p->rand = NULL;
+    p->held = NULL;
+    p->impair_lost = 0;
+    p->impair_reordered = 0;
+    p->impair_duplicated = 0;
+    p->depay_buffers = 0;
+    p->packet_data = NULL;
+    p->packet_sizes = NULL;
+    p->inputs = NULL;
 
     /* Create elements. */
-    pipeline_name = g_strdup_printf ("%s-%s-pipeline", pay, depay);
+    pipeline_name = g_strdup_printf ("%s-%s-pipeline", pay ? pay : "replay", depay);
     p->pipeline = gst_pipeline_new (pipeline_name);
     g_free (pipeline_name);
     p->appsrc = gst_element_factory_make ("appsrc", NULL);
-    p->rtppay = gst_element_factory_make (pay, NULL);
+    p->rtppay = pay ? gst_element_factory_make (pay, NULL) : NULL;
     p->rtpdepay = gst_element_factory_make (depay, NULL);
     p->fakesink = gst_element_factory_make ("fakesink", NULL);
 
     /* One or more elements are not created successfully or failed to create p? */
-    if (!p->pipeline || !p->appsrc || !p->rtppay || !p->rtpdepay || !p->fakesink) {
+    if (!p->pipeline || !p->appsrc || (pay && !p->rtppay) || !p->rtpdepay || !p->fakesink) {
         /* Release created elements. */
         RELEASE_ELEMENT (p->pipeline);
         RELEASE_ELEMENT (p->appsrc);
@@ -97,13 +259,19 @@ rtp_pipeline_create (const guint8 * frame_data, int frame_data_size,
 
     /* Add elements to the pipeline. */
     gst_bin_add (GST_BIN (p->pipeline), p->appsrc);
-    gst_bin_add (GST_BIN (p->pipeline), p->rtppay);
+    if (p->rtppay)
+        gst_bin_add (GST_BIN (p->pipeline), p->rtppay);
     gst_bin_add (GST_BIN (p->pipeline), p->rtpdepay);
     gst_bin_add (GST_BIN (p->pipeline), p->fakesink);
 
-    /* Link elements. */
-    gst_element_link (p->appsrc, p->rtppay);
-    gst_element_link (p->rtppay, p->rtpdepay);
+    /* Link elements. Without a payloader the frames are RTP packets fed
+     * straight to the depayloader. */
+    if (p->rtppay) {
+        gst_element_link (p->appsrc, p->rtppay);
+        gst_element_link (p->rtppay, p->rtpdepay);
+    } else {
+        gst_element_link (p->appsrc, p->rtpdepay);
+    }
     gst_element_link (p->rtpdepay, p->fakesink);
 
     return p;
@@ -212,6 +380,200 @@ depay_event_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
     return GST_PAD_PROBE_OK;
 }
 
+/*
+ * Measures the pay->depay latency of every frame leaving the depayloader.
+ * The frame is found from its PTS, which rtp_pipeline_run() sets to the
+ * frame index times the frame duration when timing is enabled.
+ */
+static void
+rtp_pipeline_latency_buffer (rtp_pipeline * p, GstBuffer * buf, GstClockTime now)
+{
+    GstClockTime duration = GST_SECOND / p->rate;
+    guint64 idx;
+
+    if (!GST_BUFFER_PTS_IS_VALID (buf))
+        return;
+    idx = GST_BUFFER_PTS (buf) / duration;
+    if (idx >= (guint64) p->frame_count * p->loop_count || p->push_times[idx] == 0)
+        return;
+
+    p->latencies[p->n_latencies++] = now - p->push_times[idx];
+    /* One sample per frame, also for depayloaders that push per NAL */
+    p->push_times[idx] = 0;
+}
+
+static GstPadProbeReturn
+depay_latency_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    rtp_pipeline *p = (rtp_pipeline *) user_data;
+    GstClockTime now = gst_util_get_timestamp ();
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+        guint i, len = gst_buffer_list_length (list);
+
+        for (i = 0; i < len; i++)
+            rtp_pipeline_latency_buffer (p, gst_buffer_list_get (list, i), now);
+    } else {
+        rtp_pipeline_latency_buffer (p, GST_PAD_PROBE_INFO_BUFFER (info), now);
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Enables per-frame latency measurement. Frames are pushed at a steady rate
+ * and stamped at the appsrc push, the latency is taken at the depayloader's
+ * src pad.
+ * @param p Pointer to the RTP pipeline.
+ * @param rate Frames per second to push at.
+ */
+static void
+rtp_pipeline_enable_timing (rtp_pipeline * p, guint rate)
+{
+    GstPad *pad;
+    guint n_frames = p->frame_count * p->loop_count;
+
+    p->rate = rate;
+    p->push_times = g_new0 (GstClockTime, n_frames);
+    p->latencies = g_new0 (GstClockTime, n_frames);
+    p->n_latencies = 0;
+    g_object_set (p->appsrc, "do-timestamp", FALSE, NULL);
+
+    pad = gst_element_get_static_pad (p->rtpdepay, "src");
+    gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                       GST_PAD_PROBE_TYPE_BUFFER_LIST), depay_latency_probe_cb, p, NULL);
+    gst_object_unref (pad);
+}
+
+/*
+ * Delivers one payloaded packet to the jitterbuffer through the
+ * impairment.
+ */
+static void
+rtp_pipeline_impair_buffer (rtp_pipeline * p, GstBuffer * buf)
+{
+    rtp_impairment *imp = &p->impairment;
+
+    if (g_rand_double (p->rand) < imp->loss) {
+        p->impair_lost++;
+        gst_buffer_unref (buf);
+        return;
+    }
+
+    /* Arrival time jitter, rtpjitterbuffer takes the DTS as arrival */
+    if (imp->jitter_ms > 0 && GST_BUFFER_PTS_IS_VALID (buf)) {
+        buf = gst_buffer_make_writable (buf);
+        GST_BUFFER_DTS (buf) = GST_BUFFER_PTS (buf) +
+                               g_rand_int_range (p->rand, 0, imp->jitter_ms + 1) * GST_MSECOND;
+    }
+
+    if (g_rand_double (p->rand) < imp->duplicate) {
+        p->impair_duplicated++;
+        gst_pad_chain (p->impair_sink, gst_buffer_ref (buf));
+    }
+
+    /* Hold this one back until after the next packet */
+    if (!p->held && g_rand_double (p->rand) < imp->reorder) {
+        p->impair_reordered++;
+        p->held = buf;
+        return;
+    }
+
+    gst_pad_chain (p->impair_sink, buf);
+    if (p->held) {
+        GstBuffer *held = p->held;
+
+        p->held = NULL;
+        gst_pad_chain (p->impair_sink, held);
+    }
+}
+
+static GstPadProbeReturn
+impair_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    rtp_pipeline *p = (rtp_pipeline *) user_data;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        /* Don't lose the held packet at the end */
+        if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS && p->held) {
+            GstBuffer *held = p->held;
+
+            p->held = NULL;
+            gst_pad_chain (p->impair_sink, held);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    /* Every packet is delivered by hand, the original push is dropped */
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+        guint i, len = gst_buffer_list_length (list);
+
+        for (i = 0; i < len; i++)
+            rtp_pipeline_impair_buffer (p, gst_buffer_ref (gst_buffer_list_get (list, i)));
+    } else {
+        rtp_pipeline_impair_buffer (p, gst_buffer_ref (GST_PAD_PROBE_INFO_BUFFER (info)));
+    }
+
+    return GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn
+depay_count_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    rtp_pipeline *p = (rtp_pipeline *) user_data;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        p->depay_buffers += gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+    else
+        p->depay_buffers++;
+
+    return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Inserts a seeded impairment stage and an rtpjitterbuffer between the
+ * payloader and the depayloader. No network is involved, the same seed
+ * gives the same loss, duplication and reordering pattern.
+ * @param p Pointer to the RTP pipeline.
+ * @param impairment Impairment to apply.
+ * @param latency_ms Jitterbuffer latency.
+ * @return FALSE if rtpjitterbuffer is not available.
+ */
+static gboolean
+rtp_pipeline_enable_impairment (rtp_pipeline * p, const rtp_impairment * impairment,
+                                guint latency_ms)
+{
+    GstPad *pad;
+
+    p->jitterbuffer = gst_element_factory_make ("rtpjitterbuffer", NULL);
+    if (!p->jitterbuffer)
+        return FALSE;
+    g_object_set (p->jitterbuffer, "latency", latency_ms, NULL);
+
+    gst_element_unlink (p->rtppay, p->rtpdepay);
+    gst_bin_add (GST_BIN (p->pipeline), p->jitterbuffer);
+    gst_element_link_many (p->rtppay, p->jitterbuffer, p->rtpdepay, NULL);
+
+    p->impairment = *impairment;
+    p->rand = g_rand_new_with_seed (impairment->seed);
+    p->impair_sink = gst_element_get_static_pad (p->jitterbuffer, "sink");
+
+    pad = gst_element_get_static_pad (p->rtppay, "src");
+    gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                       GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                       impair_probe_cb, p, NULL);
+    gst_object_unref (pad);
+
+    pad = gst_element_get_static_pad (p->rtpdepay, "src");
+    gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                       GST_PAD_PROBE_TYPE_BUFFER_LIST), depay_count_probe_cb, p, NULL);
+    gst_object_unref (pad);
+
+    return TRUE;
+}
+
 /*
  * RTP bus callback.
  */
@@ -259,6 +621,33 @@ rtp_bus_callback (GstBus * bus, GstMessage * message, gpointer data)
     return TRUE;
 }
 
+/*
+ * Wraps the input of frame j in loop i, without copying it.
+ */
+static GstBuffer *
+rtp_pipeline_input_buffer (rtp_pipeline * p, gint i, gint j)
+{
+    /* Variable sized packets, e.g. replayed from a capture */
+    if (p->packet_data)
+        return gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+                                            (guint8 *) p->packet_data[j], p->packet_sizes[j], 0,
+                                            p->packet_sizes[j], NULL, NULL);
+
+    return gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+                                        (guint8 *) p->frame_data + j * p->frame_data_size,
+                                        p->frame_data_size, 0, p->frame_data_size, NULL, NULL);
+}
+
+/* The counted pass ends when EOS reaches the sink, before the bus and
+ * main loop get to run */
+static GstPadProbeReturn
+sink_eos_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS)
+        alloc_counting_set (FALSE);
+    return GST_PAD_PROBE_OK;
+}
+
 /*
  * Runs the RTP pipeline.
  * @param p Pointer to the RTP pipeline.
@@ -267,8 +656,10 @@ static void
 rtp_pipeline_run (rtp_pipeline * p)
 {
     GstFlowReturn flow_ret;
+    GMainContext *context;
     GMainLoop *mainloop = NULL;
     GstBus *bus;
+    GstClockTime pace_start;
     gint i, j;
 
     /* Check parameters. */
@@ -276,9 +667,14 @@ rtp_pipeline_run (rtp_pipeline * p)
         return;
     }
 
-    /* Create mainloop. */
-    mainloop = g_main_loop_new (NULL, FALSE);
+    /* Create mainloop. Every run gets its own context so pipelines can run
+     * on several threads at once, the bus watch attaches to it. */
+    context = g_main_context_new ();
+    g_main_context_push_thread_default (context);
+    mainloop = g_main_loop_new (context, FALSE);
     if (!mainloop) {
+        g_main_context_pop_thread_default (context);
+        g_main_context_unref (context);
         return;
     }
 
@@ -309,30 +705,57 @@ rtp_pipeline_run (rtp_pipeline * p)
         gst_element_send_event (p->appsrc, gst_event_ref (p->custom_event));
     }
 
-    /* Push data into the pipeline */
-    for (i = 0; i < LOOP_COUNT; i++) {
-        const guint8 *data = p->frame_data;
+    /* The input buffers are the harness's, not the elements' allocations,
+     * so a counted run wraps them all before counting starts */
+    if (p->count_allocs) {
+        GstPad *sinkpad = gst_element_get_static_pad (p->fakesink, "sink");
+
+        gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                           sink_eos_probe_cb, NULL, NULL);
+        gst_object_unref (sinkpad);
+        p->inputs = g_new (GstBuffer *, p->loop_count * p->frame_count);
+        for (i = 0; i < p->loop_count; i++) {
+            for (j = 0; j < p->frame_count; j++)
+                p->inputs[i * p->frame_count + j] = rtp_pipeline_input_buffer (p, i, j);
+        }
+    }
 
+    /* Push data into the pipeline */
+    p->start_time = g_get_monotonic_time ();
+    pace_start = gst_util_get_timestamp ();
+    if (p->count_allocs)
+        alloc_counting_set (TRUE);
+    for (i = 0; i < p->loop_count; i++) {
         for (j = 0; j < p->frame_count; j++) {
-            GstBuffer *buf;
+            guint idx = i * p->frame_count + j;
+            GstBuffer *buf = p->inputs ? p->inputs[idx] : rtp_pipeline_input_buffer (p, i, j);
 
-            buf =
-                    gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
-                                                 (guint8 *) data, p->frame_data_size, 0, p->frame_data_size, NULL,
-                                                 NULL);
+            if (p->push_times) {
+                GstClockTime deadline = pace_start + idx * (GST_SECOND / p->rate);
+                GstClockTime now = gst_util_get_timestamp ();
+
+                /* Pace the input */
+                if (deadline > now)
+                    g_usleep ((deadline - now) / GST_USECOND);
+                GST_BUFFER_PTS (buf) = idx * (GST_SECOND / p->rate);
+                p->push_times[idx] = gst_util_get_timestamp ();
+            }
 
             g_signal_emit_by_name (p->appsrc, "push-buffer", buf, &flow_ret);
             fail_unless_equals_int (flow_ret, GST_FLOW_OK);
-            data += p->frame_data_size;
 
             gst_buffer_unref (buf);
         }
     }
+    g_clear_pointer (&p->inputs, g_free);
 
     g_signal_emit_by_name (p->appsrc, "end-of-stream", &flow_ret);
 
     /* Run mainloop. */
     g_main_loop_run (mainloop);
+    p->end_time = g_get_monotonic_time ();
+    if (p->count_allocs)
+        alloc_counting_set (FALSE);
 
     /* Set pipeline to NULL. */
     gst_element_set_state (p->pipeline, GST_STATE_NULL);
@@ -343,6 +766,9 @@ rtp_pipeline_run (rtp_pipeline * p)
     gst_bus_remove_watch (bus);
     gst_object_unref (bus);
 
+    g_main_context_pop_thread_default (context);
+    g_main_context_unref (context);
+
     fail_if (p->custom_event);
 }
 
@@ -361,6 +787,15 @@ rtp_pipeline_destroy (rtp_pipeline * p)
     /* Release pipeline. */
     RELEASE_ELEMENT (p->pipeline);
 
+    g_free (p->push_times);
+    g_free (p->latencies);
+    if (p->impair_sink)
+        gst_object_unref (p->impair_sink);
+    if (p->rand)
+        g_rand_free (p->rand);
+    if (p->held)
+        gst_buffer_unref (p->held);
+
     /* Release allocated memory. */
     free (p);
 }
@@ -436,9 +871,916 @@ GST_START_TEST (rtp_klv)
 GST_END_TEST;
 
 
+/*
+ * Benchmark mode (--bench, implied by the options choosing a benchmark).
+ * Runs every payloader/depayloader pair over a sweep of MTUs and frame
+ * sizes through the same pipelines as the tests and reports packets/s,
+ * bytes/s and ns/packet, one JSON object per line.
+ */
+static gboolean bench = FALSE;
+static gchar *bench_output = NULL;
+static gchar *bench_mtus = (gchar *) "576,1400,8000";
+static gchar *bench_sizes = (gchar *) "128,1200,16384,131072";
+static gint bench_frames = 5000;
+static gboolean bench_lists = FALSE;
+static gboolean bench_latency = FALSE;
+static gint bench_rate = 500;
+static gboolean bench_allocs = FALSE;
+static gdouble bench_max_mallocs = 0;
+static gdouble bench_max_gst_allocs = 0;
+static gboolean bench_scaling = FALSE;
+static gint bench_threads = 0;
+static gchar *bench_impair = NULL;
+static gint bench_seed = 1;
+static gint bench_jb_latency = 50;
+static gchar *bench_replay = NULL;
+static gchar *bench_replay_depay = NULL;
+static gchar *bench_replay_caps = NULL;
+static gint bench_replay_port = 0;
+static gint bench_replay_pt = -1;
+
+static GOptionEntry bench_entries[] = {
+        {"bench", 0, 0, G_OPTION_ARG_NONE, &bench,
+                "Run the payloader throughput benchmarks instead of the tests, implied by the options picking a benchmark", NULL},
+        {"bench-output", 0, 0, G_OPTION_ARG_FILENAME, &bench_output,
+                "Append results to this file instead of stdout", "FILE"},
+        {"bench-mtus", 0, 0, G_OPTION_ARG_STRING, &bench_mtus,
+                "Comma separated MTUs to sweep", "MTUS"},
+        {"bench-sizes", 0, 0, G_OPTION_ARG_STRING, &bench_sizes,
+                "Comma separated frame sizes in bytes to sweep", "SIZES"},
+        {"bench-frames", 0, 0, G_OPTION_ARG_INT, &bench_frames,
+                "Frames pushed per run", "N"},
+        {"bench-lists", 0, 0, G_OPTION_ARG_NONE, &bench_lists,
+                "Also compare buffer lists against single buffers for every payloader", NULL},
+        {"bench-latency", 0, 0, G_OPTION_ARG_NONE, &bench_latency,
+                "Also measure per-frame pay->depay latency at a steady input rate", NULL},
+        {"bench-rate", 0, 0, G_OPTION_ARG_INT, &bench_rate,
+                "Input frames per second for the latency runs", "FPS"},
+        {"bench-allocs", 0, 0, G_OPTION_ARG_NONE, &bench_allocs,
+                "Also count heap, GstMemory, GstBuffer and GstBufferList allocations per frame", NULL},
+        {"bench-max-mallocs", 0, 0, G_OPTION_ARG_DOUBLE, &bench_max_mallocs,
+                "Fail when a run makes more heap allocations per frame, 0 disables", "N"},
+        {"bench-max-gst-allocs", 0, 0, G_OPTION_ARG_DOUBLE, &bench_max_gst_allocs,
+                "Fail when a run creates more GstMemory, GstBuffer and GstBufferList per frame, 0 disables", "N"},
+        {"bench-scaling", 0, 0, G_OPTION_ARG_NONE, &bench_scaling,
+                "Also run 1, 2, 4, ... independent pipelines on as many threads", NULL},
+        {"bench-threads", 0, 0, G_OPTION_ARG_INT, &bench_threads,
+                "Most threads for the scaling runs (default: number of cores)", "N"},
+        {"bench-impair", 0, 0, G_OPTION_ARG_STRING, &bench_impair,
+                "Also run through a seeded impairment and rtpjitterbuffer, e.g. loss=0.02,reorder=0.01,duplicate=0.01,jitter=20", "SPEC"},
+        {"bench-seed", 0, 0, G_OPTION_ARG_INT, &bench_seed,
+                "Seed of the impairment", "SEED"},
+        {"bench-jb-latency", 0, 0, G_OPTION_ARG_INT, &bench_jb_latency,
+                "rtpjitterbuffer latency in ms for the impaired runs", "MS"},
+        {"bench-replay", 0, 0, G_OPTION_ARG_FILENAME, &bench_replay,
+                "Replay the RTP packets of a pcap or rtpdump file into --bench-replay-depay", "FILE"},
+        {"bench-replay-depay", 0, 0, G_OPTION_ARG_STRING, &bench_replay_depay,
+                "Depayloader for the replay", "ELEMENT"},
+        {"bench-replay-caps", 0, 0, G_OPTION_ARG_STRING, &bench_replay_caps,
+                "RTP caps of the replayed stream, e.g. application/x-rtp,media=video,clock-rate=90000,encoding-name=H264", "CAPS"},
+        {"bench-replay-port", 0, 0, G_OPTION_ARG_INT, &bench_replay_port,
+                "Only replay UDP packets to this port (pcap)", "PORT"},
+        {"bench-replay-pt", 0, 0, G_OPTION_ARG_INT, &bench_replay_pt,
+                "Only replay packets with this RTP payload type", "PT"},
+        {NULL}
+};
+
+/*
+ * Payloader/depayloader pair under benchmark.
+ * fill() writes one valid frame of the given size, which is pushed
+ * bench_frames times.
+ */
+typedef struct
+{
+    const char *name;
+    const char *filtercaps;
+    const char *pay;
+    const char *depay;
+    gsize min_size;
+    void (*fill) (guint8 * data, gsize size);
+} rtp_bench_codec;
+
+static void
+bench_fill_klv (guint8 * data, gsize size)
+{
+    gsize len = size - 20;
+
+    /* Universal key from the test data, 4 byte BER length, empty value */
+    memcpy (data, rtp_KLV_frame_data, 16);
+    data[16] = 0x83;
+    data[17] = (len >> 16) & 0xff;
+    data[18] = (len >> 8) & 0xff;
+    data[19] = len & 0xff;
+    memset (data + 20, 0, len);
+}
+
+static void
+bench_fill_h264 (guint8 * data, gsize size)
+{
+    /* One IDR slice NAL, no start code emulation in the filler */
+    memset (data, 0xaa, size);
+    data[0] = data[1] = data[2] = 0x00;
+    data[3] = 0x01;
+    data[4] = 0x65;
+}
+
+static void
+bench_fill_h265 (guint8 * data, gsize size)
+{
+    /* One IDR_W_RADL NAL */
+    memset (data, 0xaa, size);
+    data[0] = data[1] = data[2] = 0x00;
+    data[3] = 0x01;
+    data[4] = 0x26;
+    data[5] = 0x01;
+}
+
+static void
+bench_fill_vp8 (guint8 * data, gsize size)
+{
+    /* Keyframe with a 16 byte first partition of zeroes, which the bool
+     * decoder reads as the simplest header with one DCT partition */
+    guint32 tag = (1 << 4) | (16 << 5);
+
+    memset (data, 0, size);
+    data[0] = tag & 0xff;
+    data[1] = (tag >> 8) & 0xff;
+    data[2] = (tag >> 16) & 0xff;
+    data[3] = 0x9d;
+    data[4] = 0x01;
+    data[5] = 0x2a;
+    data[6] = 320 & 0xff;
+    data[7] = 320 >> 8;
+    data[8] = 240 & 0xff;
+    data[9] = 240 >> 8;
+}
+
+static void
+bench_fill_zero (guint8 * data, gsize size)
+{
+    memset (data, 0, size);
+}
+
+static const rtp_bench_codec bench_codecs[] = {
+        {"klv", "meta/x-klv, parsed=(bool)true", "rtpklvpay", "rtpklvdepay",
+                21, bench_fill_klv},
+        {"h264", "video/x-h264,stream-format=(string)byte-stream,alignment=(string)nal",
+                "rtph264pay", "rtph264depay", 6, bench_fill_h264},
+        {"h265", "video/x-h265,stream-format=(string)byte-stream,alignment=(string)nal",
+                "rtph265pay", "rtph265depay", 7, bench_fill_h265},
+        {"vp8", "video/x-vp8", "rtpvp8pay", "rtpvp8depay", 27, bench_fill_vp8},
+        {"opus", "audio/x-opus,channels=(int)2,rate=(int)48000,channel-mapping-family=(int)0",
+                "rtpopuspay", "rtpopusdepay", 1, bench_fill_zero},
+        {"raw", "audio/x-raw,format=(string)S16BE,layout=(string)interleaved,rate=(int)48000,channels=(int)2",
+                "rtpL16pay", "rtpL16depay", 4, bench_fill_zero},
+};
+
+/*
+ * Writes one result line to --bench-output or stdout. The file is opened
+ * per line since every test runs in its own forked process.
+ */
+static void
+bench_report (const gchar * line)
+{
+    FILE *f;
+
+    if (!bench_output) {
+        g_print ("%s\n", line);
+        return;
+    }
+    f = fopen (bench_output, "a");
+    fail_unless (f != NULL);
+    fprintf (f, "%s\n", line);
+    fclose (f);
+}
+
+/*
+ * How the depayloader sink pad is driven in one run.
+ * BENCH_DEPAY runs the real depayloader. BENCH_LISTS and BENCH_SINGLE both
+ * replace it with a counting chain like rtp_pipeline_enable_lists(), with
+ * and without a chain_list function, so they only differ in how the
+ * payloader's output crosses the pad. BENCH_LATENCY paces the input at
+ * --bench-rate and records the latency of every frame. BENCH_ALLOCS counts
+ * allocations over the pushes and the pass to EOS. BENCH_IMPAIRED runs
+ * through --bench-impair and an rtpjitterbuffer.
+ */
+typedef enum
+{
+    BENCH_DEPAY,
+    BENCH_LISTS,
+    BENCH_SINGLE,
+    BENCH_LATENCY,
+    BENCH_ALLOCS,
+    BENCH_IMPAIRED
+} rtp_bench_mode;
+
+static const char *bench_mode_names[] = {"depay", "lists", "single", "latency", "allocs",
+                                         "impaired"};
+
+#define BENCH_OUTLIERS 5
+
+typedef struct
+{
+    guint64 packets;
+    guint64 chain_calls;
+    gdouble packets_per_s;
+} rtp_bench_result;
+
+static GstPadProbeReturn
+bench_count_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    rtp_pipeline *p = (rtp_pipeline *) user_data;
+
+    p->pay_pushes++;
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+        guint i, len = gst_buffer_list_length (list);
+
+        p->packets += len;
+        for (i = 0; i < len; i++)
+            p->packet_bytes += gst_buffer_get_size (gst_buffer_list_get (list, i));
+    } else {
+        p->packets++;
+        p->packet_bytes += gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+static int
+compare_clock_time (const void *a, const void *b)
+{
+    GstClockTime x = *(const GstClockTime *) a, y = *(const GstClockTime *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Appends percentiles and the worst outliers of the recorded latencies.
+ */
+static void
+bench_append_latency (GString * line, rtp_pipeline * p)
+{
+    GstClockTime *l = p->latencies;
+    guint n = p->n_latencies, i;
+
+    fail_unless (n > 0);
+    qsort (l, n, sizeof (GstClockTime), compare_clock_time);
+    g_string_append_printf (line, ",\"rate\":%u,\"samples\":%u,\"p50_us\":%.2f,"
+                            "\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f,"
+                            "\"outliers_us\":[",
+                            p->rate, n, l[(n - 1) / 2] / 1000.0,
+                            l[(guint) ((n - 1) * 0.99)] / 1000.0,
+                            l[(guint) ((n - 1) * 0.999)] / 1000.0, l[n - 1] / 1000.0);
+    for (i = 0; i < MIN (n, BENCH_OUTLIERS); i++)
+        g_string_append_printf (line, "%s%.2f", i ? "," : "", l[n - 1 - i] / 1000.0);
+    g_string_append (line, "]");
+}
+
+static void
+bench_append_allocs (GString * line)
+{
+    gdouble frames = bench_frames;
+
+    g_string_append_printf (line, ",\"mallocs_per_frame\":%.2f,\"memories_per_frame\":%.2f,"
+                            "\"buffers_per_frame\":%.2f,\"buffer_lists_per_frame\":%.2f",
+                            g_atomic_int_get (&alloc_mallocs) / frames,
+                            g_atomic_int_get (&alloc_memories) / frames,
+                            g_atomic_int_get (&alloc_buffers) / frames,
+                            g_atomic_int_get (&alloc_buffer_lists) / frames);
+}
+
+/*
+ * Fails the run when the allocations per frame are over the limits.
+ */
+static void
+bench_check_allocs (const rtp_bench_codec * codec)
+{
+    gdouble frames = bench_frames;
+    gdouble mallocs = g_atomic_int_get (&alloc_mallocs) / frames;
+    gdouble gst_allocs = (g_atomic_int_get (&alloc_memories) +
+                          g_atomic_int_get (&alloc_buffers) +
+                          g_atomic_int_get (&alloc_buffer_lists)) / frames;
+
+    fail_if (bench_max_mallocs > 0 && mallocs > bench_max_mallocs,
+             "%s: %.2f heap allocations per frame, limit %.2f", codec->pay, mallocs,
+             bench_max_mallocs);
+    fail_if (bench_max_gst_allocs > 0 && gst_allocs > bench_max_gst_allocs,
+             "%s: %.2f GstMemory/GstBuffer/GstBufferList per frame, limit %.2f",
+             codec->pay, gst_allocs, bench_max_gst_allocs);
+}
+
+/*
+ * Parses --bench-impair.
+ */
+static void
+bench_parse_impairment (rtp_impairment * imp)
+{
+    gchar **tokens;
+    guint i;
+
+    memset (imp, 0, sizeof (*imp));
+    imp->seed = (guint32) bench_seed;
+    tokens = g_strsplit (bench_impair, ",", -1);
+    for (i = 0; tokens[i]; i++) {
+        gchar **kv = g_strsplit (tokens[i], "=", 2);
+
+        fail_unless (kv[0] && kv[1], "invalid impairment '%s'", tokens[i]);
+        if (g_str_equal (kv[0], "loss"))
+            imp->loss = g_ascii_strtod (kv[1], NULL);
+        else if (g_str_equal (kv[0], "reorder"))
+            imp->reorder = g_ascii_strtod (kv[1], NULL);
+        else if (g_str_equal (kv[0], "duplicate"))
+            imp->duplicate = g_ascii_strtod (kv[1], NULL);
+        else if (g_str_equal (kv[0], "jitter"))
+            imp->jitter_ms = (guint) g_ascii_strtoull (kv[1], NULL, 10);
+        else
+            fail ("unknown impairment '%s'", kv[0]);
+        g_strfreev (kv);
+    }
+    g_strfreev (tokens);
+}
+
+/*
+ * Appends what the impairment did and how the jitterbuffer recovered.
+ */
+static void
+bench_append_impairment (GString * line, rtp_pipeline * p)
+{
+    GstStructure *stats = NULL;
+    guint64 pushed = 0, lost = 0, late = 0, duplicates = 0, avg_jitter = 0;
+
+    g_object_get (p->jitterbuffer, "stats", &stats, NULL);
+    if (stats) {
+        gst_structure_get_uint64 (stats, "num-pushed", &pushed);
+        gst_structure_get_uint64 (stats, "num-lost", &lost);
+        gst_structure_get_uint64 (stats, "num-late", &late);
+        gst_structure_get_uint64 (stats, "num-duplicates", &duplicates);
+        gst_structure_get_uint64 (stats, "avg-jitter", &avg_jitter);
+        gst_structure_free (stats);
+    }
+
+    g_string_append_printf (line, ",\"seed\":%u,\"loss\":%.4f,\"reorder\":%.4f,"
+                            "\"duplicate\":%.4f,\"jitter_ms\":%u,\"dropped\":%"
+                            G_GUINT64_FORMAT ",\"reordered\":%" G_GUINT64_FORMAT
+                            ",\"duplicated\":%" G_GUINT64_FORMAT ",\"jb_pushed\":%"
+                            G_GUINT64_FORMAT ",\"jb_lost\":%" G_GUINT64_FORMAT
+                            ",\"jb_late\":%" G_GUINT64_FORMAT ",\"jb_duplicates\":%"
+                            G_GUINT64_FORMAT ",\"jb_avg_jitter_us\":%.2f,"
+                            "\"depay_buffers\":%" G_GUINT64_FORMAT ",\"frames_out_ratio\":%.4f",
+                            p->impairment.seed, p->impairment.loss, p->impairment.reorder,
+                            p->impairment.duplicate, p->impairment.jitter_ms,
+                            p->impair_lost, p->impair_reordered, p->impair_duplicated,
+                            pushed, lost, late, duplicates, avg_jitter / 1000.0,
+                            p->depay_buffers, (gdouble) p->depay_buffers / bench_frames);
+}
+
+static GstFlowReturn
+rtp_bench_chain_list (GstPad * pad, GstObject * parent, GstBufferList * list)
+{
+    rtp_pipeline *p = (rtp_pipeline *) gst_pad_get_element_private (pad);
+
+    p->chain_calls++;
+    gst_buffer_list_unref (list);
+
+    return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+rtp_bench_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+    rtp_pipeline *p = (rtp_pipeline *) gst_pad_get_element_private (pad);
+
+    p->chain_calls++;
+    gst_buffer_unref (buf);
+
+    return GST_FLOW_OK;
+}
+
+/*
+ * Replaces the depayloader chain functions with counting ones. Without a
+ * chain_list function the core splits every list into one chain call per
+ * buffer.
+ * @param p Pointer to the RTP pipeline.
+ * @param use_lists Whether to install a chain_list function.
+ */
+static void
+rtp_pipeline_count_chain (rtp_pipeline * p, gboolean use_lists)
+{
+    GstPad *pad;
+
+    pad = gst_element_get_static_pad (p->rtpdepay, "sink");
+    gst_pad_set_element_private (pad, p);
+    if (use_lists)
+        gst_pad_set_chain_list_function (pad, GST_DEBUG_FUNCPTR (rtp_bench_chain_list));
+    else
+        gst_pad_set_chain_list_function (pad, NULL);
+    gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR (rtp_bench_chain));
+    gst_object_unref (pad);
+}
+
+/*
+ * Runs one codec at one MTU and frame size and reports the result.
+ * @param result Filled in when not NULL and the run happened.
+ * @return FALSE when the elements are not available.
+ */
+static gboolean
+rtp_pipeline_bench (const rtp_bench_codec * codec, guint mtu_size, gsize frame_size,
+                    rtp_bench_mode mode, rtp_bench_result * result)
+{
+    rtp_pipeline *p;
+    guint8 *data;
+    GstPad *pad;
+    gdouble secs;
+    GString *line;
+    gchar *version;
+
+    data = (guint8 *) g_malloc (frame_size);
+    codec->fill (data, frame_size);
+
+    p = rtp_pipeline_create (data, frame_size, 1, codec->filtercaps, codec->pay,
+                             codec->depay);
+    if (p == NULL) {
+        g_print ("Skipping %s, %s or %s not available\n", codec->name, codec->pay,
+                 codec->depay);
+        g_free (data);
+        return FALSE;
+    }
+    p->loop_count = bench_frames;
+    g_object_set (p->rtppay, "mtu", mtu_size, NULL);
+
+    pad = gst_element_get_static_pad (p->rtppay, "src");
+    gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                       GST_PAD_PROBE_TYPE_BUFFER_LIST), bench_count_probe_cb, p, NULL);
+    gst_object_unref (pad);
+
+    if (mode == BENCH_LISTS || mode == BENCH_SINGLE)
+        rtp_pipeline_count_chain (p, mode == BENCH_LISTS);
+    else if (mode == BENCH_LATENCY)
+        rtp_pipeline_enable_timing (p, bench_rate);
+    else if (mode == BENCH_ALLOCS)
+        p->count_allocs = TRUE;
+    else if (mode == BENCH_IMPAIRED) {
+        rtp_impairment imp;
+
+        bench_parse_impairment (&imp);
+        if (!rtp_pipeline_enable_impairment (p, &imp, bench_jb_latency)) {
+            g_print ("Skipping impaired run, rtpjitterbuffer not available\n");
+            rtp_pipeline_destroy (p);
+            g_free (data);
+            return FALSE;
+        }
+    }
+
+    rtp_pipeline_run (p);
+
+    secs = (p->end_time - p->start_time) / (gdouble) G_USEC_PER_SEC;
+    fail_unless (p->packets > 0);
+    version = gst_version_string ();
+    line = g_string_new (NULL);
+    g_string_append_printf (line, "{\"codec\":\"%s\",\"pay\":\"%s\",\"depay\":\"%s\","
+                            "\"mode\":\"%s\",\"gst_version\":\"%s\",\"mtu\":%u,"
+                            "\"frame_size\":%" G_GSIZE_FORMAT ",\"frames\":%d,"
+                            "\"packets\":%" G_GUINT64_FORMAT ",\"packet_bytes\":%"
+                            G_GUINT64_FORMAT ",\"pay_pushes\":%" G_GUINT64_FORMAT
+                            ",\"seconds\":%.6f,\"packets_per_s\":%.1f,"
+                            "\"bytes_per_s\":%.1f,\"ns_per_packet\":%.1f",
+                            codec->name, codec->pay, codec->depay,
+                            bench_mode_names[mode], version, mtu_size, frame_size,
+                            bench_frames, p->packets, p->packet_bytes, p->pay_pushes,
+                            secs, p->packets / secs,
+                            ((gdouble) frame_size * bench_frames) / secs,
+                            secs * 1e9 / p->packets);
+    if (mode == BENCH_LISTS || mode == BENCH_SINGLE)
+        g_string_append_printf (line, ",\"chain_calls\":%" G_GUINT64_FORMAT,
+                                p->chain_calls);
+    else if (mode == BENCH_LATENCY)
+        bench_append_latency (line, p);
+    else if (mode == BENCH_ALLOCS)
+        bench_append_allocs (line);
+    else if (mode == BENCH_IMPAIRED)
+        bench_append_impairment (line, p);
+    g_string_append (line, "}");
+    bench_report (line->str);
+    g_string_free (line, TRUE);
+    g_free (version);
+
+    if (mode == BENCH_ALLOCS)
+        bench_check_allocs (codec);
+
+    if (result) {
+        result->packets = p->packets;
+        result->chain_calls = p->chain_calls;
+        result->packets_per_s = p->packets / secs;
+    }
+
+    rtp_pipeline_destroy (p);
+    g_free (data);
+
+    return TRUE;
+}
+
+/*
+ * Runs one point with and without buffer lists and reports whether the
+ * payloader batches and what it gains from it.
+ */
+static void
+rtp_bench_compare_lists (const rtp_bench_codec * codec, guint mtu_size, gsize frame_size)
+{
+    rtp_bench_result lists, single;
+    gchar *line;
+
+    if (!rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_LISTS, &lists) ||
+        !rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_SINGLE, &single))
+        return;
+
+    line = g_strdup_printf ("{\"codec\":\"%s\",\"pay\":\"%s\",\"mode\":\"lists_vs_single\","
+                            "\"mtu\":%u,\"frame_size\":%" G_GSIZE_FORMAT ","
+                            "\"batches\":%s,\"packets_per_chain_call\":%.2f,"
+                            "\"lists_speedup\":%.3f}",
+                            codec->name, codec->pay, mtu_size, frame_size,
+                            lists.chain_calls < single.chain_calls ? "true" : "false",
+                            lists.chain_calls ? (gdouble) lists.packets / lists.chain_calls : 0.0,
+                            single.packets_per_s > 0 ? lists.packets_per_s / single.packets_per_s : 0.0);
+    bench_report (line);
+    g_free (line);
+}
+
+/*
+ * One pipeline of a scaling run.
+ */
+typedef struct
+{
+    rtp_pipeline *p;
+    guint8 *data;
+} rtp_bench_worker;
+
+static gpointer
+bench_worker_thread (gpointer user_data)
+{
+    rtp_bench_worker *w = (rtp_bench_worker *) user_data;
+
+    rtp_pipeline_run (w->p);
+
+    return NULL;
+}
+
+/*
+ * Runs n_threads independent pipelines in parallel.
+ * @return Aggregate packets per second, 0 when the elements are missing.
+ */
+static gdouble
+rtp_bench_parallel (const rtp_bench_codec * codec, guint mtu_size, gsize frame_size,
+                    guint n_threads)
+{
+    rtp_bench_worker *workers;
+    GThread **threads;
+    gint64 start = G_MAXINT64, end = 0;
+    guint64 packets = 0;
+    gdouble pps = 0;
+    guint i;
+
+    workers = g_new0 (rtp_bench_worker, n_threads);
+    threads = g_new0 (GThread *, n_threads);
+
+    /* Build everything first, only the runs overlap */
+    for (i = 0; i < n_threads; i++) {
+        GstPad *pad;
+
+        workers[i].data = (guint8 *) g_malloc (frame_size);
+        codec->fill (workers[i].data, frame_size);
+        workers[i].p = rtp_pipeline_create (workers[i].data, frame_size, 1,
+                                            codec->filtercaps, codec->pay, codec->depay);
+        if (workers[i].p == NULL)
+            goto done;
+        workers[i].p->loop_count = bench_frames;
+        g_object_set (workers[i].p->rtppay, "mtu", mtu_size, NULL);
+
+        pad = gst_element_get_static_pad (workers[i].p->rtppay, "src");
+        gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                           GST_PAD_PROBE_TYPE_BUFFER_LIST), bench_count_probe_cb,
+                           workers[i].p, NULL);
+        gst_object_unref (pad);
+    }
+
+    for (i = 0; i < n_threads; i++)
+        threads[i] = g_thread_new ("bench", bench_worker_thread, &workers[i]);
+    for (i = 0; i < n_threads; i++) {
+        rtp_pipeline *p = workers[i].p;
+
+        g_thread_join (threads[i]);
+        start = MIN (start, p->start_time);
+        end = MAX (end, p->end_time);
+        packets += p->packets;
+    }
+    pps = packets / ((end - start) / (gdouble) G_USEC_PER_SEC);
+
+done:
+    for (i = 0; i < n_threads; i++) {
+        rtp_pipeline_destroy (workers[i].p);
+        g_free (workers[i].data);
+    }
+    g_free (threads);
+    g_free (workers);
+
+    return pps;
+}
+
+/*
+ * Doubles the number of parallel pipelines up to the number of cores and
+ * reports aggregate throughput and scaling efficiency against one thread.
+ */
+static void
+rtp_bench_scaling (const rtp_bench_codec * codec, guint mtu_size, gsize frame_size)
+{
+    guint max_threads = bench_threads > 0 ? bench_threads : g_get_num_processors ();
+    gdouble base = 0;
+    guint n;
+
+    for (n = 1; n <= max_threads; n = (n * 2 > max_threads && n < max_threads) ? max_threads : n * 2) {
+        gdouble pps = rtp_bench_parallel (codec, mtu_size, frame_size, n);
+        gchar *line;
+
+        if (pps <= 0)
+            return;
+        if (n == 1)
+            base = pps;
+
+        line = g_strdup_printf ("{\"codec\":\"%s\",\"pay\":\"%s\",\"depay\":\"%s\","
+                                "\"mode\":\"scaling\",\"mtu\":%u,\"frame_size\":%"
+                                G_GSIZE_FORMAT ",\"threads\":%u,\"cores\":%u,"
+                                "\"packets_per_s\":%.1f,\"efficiency\":%.3f}",
+                                codec->name, codec->pay, codec->depay, mtu_size,
+                                frame_size, n, g_get_num_processors (), pps,
+                                pps / (n * base));
+        bench_report (line);
+        g_free (line);
+    }
+}
+
+/*
+ * Sweeps MTU and frame size for one codec.
+ */
+static void
+rtp_bench_codec_sweep (const rtp_bench_codec * codec)
+{
+    gchar **mtus, **sizes;
+    guint i, j;
+
+    mtus = g_strsplit (bench_mtus, ",", -1);
+    sizes = g_strsplit (bench_sizes, ",", -1);
+    for (i = 0; mtus[i]; i++) {
+        for (j = 0; sizes[j]; j++) {
+            guint mtu_size = (guint) g_ascii_strtoull (mtus[i], NULL, 10);
+            gsize frame_size = (gsize) g_ascii_strtoull (sizes[j], NULL, 10);
+
+            if (mtu_size == 0 || frame_size < codec->min_size)
+                continue;
+            rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_DEPAY, NULL);
+            if (bench_lists)
+                rtp_bench_compare_lists (codec, mtu_size, frame_size);
+            if (bench_latency && bench_rate > 0)
+                rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_LATENCY, NULL);
+            if (bench_allocs)
+                rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_ALLOCS, NULL);
+            if (bench_scaling)
+                rtp_bench_scaling (codec, mtu_size, frame_size);
+            if (bench_impair)
+                rtp_pipeline_bench (codec, mtu_size, frame_size, BENCH_IMPAIRED, NULL);
+        }
+    }
+    g_strfreev (sizes);
+    g_strfreev (mtus);
+}
+
+GST_START_TEST (rtp_bench_throughput)
+    {
+        rtp_bench_codec_sweep (&bench_codecs[__i__]);
+    }
+
+GST_END_TEST;
+
+/*
+ * Replay of captured RTP (--bench-replay).
+ * The capture is mmapped and every RTP packet in it is pushed into the
+ * depayloader as a read-only buffer wrapping the mapping, as fast as the
+ * depayloader takes them.
+ */
+typedef struct
+{
+    GPtrArray *data;
+    GArray *sizes;
+} rtp_replay_packets;
+
+static void
+replay_add_rtp (rtp_replay_packets * pkts, const guint8 * data, guint size)
+{
+    guint pt;
+
+    /* RTP version 2 only, and no RTCP */
+    if (size < 12 || (data[0] >> 6) != 2)
+        return;
+    pt = data[1] & 0x7f;
+    if (pt >= 72 && pt <= 76)
+        return;
+    if (bench_replay_pt >= 0 && (gint) pt != bench_replay_pt)
+        return;
+
+    g_ptr_array_add (pkts->data, (gpointer) data);
+    g_array_append_val (pkts->sizes, size);
+}
+
+/*
+ * Finds the UDP payload of one captured frame.
+ */
+static void
+replay_add_frame (rtp_replay_packets * pkts, guint32 linktype, const guint8 * data, guint size)
+{
+    guint off = 0, ethertype = 0;
+
+    switch (linktype) {
+        case 1:                /* Ethernet */
+            if (size < 14)
+                return;
+            ethertype = GST_READ_UINT16_BE (data + 12);
+            off = 14;
+            while (ethertype == 0x8100 && size >= off + 4) {
+                ethertype = GST_READ_UINT16_BE (data + off + 2);
+                off += 4;
+            }
+            break;
+        case 113:              /* Linux cooked */
+            if (size < 16)
+                return;
+            ethertype = GST_READ_UINT16_BE (data + 14);
+            off = 16;
+            break;
+        case 276:              /* Linux cooked v2 */
+            if (size < 20)
+                return;
+            ethertype = GST_READ_UINT16_BE (data);
+            off = 20;
+            break;
+        case 101:              /* Raw IP */
+            if (size < 1)
+                return;
+            ethertype = (data[0] >> 4) == 6 ? 0x86dd : 0x0800;
+            break;
+        default:
+            return;
+    }
+
+    if (ethertype == 0x0800) {
+        guint ihl;
+
+        if (size < off + 20 || data[off + 9] != 17)
+            return;
+        ihl = (data[off] & 0x0f) * 4;
+        off += ihl;
+    } else if (ethertype == 0x86dd) {
+        if (size < off + 40 || data[off + 6] != 17)
+            return;
+        off += 40;
+    } else {
+        return;
+    }
+
+    if (size < off + 8)
+        return;
+    if (bench_replay_port > 0 && GST_READ_UINT16_BE (data + off + 2) != bench_replay_port)
+        return;
+    replay_add_rtp (pkts, data + off + 8, MIN (size - off - 8,
+                    (guint) GST_READ_UINT16_BE (data + off + 4) - 8));
+}
+
+static gboolean
+replay_parse_pcap (rtp_replay_packets * pkts, const guint8 * data, gsize size)
+{
+    guint32 magic, linktype;
+    gboolean swapped;
+    gsize off = 24;
+
+    if (size < 24)
+        return FALSE;
+    magic = GST_READ_UINT32_LE (data);
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+        swapped = FALSE;
+    else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+        swapped = TRUE;
+    else
+        return FALSE;
+
+#define PCAP_READ_UINT32(ptr) (swapped ? GST_READ_UINT32_BE (ptr) : GST_READ_UINT32_LE (ptr))
+    linktype = PCAP_READ_UINT32 (data + 20);
+    while (off + 16 <= size) {
+        guint32 incl_len = PCAP_READ_UINT32 (data + off + 8);
+
+        off += 16;
+        if (off + incl_len > size)
+            break;
+        replay_add_frame (pkts, linktype, data + off, incl_len);
+        off += incl_len;
+    }
+#undef PCAP_READ_UINT32
+
+    return TRUE;
+}
+
+static gboolean
+replay_parse_rtpdump (rtp_replay_packets * pkts, const guint8 * data, gsize size)
+{
+    const guint8 *eol;
+    gsize off;
+
+    if (size < 12 || memcmp (data, "#!rtpplay1.0", 12) != 0)
+        return FALSE;
+    eol = (const guint8 *) memchr (data, '\n', size);
+    if (!eol)
+        return FALSE;
+    /* Text line, then the 16 byte file header */
+    off = (eol - data) + 1 + 16;
+
+    while (off + 8 <= size) {
+        guint16 length = GST_READ_UINT16_BE (data + off);
+        guint16 plen = GST_READ_UINT16_BE (data + off + 2);
+
+        if (length < 8 || off + length > size)
+            break;
+        /* plen is 0 for RTCP */
+        if (plen > 0)
+            replay_add_rtp (pkts, data + off + 8, length - 8);
+        off += length;
+    }
+
+    return TRUE;
+}
+
+GST_START_TEST (rtp_bench_replay)
+    {
+        GMappedFile *file;
+        GError *error = NULL;
+        rtp_replay_packets pkts;
+        const guint8 *data;
+        gsize size;
+        rtp_pipeline *p;
+        GString *line;
+        gdouble secs;
+        guint64 bytes = 0;
+        guint i;
+
+        fail_unless (bench_replay_depay && bench_replay_caps,
+                     "--bench-replay needs --bench-replay-depay and --bench-replay-caps");
+
+        file = g_mapped_file_new (bench_replay, FALSE, &error);
+        fail_unless (file != NULL, "%s", error ? error->message : "mmap failed");
+        data = (const guint8 *) g_mapped_file_get_contents (file);
+        size = g_mapped_file_get_length (file);
+
+        pkts.data = g_ptr_array_new ();
+        pkts.sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+        fail_unless (replay_parse_pcap (&pkts, data, size) ||
+                     replay_parse_rtpdump (&pkts, data, size),
+                     "%s is neither pcap nor rtpdump", bench_replay);
+        fail_unless (pkts.data->len > 0, "no RTP packets in %s", bench_replay);
+        for (i = 0; i < pkts.sizes->len; i++)
+            bytes += g_array_index (pkts.sizes, guint, i);
+
+        p = rtp_pipeline_create (data, 0, pkts.data->len, bench_replay_caps, NULL,
+                                 bench_replay_depay);
+        fail_unless (p != NULL, "can't create %s", bench_replay_depay);
+        p->packet_data = (const guint8 **) pkts.data->pdata;
+        p->packet_sizes = (const guint *) pkts.sizes->data;
+
+        {
+            GstPad *pad = gst_element_get_static_pad (p->rtpdepay, "src");
+            gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                               GST_PAD_PROBE_TYPE_BUFFER_LIST), depay_count_probe_cb, p, NULL);
+            gst_object_unref (pad);
+        }
+
+        rtp_pipeline_run (p);
+
+        secs = (p->end_time - p->start_time) / (gdouble) G_USEC_PER_SEC;
+        line = g_string_new (NULL);
+        g_string_append_printf (line, "{\"mode\":\"replay\",\"file\":\"%s\",\"depay\":\"%s\","
+                                "\"packets\":%u,\"packet_bytes\":%" G_GUINT64_FORMAT
+                                ",\"depay_buffers\":%" G_GUINT64_FORMAT ",\"seconds\":%.6f,"
+                                "\"packets_per_s\":%.1f,\"bytes_per_s\":%.1f,\"ns_per_packet\":%.1f}",
+                                bench_replay, bench_replay_depay, pkts.data->len, bytes,
+                                p->depay_buffers, secs, pkts.data->len / secs, bytes / secs,
+                                secs * 1e9 / pkts.data->len);
+        bench_report (line->str);
+        g_string_free (line, TRUE);
+
+        rtp_pipeline_destroy (p);
+        g_ptr_array_free (pkts.data, TRUE);
+        g_array_free (pkts.sizes, TRUE);
+        g_mapped_file_unref (file);
+    }
+
+GST_END_TEST;
+
 static Suite *
 rtp_payloading_suite (void) {
-    GstRegistry *registry = gst_registry_get();
     Suite *s = suite_create("rtp_data_test");
 
     TCase *tc_chain = tcase_create("linear");
@@ -448,6 +1790,66 @@ rtp_payloading_suite (void) {
 
     suite_add_tcase(s, tc_chain);
     tcase_add_test (tc_chain, rtp_klv);
+
+    return s;
+}
+
+static Suite *
+rtp_bench_suite (void) {
+    Suite *s = suite_create("rtp_bench");
+
+    TCase *tc_bench = tcase_create("throughput");
+
+    /* A full sweep of one codec takes a while */
+    tcase_set_timeout(tc_bench, 3600);
+
+    suite_add_tcase(s, tc_bench);
+    if (bench_replay)
+        tcase_add_test (tc_bench, rtp_bench_replay);
+    else
+        tcase_add_loop_test (tc_bench, rtp_bench_throughput, 0, G_N_ELEMENTS (bench_codecs));
+
+    return s;
 }
 
-GST_CHECK_MAIN (rtp_payloading)
+int
+main (int argc, char **argv)
+{
+    GOptionContext *ctx;
+    GError *error = NULL;
+    Suite *s;
+
+    /* Take our options out before gst_check_init() parses the rest */
+    ctx = g_option_context_new (NULL);
+    g_option_context_set_ignore_unknown_options (ctx, TRUE);
+    g_option_context_set_help_enabled (ctx, FALSE);
+    g_option_context_add_main_entries (ctx, bench_entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (ctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (ctx);
+
+    /* The options picking what to benchmark are of no use to the tests */
+    if (bench_max_mallocs > 0 || bench_max_gst_allocs > 0)
+        bench_allocs = TRUE;
+    if (bench_replay || bench_allocs || bench_lists || bench_latency || bench_scaling || bench_impair)
+        bench = TRUE;
+
+    gst_check_init (&argc, &argv);
+
+    if (bench && bench_allocs) {
+        /* Lives for the whole process, registering the hook enables it */
+        g_object_new (alloc_tracer_get_type (), NULL);
+    }
+
+    if (bench) {
+        s = rtp_bench_suite ();
+        return gst_check_run_suite (s, "rtp_bench", __FILE__);
+    }
+
+    s = rtp_payloading_suite ();
+    return gst_check_run_suite (s, "rtp_payloading", __FILE__);
+}
@@ -2,6 +2,9 @@
 #include <memory>
 #include <gst/gst.h>
 #include <glib.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
 
 /*int main() {
     std::cout << "Hello, World!" << std::endl;
@@ -10,69 +13,434 @@
     return 0;
 }*/
 
+/*
+ * Pipeline benchmark runner. Runs any launch description until EOS, for
+ * --duration seconds or until --buffers reached the sinks, and reports
+ * buffers/s, CPU time, max RSS and optionally the time spent in each
+ * element.
+ */
+
+#define DEFAULT_PIPELINE "videotestsrc ! autovideosink"
+
+static gdouble duration = 0;
+static gint64 max_buffers = 0;
+static gchar *sync_mode = NULL;
+static gboolean element_times = FALSE;
+static gchar **launch_args = NULL;
+
+static GOptionEntry entries[] = {
+        {"duration", 'd', 0, G_OPTION_ARG_DOUBLE, &duration,
+                "Stop after this many seconds", "SECONDS"},
+        {"buffers", 'n', 0, G_OPTION_ARG_INT64, &max_buffers,
+                "Stop after this many buffers reached the sinks", "N"},
+        {"sync", 0, 0, G_OPTION_ARG_STRING, &sync_mode,
+                "Set sync on all sinks (default: leave the sinks' own setting)", "on|off"},
+        {"element-times", 'e', 0, G_OPTION_ARG_NONE, &element_times,
+                "Measure the time spent in each element", NULL},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &launch_args, NULL,
+                "[PIPELINE-DESCRIPTION]"},
+        {NULL}
+};
+
+static GstElement *pipeline = NULL;
+static volatile gint sink_buffers = 0;
+static volatile gint eos_sent = 0;
+static gboolean run_failed = FALSE;
+
+static MetricsCounter *buffers_counter;
+static MetricsHistogram *interval_hist;
+/* Gap between two buffers at one sink, around the usual frame durations */
+static const gdouble interval_bounds[] = {
+        0.001, 0.005, 0.010, 0.020, 0.034, 0.050, 0.100, 0.250, 1.0
+};
+
+/*
+ * Per-element processing time. A tracer follows every push on the calling
+ * thread: the time between pad-push-pre and pad-push-post is charged to
+ * the peer element, minus the time of the pushes that element made itself
+ * downstream in between. Source elements' own work (create) is not pushed
+ * to them, so it is not measured.
+ */
+typedef struct
+{
+    gchar *name;
+    GMutex lock;
+    guint64 time;
+    guint64 buffers;
+} ElementStats;
+
+typedef struct
+{
+    ElementStats *stats;
+    GstClockTime start;
+    GstClockTime child;
+    guint buffers;
+} PushFrame;
+
+static GMutex stats_lock;
+static GPtrArray *all_stats = NULL;
+static GQuark stats_quark = 0;
+static GPrivate push_stack = G_PRIVATE_INIT ((GDestroyNotify) g_array_unref);
+
+typedef struct
+{
+    GstTracer parent;
+} ElementTimeTracer;
+
+typedef struct
+{
+    GstTracerClass parent_class;
+} ElementTimeTracerClass;
+
+G_DEFINE_TYPE (ElementTimeTracer, element_time_tracer, GST_TYPE_TRACER);
+
+static ElementStats *
+element_stats_get (GstPad * pad)
+{
+    GstPad *peer = GST_PAD_PEER (pad);
+    GstObject *parent;
+    ElementStats *stats;
+
+    if (!peer)
+        return NULL;
+    parent = GST_OBJECT_PARENT (peer);
+    /* Ghost pads lead into a bin, its time is the one of its children */
+    if (!parent || !GST_IS_ELEMENT (parent) || GST_IS_BIN (parent))
+        return NULL;
+
+    stats = (ElementStats *) g_object_get_qdata (G_OBJECT (parent), stats_quark);
+    if (stats)
+        return stats;
+
+    g_mutex_lock (&stats_lock);
+    stats = (ElementStats *) g_object_get_qdata (G_OBJECT (parent), stats_quark);
+    if (!stats) {
+        stats = g_new0 (ElementStats, 1);
+        stats->name = gst_object_get_name (parent);
+        g_mutex_init (&stats->lock);
+        g_ptr_array_add (all_stats, stats);
+        g_object_set_qdata (G_OBJECT (parent), stats_quark, stats);
+    }
+    g_mutex_unlock (&stats_lock);
+
+    return stats;
+}
+
+static void
+push_frame_enter (GstClockTime ts, GstPad * pad, guint buffers)
+{
+    GArray *stack = (GArray *) g_private_get (&push_stack);
+    PushFrame frame;
+
+    if (!stack) {
+        stack = g_array_new (FALSE, FALSE, sizeof (PushFrame));
+        g_private_set (&push_stack, stack);
+    }
+    frame.stats = element_stats_get (pad);
+    frame.start = ts;
+    frame.child = 0;
+    frame.buffers = buffers;
+    g_array_append_val (stack, frame);
+}
+
+static void
+push_frame_leave (GstClockTime ts)
+{
+    GArray *stack = (GArray *) g_private_get (&push_stack);
+    PushFrame *frame;
+    GstClockTime inclusive;
+
+    if (!stack || stack->len == 0)
+        return;
+    frame = &g_array_index (stack, PushFrame, stack->len - 1);
+    inclusive = ts - frame->start;
+
+    if (frame->stats) {
+        g_mutex_lock (&frame->stats->lock);
+        frame->stats->time += inclusive > frame->child ? inclusive - frame->child : 0;
+        frame->stats->buffers += frame->buffers;
+        g_mutex_unlock (&frame->stats->lock);
+    }
+    g_array_set_size (stack, stack->len - 1);
+    if (stack->len > 0)
+        g_array_index (stack, PushFrame, stack->len - 1).child += inclusive;
+}
+
+static void
+element_time_push_pre (GObject * self, GstClockTime ts, GstPad * pad, GstBuffer * buffer)
+{
+    push_frame_enter (ts, pad, 1);
+}
+
+static void
+element_time_push_list_pre (GObject * self, GstClockTime ts, GstPad * pad, GstBufferList * list)
+{
+    push_frame_enter (ts, pad, gst_buffer_list_length (list));
+}
+
+static void
+element_time_push_post (GObject * self, GstClockTime ts, GstPad * pad, GstFlowReturn res)
+{
+    push_frame_leave (ts);
+}
+
+static void
+element_time_tracer_class_init (ElementTimeTracerClass * klass)
+{
+}
+
+static void
+element_time_tracer_init (ElementTimeTracer * self)
+{
+    GstTracer *tracer = GST_TRACER (self);
+
+    gst_tracing_register_hook (tracer, "pad-push-pre", G_CALLBACK (element_time_push_pre));
+    gst_tracing_register_hook (tracer, "pad-push-post", G_CALLBACK (element_time_push_post));
+    gst_tracing_register_hook (tracer, "pad-push-list-pre", G_CALLBACK (element_time_push_list_pre));
+    gst_tracing_register_hook (tracer, "pad-push-list-post", G_CALLBACK (element_time_push_post));
+}
+
+static gint
+compare_stats_time (gconstpointer a, gconstpointer b)
+{
+    const ElementStats *sa = *(ElementStats * const *) a;
+    const ElementStats *sb = *(ElementStats * const *) b;
+
+    return sa->time < sb->time ? 1 : (sa->time > sb->time ? -1 : 0);
+}
+
+static void
+print_element_times (void)
+{
+    guint i;
+
+    g_ptr_array_sort (all_stats, compare_stats_time);
+    g_print ("%-32s %12s %12s %12s\n", "element", "time (ms)", "buffers", "us/buffer");
+    for (i = 0; i < all_stats->len; i++) {
+        ElementStats *stats = (ElementStats *) g_ptr_array_index (all_stats, i);
+
+        g_print ("%-32s %12.3f %12" G_GUINT64_FORMAT " %12.3f\n", stats->name,
+                 stats->time / 1e6, stats->buffers,
+                 stats->buffers ? stats->time / 1e3 / stats->buffers : 0.0);
+    }
+}
+
+static void
+element_stats_free (gpointer data)
+{
+    ElementStats *stats = (ElementStats *) data;
+
+    g_mutex_clear (&stats->lock);
+    g_free (stats->name);
+    g_free (stats);
+}
+
 static gboolean bus_call (GstBus *bus, GstMessage *msg, gpointer data);
 
+static gboolean
+send_eos (gpointer data)
+{
+    g_print ("Stopping\n");
+    gst_element_send_event (pipeline, gst_event_new_eos ());
+    return G_SOURCE_REMOVE;
+}
+
+static GstPadProbeReturn
+sink_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    gint64 *last = (gint64 *) user_data;
+    gint64 now = g_get_monotonic_time ();
+    gint n = 1;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        n = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+    metrics_counter_add (buffers_counter, n);
+    /* One streaming thread per sink pad, no locking needed */
+    if (*last)
+        metrics_histogram_observe (interval_hist, (now - *last) / (gdouble) G_USEC_PER_SEC);
+    *last = now;
+    n = g_atomic_int_add (&sink_buffers, n) + n;
+
+    if (max_buffers > 0 && n >= max_buffers && g_atomic_int_compare_and_exchange (&eos_sent, 0, 1))
+        g_idle_add (send_eos, NULL);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Applies --sync to a sink and counts the buffers reaching it, once.
+ */
+static void
+setup_sink (GstElement * element)
+{
+    static GMutex lock;
+    gboolean done;
+    GstPad *pad;
+
+    if (GST_IS_BIN (element) || !GST_OBJECT_FLAG_IS_SET (element, GST_ELEMENT_FLAG_SINK))
+        return;
+    g_mutex_lock (&lock);
+    done = g_object_get_data (G_OBJECT (element), "mainapp-sink") != NULL;
+    g_object_set_data (G_OBJECT (element), "mainapp-sink", GINT_TO_POINTER (1));
+    g_mutex_unlock (&lock);
+    if (done)
+        return;
+
+    if (sync_mode && g_object_class_find_property (G_OBJECT_GET_CLASS (element), "sync"))
+        g_object_set (element, "sync", g_strcmp0 (sync_mode, "off") != 0, NULL);
+    pad = gst_element_get_static_pad (element, "sink");
+    if (pad) {
+        gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+                           GST_PAD_PROBE_TYPE_BUFFER_LIST), sink_probe_cb,
+                           g_new0 (gint64, 1), g_free);
+        gst_object_unref (pad);
+    }
+}
+
+/*
+ * Sinks created later, e.g. by playbin or decodebin, possibly from a
+ * streaming thread.
+ */
+static void
+deep_element_added_cb (GstBin * bin, GstBin * sub_bin, GstElement * element, gpointer user_data)
+{
+    setup_sink (element);
+}
+
+/*
+ * Sets up every sink there is in READY, when auto sinks already created
+ * their real sink, and the ones added after.
+ */
+static void
+setup_sinks (void)
+{
+    GstIterator *it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+    GValue item = G_VALUE_INIT;
+
+    g_signal_connect (pipeline, "deep-element-added", G_CALLBACK (deep_element_added_cb), NULL);
+    while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+        setup_sink (GST_ELEMENT (g_value_get_object (&item)));
+        g_value_reset (&item);
+    }
+    g_value_unset (&item);
+    gst_iterator_free (it);
+}
+
+static gdouble
+cpu_seconds (const struct rusage * usage)
+{
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 +
+           usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
 int main (int argc, char *argv[])
 {
     GMainLoop *loop;
-
-    GstElement *pipeline, *videotestsrcm, *autovideosinkm;
+    GOptionContext *optctx;
+    GError *error = NULL;
+    GstTracer *tracer = NULL;
+    gchar *description;
     GstBus *bus;
     guint bus_watch_id;
+    struct rusage usage_start, usage_end;
+    gint64 start_time;
+    gdouble wall, cpu;
 
     /* Initialisation */
-    gst_init (&argc, &argv);
+    optctx = g_option_context_new ("- pipeline benchmark runner");
+    g_option_context_add_main_entries (optctx, entries, NULL);
+    g_option_context_add_group (optctx, gst_init_get_option_group ());
+    g_option_context_add_group (optctx, metrics_get_option_group ());
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
 
-    loop = g_main_loop_new (NULL, FALSE);
+    if (sync_mode && g_strcmp0 (sync_mode, "on") != 0 && g_strcmp0 (sync_mode, "off") != 0) {
+        g_printerr ("--sync must be on or off\n");
+        return -1;
+    }
 
+    if (!metrics_setup ())
+        return -1;
+    buffers_counter = metrics_counter_new ("sink_buffers_total", "Buffers that reached the sinks");
+    interval_hist = metrics_histogram_new ("sink_buffer_interval_seconds", "Time between two buffers at a sink",
+                                           interval_bounds, G_N_ELEMENTS (interval_bounds));
 
-    /* Create gstreamer elements */
-    pipeline = gst_pipeline_new ("videotest-pipeline");
-    videotestsrcm   = gst_element_factory_make ("videotestsrc", "testsource");
-    autovideosinkm = gst_element_factory_make ("autovideosink", "videosink");
+    if (element_times) {
+        stats_quark = g_quark_from_static_string ("mainapp-element-stats");
+        all_stats = g_ptr_array_new_with_free_func (element_stats_free);
+        tracer = GST_TRACER (g_object_new (element_time_tracer_get_type (), NULL));
+    }
+
+    loop = g_main_loop_new (NULL, FALSE);
 
-    if (!pipeline || !videotestsrcm || !autovideosinkm) {
-        g_printerr ("One element could not be created. Exiting.\n");
+    /* Create the pipeline */
+    description = launch_args ? g_strjoinv (" ", launch_args) : g_strdup (DEFAULT_PIPELINE);
+    pipeline = gst_parse_launch (description, &error);
+    if (!pipeline || error) {
+        g_printerr ("Can't create pipeline '%s': %s\n", description, error ? error->message : "?");
+        g_clear_error (&error);
+        if (pipeline)
+            gst_object_unref (pipeline);
+        g_free (description);
         return -1;
     }
+    if (!GST_IS_PIPELINE (pipeline)) {
+        GstElement *wrapper = gst_pipeline_new ("benchmark-pipeline");
 
-    /* Set up the pipeline */
+        gst_bin_add (GST_BIN (wrapper), pipeline);
+        pipeline = wrapper;
+    }
 
     /* we add a message handler */
     bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
     bus_watch_id = gst_bus_add_watch (bus, bus_call, loop);
     gst_object_unref (bus);
 
+    gst_element_set_state (pipeline, GST_STATE_READY);
+    setup_sinks ();
 
-    /* we add all elements into the pipeline */
-    gst_bin_add_many (GST_BIN (pipeline),
-                      videotestsrcm, autovideosinkm, NULL);
-
-    /* we link the elements together */
-    /* videotestsrcm -> autovideosinkm */
-    gst_element_link (videotestsrcm, autovideosinkm);
-
+    if (duration > 0)
+        g_timeout_add ((guint) (duration * 1000), send_eos, NULL);
 
     /* Set the pipeline to "playing" state*/
-    g_print ("Now set pipeline in state playing");
+    g_print ("Running %s\n", description);
+    getrusage (RUSAGE_SELF, &usage_start);
+    start_time = g_get_monotonic_time ();
     gst_element_set_state (pipeline, GST_STATE_PLAYING);
 
-
     /* Iterate */
-    g_print ("Running...\n");
     g_main_loop_run (loop);
 
+    wall = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+    getrusage (RUSAGE_SELF, &usage_end);
+    cpu = cpu_seconds (&usage_end) - cpu_seconds (&usage_start);
 
     /* Out of the main loop, clean up nicely */
-    g_print ("Returned, stopping playback\n");
     gst_element_set_state (pipeline, GST_STATE_NULL);
 
-    g_print ("Deleting pipeline\n");
+    g_print ("Wall time:   %.3f s\n", wall);
+    g_print ("Buffers:     %d at the sinks, %.1f buffers/s\n", sink_buffers,
+             wall > 0 ? sink_buffers / wall : 0);
+    g_print ("CPU time:    %.3f s (%.0f%% of one core)\n", cpu, wall > 0 ? 100 * cpu / wall : 0);
+    g_print ("Max RSS:     %ld KB\n", usage_end.ru_maxrss);
+    if (element_times)
+        print_element_times ();
+
     gst_object_unref (GST_OBJECT (pipeline));
     g_source_remove (bus_watch_id);
     g_main_loop_unref (loop);
+    g_free (description);
+    g_strfreev (launch_args);
+    g_free (sync_mode);
+    /* The tracer stays registered for the rest of the process */
+    (void) tracer;
 
-    return 0;
+    return run_failed ? -1 : 0;
 }
 
 static gboolean bus_call (GstBus *bus, GstMessage *msg, gpointer data)
@@ -96,6 +464,7 @@ static gboolean bus_call (GstBus *bus, GstMessage *msg, gpointer data)
             g_printerr ("Error: %s\n", error->message);
             g_error_free (error);
 
+            run_failed = TRUE;
             g_main_loop_quit (loop);
             break;
         }
@@ -0,0 +1,331 @@
+//
+// Process wide counters, gauges and histograms, see metrics.h.
+//
+
+#include "metrics.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define METRICS_SHARDS 16
+/* gsize slots per cache line, shard rows are padded to a whole line */
+#define SLOTS_PER_LINE (64 / sizeof (gsize))
+/* Histogram sums are kept as integers in units of 1e-9 */
+#define HISTOGRAM_SUM_SCALE 1e9
+#define MAX_REQUEST_SIZE 8192
+
+typedef enum
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} MetricType;
+
+struct _Metric
+{
+    MetricType type;
+    gchar *name;
+    gchar *help;
+    gdouble *bounds;
+    guint n_bounds;
+    /*
+     * METRICS_SHARDS rows of stride slots. A counter row holds its value,
+     * a histogram row holds n_bounds + 1 bucket counts and the scaled sum.
+     */
+    gsize *slots;
+    guint stride;
+    gssize gauge;
+};
+
+static gchar *metrics_address = NULL;
+
+static GOptionEntry metrics_entries[] = {
+        {"metrics", 0, 0, G_OPTION_ARG_STRING, &metrics_address,
+                "Serve counters over HTTP on [HOST:]PORT (default host 127.0.0.1) or unix:PATH", "ADDRESS"},
+        {NULL}
+};
+
+static GMutex metrics_lock;
+static GPtrArray *metrics = NULL;
+static volatile gint next_shard = 0;
+static GPrivate thread_shard;
+static GSocketService *service = NULL;
+
+/*
+ * Threads take the shards round robin, so up to METRICS_SHARDS threads
+ * never share a cache line.
+ */
+static inline guint
+shard_index (void)
+{
+    guint shard = GPOINTER_TO_UINT (g_private_get (&thread_shard));
+
+    if (G_UNLIKELY (shard == 0)) {
+        shard = (guint) g_atomic_int_add (&next_shard, 1) % METRICS_SHARDS + 1;
+        g_private_set (&thread_shard, GUINT_TO_POINTER (shard));
+    }
+    return shard - 1;
+}
+
+static gsize
+slot_sum (struct _Metric * metric, guint slot)
+{
+    gsize sum = 0;
+    guint i;
+
+    for (i = 0; i < METRICS_SHARDS; i++)
+        sum += (gsize) g_atomic_pointer_get (&metric->slots[i * metric->stride + slot]);
+    return sum;
+}
+
+static struct _Metric *
+metric_get (MetricType type, const gchar * name, const gchar * help, const gdouble * bounds,
+            guint n_bounds)
+{
+    struct _Metric *metric = NULL;
+    guint i, slots;
+
+    g_mutex_lock (&metrics_lock);
+    if (!metrics)
+        metrics = g_ptr_array_new ();
+    for (i = 0; i < metrics->len && !metric; i++) {
+        if (g_strcmp0 (((struct _Metric *) g_ptr_array_index (metrics, i))->name, name) == 0)
+            metric = (struct _Metric *) g_ptr_array_index (metrics, i);
+    }
+    if (metric) {
+        g_mutex_unlock (&metrics_lock);
+        if (metric->type != type)
+            g_error ("Metric %s registered twice with different types", name);
+        return metric;
+    }
+
+    metric = g_new0 (struct _Metric, 1);
+    metric->type = type;
+    metric->name = g_strdup (name);
+    metric->help = g_strdup (help);
+    if (type == METRIC_HISTOGRAM) {
+#if GLIB_CHECK_VERSION (2, 68, 0)
+        metric->bounds = (gdouble *) g_memdup2 (bounds, n_bounds * sizeof (gdouble));
+#else
+        metric->bounds = (gdouble *) g_memdup (bounds, n_bounds * sizeof (gdouble));
+#endif
+        metric->n_bounds = n_bounds;
+    }
+    if (type != METRIC_GAUGE) {
+        slots = type == METRIC_HISTOGRAM ? n_bounds + 2 : 1;
+        metric->stride = (slots + SLOTS_PER_LINE - 1) / SLOTS_PER_LINE * SLOTS_PER_LINE;
+        /* Never freed, metrics live as long as the process */
+        if (posix_memalign ((void **) &metric->slots, 64, METRICS_SHARDS * metric->stride * sizeof (gsize)))
+            g_error ("Can't allocate the slots of metric %s", name);
+        memset (metric->slots, 0, METRICS_SHARDS * metric->stride * sizeof (gsize));
+    }
+    g_ptr_array_add (metrics, metric);
+    g_mutex_unlock (&metrics_lock);
+
+    return metric;
+}
+
+MetricsCounter *
+metrics_counter_new (const gchar * name, const gchar * help)
+{
+    return metric_get (METRIC_COUNTER, name, help, NULL, 0);
+}
+
+void
+metrics_counter_add (MetricsCounter * counter, guint64 n)
+{
+    g_atomic_pointer_add (&counter->slots[shard_index () * counter->stride], (gssize) n);
+}
+
+MetricsGauge *
+metrics_gauge_new (const gchar * name, const gchar * help)
+{
+    return metric_get (METRIC_GAUGE, name, help, NULL, 0);
+}
+
+void
+metrics_gauge_set (MetricsGauge * gauge, gint64 value)
+{
+    g_atomic_pointer_set (&gauge->gauge, (gssize) value);
+}
+
+void
+metrics_gauge_add (MetricsGauge * gauge, gint64 n)
+{
+    g_atomic_pointer_add (&gauge->gauge, (gssize) n);
+}
+
+MetricsHistogram *
+metrics_histogram_new (const gchar * name, const gchar * help, const gdouble * bounds, guint n_bounds)
+{
+    return metric_get (METRIC_HISTOGRAM, name, help, bounds, n_bounds);
+}
+
+void
+metrics_histogram_observe (MetricsHistogram * histogram, gdouble value)
+{
+    gsize *row = &histogram->slots[shard_index () * histogram->stride];
+    guint bucket = 0;
+
+    /* Few buckets, a linear scan beats a binary search */
+    while (bucket < histogram->n_bounds && value > histogram->bounds[bucket])
+        bucket++;
+    g_atomic_pointer_add (&row[bucket], (gssize) 1);
+    if (value > 0)
+        g_atomic_pointer_add (&row[histogram->n_bounds + 1], (gssize) (value * HISTOGRAM_SUM_SCALE));
+}
+
+static gchar *
+metrics_render (void)
+{
+    GString *out = g_string_new (NULL);
+    gchar num[G_ASCII_DTOSTR_BUF_SIZE];
+    guint i, b;
+
+    g_mutex_lock (&metrics_lock);
+    for (i = 0; metrics && i < metrics->len; i++) {
+        struct _Metric *metric = (struct _Metric *) g_ptr_array_index (metrics, i);
+
+        g_string_append_printf (out, "# HELP %s %s\n", metric->name, metric->help);
+        switch (metric->type) {
+        case METRIC_COUNTER:
+            g_string_append_printf (out, "# TYPE %s counter\n%s %" G_GSIZE_FORMAT "\n", metric->name,
+                                    metric->name, slot_sum (metric, 0));
+            break;
+        case METRIC_GAUGE:
+            g_string_append_printf (out, "# TYPE %s gauge\n%s %" G_GSSIZE_FORMAT "\n", metric->name,
+                                    metric->name, (gssize) g_atomic_pointer_get (&metric->gauge));
+            break;
+        case METRIC_HISTOGRAM:{
+            gsize cumulative = 0;
+
+            g_string_append_printf (out, "# TYPE %s histogram\n", metric->name);
+            for (b = 0; b <= metric->n_bounds; b++) {
+                cumulative += slot_sum (metric, b);
+                if (b < metric->n_bounds)
+                    g_ascii_dtostr (num, sizeof (num), metric->bounds[b]);
+                g_string_append_printf (out, "%s_bucket{le=\"%s\"} %" G_GSIZE_FORMAT "\n", metric->name,
+                                        b < metric->n_bounds ? num : "+Inf", cumulative);
+            }
+            g_ascii_dtostr (num, sizeof (num), slot_sum (metric, metric->n_bounds + 1) / HISTOGRAM_SUM_SCALE);
+            g_string_append_printf (out, "%s_sum %s\n%s_count %" G_GSIZE_FORMAT "\n", metric->name, num,
+                                    metric->name, cumulative);
+            break;
+        }
+        }
+    }
+    g_mutex_unlock (&metrics_lock);
+
+    return g_string_free (out, FALSE);
+}
+
+/*
+ * One request per connection: read the header, answer any GET with all
+ * metrics and close.
+ */
+static gboolean
+metrics_run_cb (GThreadedSocketService * svc, GSocketConnection * connection, GObject * source,
+                gpointer user_data)
+{
+    GInputStream *in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    GOutputStream *out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    gchar request[MAX_REQUEST_SIZE + 1];
+    gsize len = 0;
+    gchar *body, *header;
+    const gchar *status = "200 OK";
+
+    while (len < MAX_REQUEST_SIZE) {
+        gssize n = g_input_stream_read (in, request + len, MAX_REQUEST_SIZE - len, NULL, NULL);
+
+        if (n <= 0)
+            return TRUE;
+        len += n;
+        request[len] = '\0';
+        if (strstr (request, "\r\n\r\n") || strstr (request, "\n\n"))
+            break;
+    }
+
+    if (g_str_has_prefix (request, "GET ")) {
+        body = metrics_render ();
+    } else {
+        status = "405 Method Not Allowed";
+        body = g_strdup ("");
+    }
+    header = g_strdup_printf ("HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %" G_GSIZE_FORMAT "\r\nConnection: close\r\n\r\n",
+                              status, strlen (body));
+    g_output_stream_write_all (out, header, strlen (header), NULL, NULL, NULL);
+    g_output_stream_write_all (out, body, strlen (body), NULL, NULL, NULL);
+    g_free (header);
+    g_free (body);
+
+    return TRUE;
+}
+
+GOptionGroup *
+metrics_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("metrics", "Metrics endpoint options",
+                                "Show metrics endpoint options", NULL, NULL);
+    g_option_group_add_entries (group, metrics_entries);
+    return group;
+}
+
+gboolean
+metrics_setup (void)
+{
+    GSocketAddress *address;
+    GError *error = NULL;
+
+    if (!metrics_address || service)
+        return TRUE;
+
+    if (g_str_has_prefix (metrics_address, "unix:")) {
+        const gchar *path = metrics_address + strlen ("unix:");
+        GStatBuf st;
+
+        /* A socket left behind by a previous run would fail the bind */
+        if (g_stat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+            g_unlink (path);
+        address = g_unix_socket_address_new (path);
+    } else {
+        const gchar *colon = strrchr (metrics_address, ':');
+        gchar *host = colon ? g_strndup (metrics_address, colon - metrics_address) : g_strdup ("127.0.0.1");
+        gchar *end;
+        gint64 port = g_ascii_strtoll (colon ? colon + 1 : metrics_address, &end, 10);
+
+        if (*end || port <= 0 || port > 65535) {
+            g_printerr ("Invalid --metrics address '%s'\n", metrics_address);
+            g_free (host);
+            return FALSE;
+        }
+        address = g_inet_socket_address_new_from_string (host, (guint) port);
+        g_free (host);
+        if (!address) {
+            g_printerr ("Invalid --metrics host in '%s'\n", metrics_address);
+            return FALSE;
+        }
+    }
+
+    service = g_threaded_socket_service_new (2);
+    if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address, G_SOCKET_TYPE_STREAM,
+                                        G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error)) {
+        g_printerr ("Can't serve metrics on %s: %s\n", metrics_address, error->message);
+        g_clear_error (&error);
+        g_object_unref (address);
+        g_clear_object (&service);
+        return FALSE;
+    }
+    g_object_unref (address);
+
+    g_signal_connect (service, "run", G_CALLBACK (metrics_run_cb), NULL);
+    g_socket_service_start (service);
+    g_print ("Metrics served on %s\n", metrics_address);
+
+    return TRUE;
+}
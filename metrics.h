@@ -0,0 +1,63 @@
+//
+// Process wide counters, gauges and histograms, shared by all binaries.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib.h>
+
+/*
+ * Metrics are created once by name and live until the process exits, so
+ * the hot path is a lookup-free atomic add on the returned pointer.
+ * Counters and histograms are sharded per thread: every thread adds to its
+ * own cache line and the shards are only summed when the endpoint is
+ * scraped. Gauges hold a single value that is set or adjusted.
+ *
+ * The values are served in the Prometheus text format by the --metrics
+ * endpoint, e.g. curl http://127.0.0.1:9100/metrics or
+ * curl --unix-socket /tmp/app.sock http://x/metrics
+ */
+
+typedef struct _Metric MetricsCounter;
+typedef struct _Metric MetricsGauge;
+typedef struct _Metric MetricsHistogram;
+
+/*
+ * Returns the counter called name, creating it on first use.
+ * @param name Metric name, e.g. "rtsp_frames_sent_total".
+ * @param help One line description.
+ */
+MetricsCounter *metrics_counter_new (const gchar * name, const gchar * help);
+
+void metrics_counter_add (MetricsCounter * counter, guint64 n);
+
+MetricsGauge *metrics_gauge_new (const gchar * name, const gchar * help);
+
+void metrics_gauge_set (MetricsGauge * gauge, gint64 value);
+
+void metrics_gauge_add (MetricsGauge * gauge, gint64 n);
+
+/*
+ * Returns the histogram called name, creating it on first use.
+ * @param bounds Ascending upper bounds of the buckets, +Inf is implied.
+ * @param n_bounds Number of bounds.
+ */
+MetricsHistogram *metrics_histogram_new (const gchar * name, const gchar * help,
+                                         const gdouble * bounds, guint n_bounds);
+
+void metrics_histogram_observe (MetricsHistogram * histogram, gdouble value);
+
+/*
+ * Returns the option group with --metrics, to be added to the binary's
+ * GOptionContext.
+ */
+GOptionGroup *metrics_get_option_group (void);
+
+/*
+ * Starts the endpoint given by --metrics, if any, on its own threads.
+ * @return FALSE if the endpoint can't be opened.
+ */
+gboolean metrics_setup (void);
+
+#endif //METRICS_H
@@ -0,0 +1,48 @@
+//
+// Binary log written by the perftrace tracer (gst_perf_tracer.cpp) and
+// read by perflogreader (perf_log_reader.cpp).
+//
+// The file starts with a PerfLogHeader, followed by fixed size PerfRecords
+// in host byte order. A PERF_RECORD_NAME record is followed by its name,
+// arg bytes padded to a multiple of 8.
+//
+
+#ifndef PERF_LOG_FORMAT_H
+#define PERF_LOG_FORMAT_H
+
+#include <glib.h>
+
+#define PERF_LOG_MAGIC "GSTPERF1"
+#define PERF_LOG_VERSION 1
+
+typedef struct
+{
+    gchar magic[8];
+    guint32 version;
+    guint32 record_size;
+    guint64 start_ts;           /* gst_util_get_timestamp () when tracing started */
+} PerfLogHeader;
+
+typedef enum
+{
+    PERF_RECORD_NAME = 1,       /* id names an element or pad, arg = name length */
+    PERF_RECORD_PROC,           /* element id spent value ns on arg buffers, ts = chain start */
+    PERF_RECORD_ARRIVAL,        /* pad id got a buffer value ns after the previous one */
+    PERF_RECORD_QUEUE,          /* queue id holds arg buffers and value ns of data */
+    PERF_RECORD_DROPS           /* thread tid lost arg records to a full buffer */
+} PerfRecordType;
+
+typedef struct
+{
+    guint8 type;
+    guint8 reserved[3];
+    guint32 tid;
+    guint64 ts;
+    guint32 id;
+    guint32 arg;
+    guint64 value;
+} PerfRecord;
+
+G_STATIC_ASSERT (sizeof (PerfRecord) == 32);
+
+#endif // PERF_LOG_FORMAT_H
@@ -0,0 +1,299 @@
+//
+// Summarises a log written by the perftrace tracer (gst_perf_tracer.cpp).
+//
+// perflogreader [--dump] gstperf-1234.log
+//
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "perf_log_format.h"
+
+static gboolean dump = FALSE;
+
+static GOptionEntry entries[] = {
+    {"dump", 'd', 0, G_OPTION_ARG_NONE, &dump, "Print every record", NULL},
+    {NULL}
+};
+
+typedef struct
+{
+    GArray *values;             /* guint64, per buffer for PROC, gaps for ARRIVAL */
+    guint64 total;
+    guint64 buffers;
+    guint64 max;
+    GHashTable *threads;
+} Stats;
+
+static GHashTable *names;       /* id -> name */
+static GHashTable *proc;        /* id -> Stats */
+static GHashTable *arrival;
+static GHashTable *queues;
+static GHashTable *thread_records;      /* tid -> count */
+static GHashTable *thread_drops;
+
+static Stats *
+stats_get (GHashTable * table, guint32 id)
+{
+    Stats *stats = (Stats *) g_hash_table_lookup (table, GUINT_TO_POINTER (id));
+
+    if (!stats) {
+        stats = g_new0 (Stats, 1);
+        stats->values = g_array_new (FALSE, FALSE, sizeof (guint64));
+        stats->threads = g_hash_table_new (NULL, NULL);
+        g_hash_table_insert (table, GUINT_TO_POINTER (id), stats);
+    }
+    return stats;
+}
+
+static void
+stats_free (gpointer data)
+{
+    Stats *stats = (Stats *) data;
+
+    g_array_free (stats->values, TRUE);
+    g_hash_table_unref (stats->threads);
+    g_free (stats);
+}
+
+static gint
+compare_u64 (gconstpointer a, gconstpointer b)
+{
+    guint64 x = *(const guint64 *) a, y = *(const guint64 *) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static guint64
+percentile (GArray * sorted, gdouble p)
+{
+    if (sorted->len == 0)
+        return 0;
+    return g_array_index (sorted, guint64, (guint) ((sorted->len - 1) * p));
+}
+
+static const gchar *
+name_of (guint32 id)
+{
+    const gchar *name = (const gchar *) g_hash_table_lookup (names, GUINT_TO_POINTER (id));
+
+    return name ? name : "?";
+}
+
+static void
+count_thread (GHashTable * table, guint32 tid, guint64 n)
+{
+    guint64 count = GPOINTER_TO_SIZE (g_hash_table_lookup (table, GUINT_TO_POINTER (tid)));
+
+    g_hash_table_insert (table, GUINT_TO_POINTER (tid), GSIZE_TO_POINTER (count + n));
+}
+
+static gchar *
+threads_string (GHashTable * threads)
+{
+    GString *str = g_string_new (NULL);
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, threads);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_string_append_printf (str, "%s%u", str->len ? "," : "", GPOINTER_TO_UINT (key));
+    return g_string_free (str, FALSE);
+}
+
+static gboolean
+read_log (const gchar * path)
+{
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new (path, FALSE, &error);
+    const guint8 *data, *end;
+    const PerfLogHeader *header;
+    guint64 start_ts;
+
+    if (!mapped) {
+        g_printerr ("Can't open %s: %s\n", path, error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    data = (const guint8 *) g_mapped_file_get_contents (mapped);
+    end = data + g_mapped_file_get_length (mapped);
+
+    header = (const PerfLogHeader *) data;
+    if (end - data < (gssize) sizeof (PerfLogHeader) || memcmp (header->magic, PERF_LOG_MAGIC, 8) != 0) {
+        g_printerr ("%s is not a perftrace log\n", path);
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+    if (header->version != PERF_LOG_VERSION || header->record_size != sizeof (PerfRecord)) {
+        g_printerr ("%s: unsupported version %u, record size %u\n", path, header->version, header->record_size);
+        g_mapped_file_unref (mapped);
+        return FALSE;
+    }
+    start_ts = header->start_ts;
+    data += sizeof (PerfLogHeader);
+
+    /* A record in flight when the process died is cut short, stop there */
+    while (end - data >= (gssize) sizeof (PerfRecord)) {
+        PerfRecord rec;
+
+        memcpy (&rec, data, sizeof (rec));
+        data += sizeof (rec);
+
+        if (dump && rec.type != PERF_RECORD_NAME)
+            g_print ("%12.6f tid=%u type=%u id=%u arg=%u value=%" G_GUINT64_FORMAT "\n",
+                     (gint64) (rec.ts - start_ts) / 1e9, rec.tid, rec.type, rec.id, rec.arg, rec.value);
+
+        switch (rec.type) {
+        case PERF_RECORD_NAME:{
+            gsize padded = (rec.arg + 7) & ~7u;
+
+            if ((gsize) (end - data) < padded)
+                goto done;
+            g_hash_table_insert (names, GUINT_TO_POINTER (rec.id), g_strndup ((const gchar *) data, rec.arg));
+            data += padded;
+            break;
+        }
+        case PERF_RECORD_PROC:{
+            Stats *stats = stats_get (proc, rec.id);
+            guint64 per_buffer = rec.value / MAX (rec.arg, 1);
+
+            g_array_append_val (stats->values, per_buffer);
+            stats->total += rec.value;
+            stats->buffers += rec.arg;
+            stats->max = MAX (stats->max, rec.value);
+            g_hash_table_add (stats->threads, GUINT_TO_POINTER (rec.tid));
+            count_thread (thread_records, rec.tid, 1);
+            break;
+        }
+        case PERF_RECORD_ARRIVAL:{
+            Stats *stats = stats_get (arrival, rec.id);
+
+            g_array_append_val (stats->values, rec.value);
+            stats->total += rec.value;
+            stats->buffers++;
+            stats->max = MAX (stats->max, rec.value);
+            count_thread (thread_records, rec.tid, 1);
+            break;
+        }
+        case PERF_RECORD_QUEUE:{
+            Stats *stats = stats_get (queues, rec.id);
+            guint64 level = rec.arg;
+
+            g_array_append_val (stats->values, rec.value);
+            stats->total += level;
+            stats->buffers++;
+            stats->max = MAX (stats->max, level);
+            break;
+        }
+        case PERF_RECORD_DROPS:
+            count_thread (thread_drops, rec.tid, rec.arg);
+            count_thread (thread_records, rec.tid, 0);
+            break;
+        default:
+            g_printerr ("Unknown record type %u, stopping\n", rec.type);
+            goto done;
+        }
+    }
+
+done:
+    g_mapped_file_unref (mapped);
+    return TRUE;
+}
+
+static void
+print_report (void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_print ("%-32s %10s %12s %10s %10s %10s  %s\n", "element", "buffers", "total ms", "mean us",
+             "p50 us", "p99 us", "threads");
+    g_hash_table_iter_init (&iter, proc);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        Stats *stats = (Stats *) value;
+        gchar *threads = threads_string (stats->threads);
+
+        g_array_sort (stats->values, compare_u64);
+        g_print ("%-32s %10" G_GUINT64_FORMAT " %12.3f %10.2f %10.2f %10.2f  %s\n",
+                 name_of (GPOINTER_TO_UINT (key)), stats->buffers, stats->total / 1e6,
+                 stats->buffers ? stats->total / 1e3 / stats->buffers : 0.0,
+                 percentile (stats->values, 0.5) / 1e3, percentile (stats->values, 0.99) / 1e3, threads);
+        g_free (threads);
+    }
+
+    g_print ("\n%-40s %10s %10s %10s %10s\n", "pad", "buffers", "mean ms", "p99 ms", "max ms");
+    g_hash_table_iter_init (&iter, arrival);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        Stats *stats = (Stats *) value;
+
+        g_array_sort (stats->values, compare_u64);
+        g_print ("%-40s %10" G_GUINT64_FORMAT " %10.3f %10.3f %10.3f\n", name_of (GPOINTER_TO_UINT (key)),
+                 stats->buffers, stats->buffers ? stats->total / 1e6 / stats->buffers : 0.0,
+                 percentile (stats->values, 0.99) / 1e6, stats->max / 1e6);
+    }
+
+    if (g_hash_table_size (queues)) {
+        g_print ("\n%-32s %10s %12s %12s %12s\n", "queue", "samples", "avg buffers", "max buffers",
+                 "max ms");
+        g_hash_table_iter_init (&iter, queues);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            Stats *stats = (Stats *) value;
+
+            g_array_sort (stats->values, compare_u64);
+            g_print ("%-32s %10" G_GUINT64_FORMAT " %12.1f %12" G_GUINT64_FORMAT " %12.3f\n",
+                     name_of (GPOINTER_TO_UINT (key)), stats->buffers,
+                     stats->buffers ? (gdouble) stats->total / stats->buffers : 0.0, stats->max,
+                     percentile (stats->values, 1.0) / 1e6);
+        }
+    }
+
+    g_print ("\n%-10s %10s %10s\n", "thread", "records", "dropped");
+    g_hash_table_iter_init (&iter, thread_records);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_print ("%-10u %10" G_GSIZE_FORMAT " %10" G_GSIZE_FORMAT "\n", GPOINTER_TO_UINT (key),
+                 GPOINTER_TO_SIZE (value), GPOINTER_TO_SIZE (g_hash_table_lookup (thread_drops, key)));
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    int ret = 0;
+
+    context = g_option_context_new ("LOGFILE - summarise a perftrace log");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("Error initializing: %s\n", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return -1;
+    }
+    g_option_context_free (context);
+    if (argc != 2) {
+        g_printerr ("Usage: %s [--dump] LOGFILE\n", argv[0]);
+        return -1;
+    }
+
+    names = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+    proc = g_hash_table_new_full (NULL, NULL, NULL, stats_free);
+    arrival = g_hash_table_new_full (NULL, NULL, NULL, stats_free);
+    queues = g_hash_table_new_full (NULL, NULL, NULL, stats_free);
+    thread_records = g_hash_table_new (NULL, NULL);
+    thread_drops = g_hash_table_new (NULL, NULL);
+
+    if (read_log (argv[1]))
+        print_report ();
+    else
+        ret = -1;
+
+    g_hash_table_unref (names);
+    g_hash_table_unref (proc);
+    g_hash_table_unref (arrival);
+    g_hash_table_unref (queues);
+    g_hash_table_unref (thread_records);
+    g_hash_table_unref (thread_drops);
+
+    return ret;
+}
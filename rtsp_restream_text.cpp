@@ -10,6 +10,10 @@
 #include <cstring>
 #include <iostream>
 
+#include "rtsp_server_common.h"
+#include "metrics.h"
+#include "dvr.h"
+
 #define DEFAULT_RTSP_PORT "8554"
 
 static char *port = (char *) DEFAULT_RTSP_PORT;
@@ -104,6 +108,8 @@ media_configure_cb(GstRTSPMediaFactory *factory, GstRTSPMedia *media) {
     g_signal_connect (appsrc, "need-data", (GCallback) need_data, ctx);
     gst_object_unref(appsrc);
     gst_object_unref(element);
+
+    client_backlog_attach(media, "pay0");
 }
 
 int
@@ -119,6 +125,10 @@ main(int argc, char *argv[]) {
     optctx = g_option_context_new("<filename.mp4> - Test RTSP Server, MP4");
     g_option_context_add_main_entries(optctx, entries, NULL);
     g_option_context_add_group(optctx, gst_init_get_option_group());
+    g_option_context_add_group(optctx, client_backlog_get_option_group());
+    g_option_context_add_group(optctx, server_threads_get_option_group());
+    g_option_context_add_group(optctx, metrics_get_option_group());
+    g_option_context_add_group(optctx, dvr_get_option_group());
     if (!g_option_context_parse(optctx, &argc, &argv, &error)) {
         g_printerr("Error parsing options: %s\n", error->message);
         g_option_context_free(optctx);
@@ -132,11 +142,17 @@ main(int argc, char *argv[]) {
     }
     g_option_context_free(optctx);
 
+    if (!metrics_setup())
+        return -1;
+
     loop = g_main_loop_new(NULL, FALSE);
 
     /* create a server instance */
     server = gst_rtsp_server_new();
     g_object_set(server, "service", port, NULL);
+    client_backlog_setup(server);
+    if (!server_threads_setup(server))
+        return -1;
 
     /* get the mount points for this server, every server has a default object
      * that be used to map uri mount points to media factories */
@@ -156,6 +172,7 @@ main(int argc, char *argv[]) {
 
     /* attach the test factory to the /test url */
     gst_rtsp_mount_points_add_factory(mounts, "/test", factory);
+    dvr_playback_setup(mounts);
 
     /* don't need the ref to the mapper anymore */
     g_object_unref(mounts);
@@ -0,0 +1,730 @@
+//
+// Helpers shared by the RTSP server binaries (rtsprestream, rtspstreamappsrc).
+//
+
+#include "rtsp_server_common.h"
+#include "dvr.h"
+#include "metrics.h"
+#include "shm_egress.h"
+
+#include <gst/video/video.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#define DEFAULT_CLIENT_BACKLOG_KB 1024
+#define DEFAULT_CLIENT_STATS_INTERVAL 10
+
+static gint client_backlog_kb = DEFAULT_CLIENT_BACKLOG_KB;
+static gint client_stats_interval = DEFAULT_CLIENT_STATS_INTERVAL;
+
+static GOptionEntry backlog_entries[] = {
+        {"client-backlog", 0, 0, G_OPTION_ARG_INT, &client_backlog_kb,
+                "Per-client send backlog in KB before frames are dropped, 0 disables (default: 1024)", "KB"},
+        {"client-stats", 0, 0, G_OPTION_ARG_INT, &client_stats_interval,
+                "Seconds between per-client counter reports, 0 disables (default: 10)", "SECONDS"},
+        {NULL}
+};
+
+#define DEFAULT_RTSP_THREADS 1
+
+static gint rtsp_threads = DEFAULT_RTSP_THREADS;
+static gchar *rtsp_cpus = NULL;
+
+static GOptionEntry thread_entries[] = {
+        {"rtsp-threads", 0, 0, G_OPTION_ARG_INT, &rtsp_threads,
+                "Client threads, each with its own GMainContext; -1 gives every client its own, 0 serves clients from the main context (default: 1)", "N"},
+        {"rtsp-cpus", 0, 0, G_OPTION_ARG_STRING, &rtsp_cpus,
+                "Comma separated CPUs to pin client threads to, round robin", "CPUS"},
+        {NULL}
+};
+
+/*
+ * Backlog state of one client, owned by its media. The backlog is what the
+ * payloader produced since PLAY minus what the client acknowledged, so it
+ * covers the server's own queues (the client's watch) as well as the
+ * socket's.
+ */
+typedef struct
+{
+    GSocket *socket;            /* TCP interleaved clients only */
+    gchar *name;
+    guint64 produced_bytes;     /* interleaved RTP since PLAY */
+    guint64 acked_base;         /* acknowledged by the client at PLAY */
+    guint64 queued_bytes;
+    guint64 dropped_frames;
+    gboolean dropping;
+    gboolean drained;           /* below the resume mark, keyframe asked for */
+} ClientBacklog;
+
+static GMutex backlog_lock;
+static GList *backlogs = NULL;
+
+static MetricsGauge *clients_gauge;
+static MetricsCounter *frames_sent;
+static MetricsCounter *frames_dropped;
+static MetricsHistogram *send_queue_hist;
+/* Socket send queue in bytes, up to the default backlog limit and beyond */
+static const gdouble send_queue_bounds[] = {
+        4096, 16384, 65536, 262144, 524288, 1048576, 4194304
+};
+
+GOptionGroup *
+client_backlog_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("client", "Per-client backpressure options",
+                                "Show per-client backpressure options", NULL, NULL);
+    g_option_group_add_entries (group, backlog_entries);
+    return group;
+}
+
+static void
+client_backlog_free (ClientBacklog * b)
+{
+    g_mutex_lock (&backlog_lock);
+    backlogs = g_list_remove (backlogs, b);
+    g_mutex_unlock (&backlog_lock);
+
+    g_print ("client %s gone: dropped %" G_GUINT64_FORMAT " frames\n",
+             GST_STR_NULL (b->name), b->dropped_frames);
+    if (b->socket)
+        g_object_unref (b->socket);
+    g_free (b->name);
+    g_free (b);
+}
+
+/*
+ * Bytes of the connection the client has acknowledged, from TCP_INFO.
+ */
+static gboolean
+socket_bytes_acked (GSocket * socket, guint64 * acked)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof (info);
+
+    memset (&info, 0, sizeof (info));
+    if (getsockopt (g_socket_get_fd (socket), IPPROTO_TCP, TCP_INFO, &info, &len) != 0
+        || len < offsetof (struct tcp_info, tcpi_bytes_acked) + sizeof (info.tcpi_bytes_acked))
+        return FALSE;
+    *acked = info.tcpi_bytes_acked;
+    return TRUE;
+}
+
+/*
+ * Counts what the payloader hands to the server, with the 4 byte
+ * interleaved header of every packet.
+ */
+static gboolean
+count_produced (GstBuffer ** buf, guint idx, gpointer user_data)
+{
+    *(guint64 *) user_data += gst_buffer_get_size (*buf) + 4;
+    return TRUE;
+}
+
+static GstPadProbeReturn
+client_produced_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    ClientBacklog *b = (ClientBacklog *) user_data;
+    guint64 bytes = 0;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), count_produced, &bytes);
+    else
+        bytes = gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)) + 4;
+
+    g_mutex_lock (&backlog_lock);
+    if (b->socket)
+        b->produced_bytes += bytes;
+    g_mutex_unlock (&backlog_lock);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Runs for every encoded frame before it reaches the payloader.
+ */
+static GstPadProbeReturn
+client_backlog_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    ClientBacklog *b = (ClientBacklog *) user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+    guint64 limit = (guint64) client_backlog_kb * 1024;
+    GstPadProbeReturn ret = GST_PAD_PROBE_OK;
+    gboolean connected, request_keyframe = FALSE;
+    guint64 queued_bytes, acked;
+
+    g_mutex_lock (&backlog_lock);
+    if (b->socket && socket_bytes_acked (b->socket, &acked)) {
+        acked -= MIN (acked, b->acked_base);
+        b->queued_bytes = b->produced_bytes > acked ? b->produced_bytes - acked : 0;
+    }
+
+    if (limit > 0) {
+        /* The frames in between would not decode anyway, so the encoder is
+         * asked for a keyframe right away and again once the backlog is
+         * down to half, rather than waiting for its next natural one */
+        if (!b->dropping && b->queued_bytes > limit) {
+            b->dropping = TRUE;
+            b->drained = FALSE;
+            request_keyframe = TRUE;
+        }
+        if (b->dropping && b->queued_bytes <= limit / 2) {
+            if (!GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+                b->dropping = FALSE;
+            } else if (!b->drained) {
+                b->drained = TRUE;
+                request_keyframe = TRUE;
+            }
+        }
+        if (b->dropping) {
+            b->dropped_frames++;
+            ret = GST_PAD_PROBE_DROP;
+        }
+    }
+    connected = b->socket != NULL;
+    queued_bytes = b->queued_bytes;
+    g_mutex_unlock (&backlog_lock);
+
+    if (request_keyframe)
+        gst_pad_push_event (pad, gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0));
+
+    if (ret == GST_PAD_PROBE_DROP) {
+        metrics_counter_add (frames_dropped, 1);
+    } else {
+        metrics_counter_add (frames_sent, 1);
+        if (connected)
+            metrics_histogram_observe (send_queue_hist, queued_bytes);
+    }
+
+    return ret;
+}
+
+void
+client_backlog_attach (GstRTSPMedia * media, const gchar * pay_name)
+{
+    GstElement *element, *pay;
+    GstPad *pad;
+    ClientBacklog *b;
+
+    element = gst_rtsp_media_get_element (media);
+    pay = gst_bin_get_by_name_recurse_up (GST_BIN (element), pay_name);
+    gst_object_unref (element);
+    if (!pay)
+        return;
+
+    b = g_new0 (ClientBacklog, 1);
+    g_mutex_lock (&backlog_lock);
+    backlogs = g_list_prepend (backlogs, b);
+    g_mutex_unlock (&backlog_lock);
+    /* make sure the state is freed when the media is gone */
+    g_object_set_data_full (G_OBJECT (media), "client-backlog", b,
+                            (GDestroyNotify) client_backlog_free);
+
+    pad = gst_element_get_static_pad (pay, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, client_backlog_probe_cb,
+                       b, NULL);
+    gst_object_unref (pad);
+    pad = gst_element_get_static_pad (pay, "src");
+    gst_pad_add_probe (pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                       client_produced_probe_cb, b, NULL);
+    gst_object_unref (pad);
+    gst_object_unref (pay);
+}
+
+/*
+ * The media is known once the client asks to play it, hand it the socket
+ * its data will be sent on. Clients receiving over UDP have no backlog in
+ * the server.
+ */
+static void
+play_request_cb (GstRTSPClient * client, GstRTSPContext * ctx, gpointer user_data)
+{
+    GstRTSPStreamTransport *trans;
+    GstRTSPConnection *conn;
+    GSocket *socket;
+    ClientBacklog *b;
+    guint64 acked;
+
+    if (!ctx->media || !ctx->sessmedia)
+        return;
+    b = (ClientBacklog *) g_object_get_data (G_OBJECT (ctx->media), "client-backlog");
+    trans = gst_rtsp_session_media_get_transport (ctx->sessmedia, 0);
+    if (!b || !trans
+        || gst_rtsp_stream_transport_get_transport (trans)->lower_transport != GST_RTSP_LOWER_TRANS_TCP)
+        return;
+
+    conn = gst_rtsp_client_get_connection (client);
+    socket = gst_rtsp_connection_get_write_socket (conn);
+    if (!socket_bytes_acked (socket, &acked)) {
+        g_printerr ("No TCP_INFO byte counters, client %s has no backlog limit\n",
+                    gst_rtsp_connection_get_ip (conn));
+        return;
+    }
+    g_mutex_lock (&backlog_lock);
+    if (!b->socket) {
+        b->socket = (GSocket *) g_object_ref (socket);
+        b->name = g_strdup (gst_rtsp_connection_get_ip (conn));
+        b->acked_base = acked;
+        b->produced_bytes = 0;
+    }
+    g_mutex_unlock (&backlog_lock);
+}
+
+static void
+client_closed_cb (GstRTSPClient * client, gpointer user_data)
+{
+    metrics_gauge_add (clients_gauge, -1);
+}
+
+static void
+client_connected_cb (GstRTSPServer * server, GstRTSPClient * client, gpointer user_data)
+{
+    metrics_gauge_add (clients_gauge, 1);
+    g_signal_connect (client, "play-request", (GCallback) play_request_cb, NULL);
+    g_signal_connect (client, "closed", (GCallback) client_closed_cb, NULL);
+}
+
+static gboolean
+client_stats_cb (gpointer user_data)
+{
+    GList *l;
+
+    g_mutex_lock (&backlog_lock);
+    for (l = backlogs; l; l = l->next) {
+        ClientBacklog *b = (ClientBacklog *) l->data;
+        if (!b->name)
+            continue;
+        g_print ("client %s: queued %" G_GUINT64_FORMAT " bytes, dropped %"
+                 G_GUINT64_FORMAT " frames%s\n", b->name, b->queued_bytes,
+                 b->dropped_frames, b->dropping ? " (dropping)" : "");
+    }
+    g_mutex_unlock (&backlog_lock);
+
+    return G_SOURCE_CONTINUE;
+}
+
+void
+client_backlog_setup (GstRTSPServer * server)
+{
+    clients_gauge = metrics_gauge_new ("rtsp_clients", "Connected RTSP clients");
+    frames_sent = metrics_counter_new ("rtsp_frames_sent_total", "Encoded frames passed to client payloaders");
+    frames_dropped = metrics_counter_new ("rtsp_frames_dropped_total",
+                                          "Encoded frames dropped by the per-client backlog policy");
+    send_queue_hist = metrics_histogram_new ("rtsp_client_send_queue_bytes",
+                                             "Bytes queued for a client but not acknowledged by it, per sent frame",
+                                             send_queue_bounds, G_N_ELEMENTS (send_queue_bounds));
+
+    g_signal_connect (server, "client-connected", (GCallback) client_connected_cb, NULL);
+    if (client_stats_interval > 0)
+        g_timeout_add_seconds (client_stats_interval, client_stats_cb, NULL);
+}
+
+static gboolean
+egress_bus_cb (GstBus * bus, GstMessage * message, gpointer user_data)
+{
+    GError *error = NULL;
+    gchar *debug = NULL;
+
+    if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+        gst_message_parse_error (message, &error, &debug);
+        g_printerr ("Shared memory egress error: %s (%s)\n", error->message, debug ? debug : "");
+        g_clear_error (&error);
+        g_free (debug);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+GstElement *
+frame_egress_pipeline_new (const gchar * source_description)
+{
+    GstElement *pipeline, *source, *egress;
+    GError *error = NULL;
+    GstBus *bus;
+
+    if (!shm_egress_enabled ())
+        return NULL;
+
+    source = gst_parse_bin_from_description (source_description, TRUE, &error);
+    if (!source) {
+        g_printerr ("Can't create the shared memory egress source: %s\n", error ? error->message : "?");
+        g_clear_error (&error);
+        return NULL;
+    }
+    g_clear_error (&error);
+    egress = shm_egress_bin_new ();
+    if (!egress) {
+        gst_object_unref (source);
+        return NULL;
+    }
+
+    pipeline = gst_pipeline_new ("egress");
+    gst_bin_add_many (GST_BIN (pipeline), source, egress, NULL);
+    if (!gst_element_link (source, egress)) {
+        g_printerr ("Can't link the shared memory egress to its source\n");
+        gst_object_unref (pipeline);
+        return NULL;
+    }
+
+    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+    gst_bus_add_watch (bus, egress_bus_cb, NULL);
+    gst_object_unref (bus);
+
+    return pipeline;
+}
+
+/* Compressed data queued in a playback's appsrc, the reader waits beyond it */
+#define DVR_PLAYBACK_MAX_BYTES (4 * 1024 * 1024)
+
+/*
+ * Playback of one client, owned by its appsrc. The feeding thread keeps a
+ * ref on the appsrc until it exits.
+ *
+ * Stream position 0 is the keyframe playback started at, so an RTSP Range
+ * maps to the wall clock time base + position. A seek repositions the
+ * reader and stamps the keyframe found with the position asked for.
+ */
+typedef struct
+{
+    /* Taken around reading and pushing, and by the seeks */
+    GMutex lock;
+    DvrReader *reader;
+    gboolean started;
+    gint64 base;
+    /* Position of the last seek and wall clock time of its first frame */
+    gint64 position;
+    gint64 first;
+    /* The reader lost its place, ended until the next seek */
+    gboolean ended;
+} DvrPlayback;
+
+static void
+dvr_playback_free (gpointer data)
+{
+    DvrPlayback *playback = (DvrPlayback *) data;
+
+    dvr_reader_close (playback->reader);
+    g_mutex_clear (&playback->lock);
+    g_free (playback);
+}
+
+static gpointer
+dvr_playback_thread (gpointer data)
+{
+    GstElement *appsrc = GST_ELEMENT (data);
+    DvrPlayback *playback = (DvrPlayback *) g_object_get_data (G_OBJECT (appsrc), "dvr-playback");
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    for (;;) {
+        gboolean lost = FALSE, pushed = FALSE;
+        guint64 level = 0;
+        gint64 time = 0;
+        GstBuffer *buffer = NULL;
+
+        /*
+         * The appsrc doesn't block, so a seek never waits for a full queue
+         * while the lock is held; the sink paces playback instead.
+         */
+        g_object_get (appsrc, "current-level-bytes", &level, NULL);
+        if (level < DVR_PLAYBACK_MAX_BYTES) {
+            g_mutex_lock (&playback->lock);
+            if (!playback->ended)
+                buffer = dvr_reader_next (playback->reader, &time, &lost);
+            if (lost) {
+                /* The client is further behind than the ring is long */
+                g_print ("DVR playback fell behind the recording, ending it\n");
+                playback->ended = TRUE;
+                g_signal_emit_by_name (appsrc, "end-of-stream", &ret);
+            } else if (buffer) {
+                if (playback->first < 0)
+                    playback->first = time;
+                GST_BUFFER_PTS (buffer) = playback->position + MAX (time - playback->first, 0);
+                g_signal_emit_by_name (appsrc, "push-buffer", buffer, &ret);
+                gst_buffer_unref (buffer);
+                pushed = TRUE;
+            }
+            g_mutex_unlock (&playback->lock);
+        }
+
+        /* A flush is either a seek or the media stopping, the state tells */
+        if (pushed && ret == GST_FLOW_OK)
+            continue;
+        if (pushed && ret != GST_FLOW_FLUSHING)
+            break;
+        /* Full, ended or at the live edge, wait */
+        if (GST_STATE (appsrc) < GST_STATE_PAUSED)
+            break;
+        g_usleep (10 * 1000);
+    }
+
+    gst_object_unref (appsrc);
+    return NULL;
+}
+
+static void
+dvr_need_data_cb (GstElement * appsrc, guint length, DvrPlayback * playback)
+{
+    if (playback->started)
+        return;
+    playback->started = TRUE;
+    g_thread_unref (g_thread_new ("dvr-playback", dvr_playback_thread, gst_object_ref (appsrc)));
+}
+
+/*
+ * An RTSP PLAY with a Range, and the appsrc's initial seek to 0. The appsrc
+ * drops what is queued once this returns.
+ */
+static gboolean
+dvr_seek_data_cb (GstElement * appsrc, guint64 position, DvrPlayback * playback)
+{
+    gboolean res;
+
+    g_mutex_lock (&playback->lock);
+    res = dvr_reader_seek (playback->reader, playback->base + (gint64) position, NULL);
+    if (res) {
+        playback->position = position;
+        playback->first = -1;
+        playback->ended = FALSE;
+    }
+    g_mutex_unlock (&playback->lock);
+
+    return res;
+}
+
+/*
+ * @return The wall clock time in ns the start= of a playback url's query
+ * asks for, 0 for the oldest keyframe.
+ */
+static gint64
+dvr_url_start_time (const GstRTSPUrl * url)
+{
+    gchar **params = g_strsplit (url->query ? url->query : "", "&", -1);
+    gint64 start = 0;
+    guint i;
+
+    for (i = 0; params[i]; i++) {
+        const gchar *spec = params[i] + strlen ("start=");
+        gchar *end;
+        gint64 seconds;
+
+        if (!g_str_has_prefix (params[i], "start="))
+            continue;
+        seconds = g_ascii_strtoll (spec, &end, 10);
+        if (end == spec || *end != '\0')
+            start = -1;
+        else if (*spec == '-')
+            start = g_get_real_time () * 1000 + seconds * GST_SECOND;
+        else
+            start = seconds * GST_SECOND;
+    }
+    g_strfreev (params);
+
+    return start;
+}
+
+/*
+ * Factory that creates a media per client, reading the recording from
+ * where the url asks for. The mount point matches the url's path only, so
+ * the start is passed in the query.
+ */
+typedef struct
+{
+    GstRTSPMediaFactory parent;
+} DvrMediaFactory;
+
+typedef struct
+{
+    GstRTSPMediaFactoryClass parent_class;
+} DvrMediaFactoryClass;
+
+G_DEFINE_TYPE (DvrMediaFactory, dvr_media_factory, GST_TYPE_RTSP_MEDIA_FACTORY);
+
+static GstElement *
+dvr_media_factory_create_element (GstRTSPMediaFactory * factory, const GstRTSPUrl * url)
+{
+    GstElement *element, *appsrc;
+    DvrPlayback *playback;
+    DvrReader *reader;
+    GError *error = NULL;
+    gint64 start = dvr_url_start_time (url), base;
+
+    if (start < 0) {
+        g_printerr ("Invalid DVR playback start in %s?%s\n", url->abspath, url->query);
+        return NULL;
+    }
+    reader = dvr_reader_open (dvr_get_dir (), &error);
+    if (!reader) {
+        g_printerr ("Can't open the recording: %s\n", error->message);
+        g_clear_error (&error);
+        return NULL;
+    }
+    if (!dvr_reader_seek (reader, start, &base)) {
+        g_printerr ("Nothing recorded in %s yet\n", dvr_get_dir ());
+        dvr_reader_close (reader);
+        return NULL;
+    }
+
+    element = GST_RTSP_MEDIA_FACTORY_CLASS (dvr_media_factory_parent_class)->create_element (factory, url);
+    appsrc = element ? gst_bin_get_by_name_recurse_up (GST_BIN (element), "dvrsrc") : NULL;
+    if (!appsrc) {
+        dvr_reader_close (reader);
+        if (element)
+            gst_object_unref (element);
+        return NULL;
+    }
+
+    playback = g_new0 (DvrPlayback, 1);
+    g_mutex_init (&playback->lock);
+    playback->reader = reader;
+    playback->base = base;
+    playback->first = -1;
+    g_object_set_data_full (G_OBJECT (appsrc), "dvr-playback", playback, dvr_playback_free);
+    g_signal_connect (appsrc, "need-data", G_CALLBACK (dvr_need_data_cb), playback);
+    g_signal_connect (appsrc, "seek-data", G_CALLBACK (dvr_seek_data_cb), playback);
+    gst_object_unref (appsrc);
+
+    return element;
+}
+
+static void
+dvr_media_factory_class_init (DvrMediaFactoryClass * klass)
+{
+    GstRTSPMediaFactoryClass *factory_class = GST_RTSP_MEDIA_FACTORY_CLASS (klass);
+
+    factory_class->create_element = dvr_media_factory_create_element;
+}
+
+static void
+dvr_media_factory_init (DvrMediaFactory * factory)
+{
+}
+
+static void
+dvr_media_configure_cb (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+{
+    client_backlog_attach (media, "pay0");
+}
+
+void
+dvr_playback_setup (GstRTSPMountPoints * mounts)
+{
+    GstRTSPMediaFactory *factory;
+
+    if (!dvr_get_dir ())
+        return;
+
+    factory = (GstRTSPMediaFactory *) g_object_new (dvr_media_factory_get_type (), NULL);
+    /*
+     * The recording is byte-stream with SPS/PPS on every keyframe. Not live,
+     * so the media is seekable and the sinks pace it.
+     */
+    gst_rtsp_media_factory_set_launch (factory, "( appsrc name=dvrsrc format=time stream-type=seekable "
+                                       "caps=\"video/x-h264,stream-format=byte-stream,alignment=au\" ! "
+                                       "h264parse ! rtph264pay name=pay0 pt=96 config-interval=-1 )");
+    g_signal_connect (factory, "media-configure", G_CALLBACK (dvr_media_configure_cb), NULL);
+    gst_rtsp_mount_points_add_factory (mounts, "/dvr", factory);
+    g_print ("Recording in %s played back on /dvr\n", dvr_get_dir ());
+}
+
+/*
+ * Thread pool that pins every thread it starts to the next CPU of
+ * --rtsp-cpus.
+ */
+typedef struct
+{
+    GstRTSPThreadPool parent;
+} PinnedThreadPool;
+
+typedef struct
+{
+    GstRTSPThreadPoolClass parent_class;
+} PinnedThreadPoolClass;
+
+G_DEFINE_TYPE (PinnedThreadPool, pinned_thread_pool, GST_TYPE_RTSP_THREAD_POOL);
+
+static gint *pin_cpus = NULL;
+static guint n_pin_cpus = 0;
+static gint pin_next = 0;
+
+/* Called from the new thread itself before it runs its main loop */
+static void
+pinned_thread_pool_thread_enter (GstRTSPThreadPool * pool, GstRTSPThread * thread)
+{
+    cpu_set_t set;
+    guint idx = (guint) g_atomic_int_add (&pin_next, 1) % n_pin_cpus;
+    int err;
+
+    CPU_ZERO (&set);
+    CPU_SET (pin_cpus[idx], &set);
+    err = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+    if (err != 0)
+        g_printerr ("Failed to pin client thread to CPU %d: %s\n", pin_cpus[idx],
+                    g_strerror (err));
+}
+
+static void
+pinned_thread_pool_class_init (PinnedThreadPoolClass * klass)
+{
+    GstRTSPThreadPoolClass *tpool_class = GST_RTSP_THREAD_POOL_CLASS (klass);
+
+    tpool_class->thread_enter = pinned_thread_pool_thread_enter;
+}
+
+static void
+pinned_thread_pool_init (PinnedThreadPool * pool)
+{
+}
+
+GOptionGroup *
+server_threads_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("threads", "Server threading options",
+                                "Show server threading options", NULL, NULL);
+    g_option_group_add_entries (group, thread_entries);
+    return group;
+}
+
+gboolean
+server_threads_setup (GstRTSPServer * server)
+{
+    GstRTSPThreadPool *pool;
+
+    if (rtsp_cpus) {
+        gchar **tokens = g_strsplit (rtsp_cpus, ",", -1);
+        guint i;
+
+        n_pin_cpus = g_strv_length (tokens);
+        pin_cpus = g_new0 (gint, MAX (n_pin_cpus, 1));
+        for (i = 0; i < n_pin_cpus; i++) {
+            gchar *end;
+            pin_cpus[i] = (gint) g_ascii_strtoll (tokens[i], &end, 10);
+            if (*end || end == tokens[i] || pin_cpus[i] < 0 || pin_cpus[i] >= CPU_SETSIZE) {
+                g_printerr ("Invalid CPU '%s' in --rtsp-cpus\n", tokens[i]);
+                g_strfreev (tokens);
+                return FALSE;
+            }
+        }
+        g_strfreev (tokens);
+        if (n_pin_cpus == 0) {
+            g_printerr ("--rtsp-cpus needs at least one CPU\n");
+            return FALSE;
+        }
+
+        pool = (GstRTSPThreadPool *) g_object_new (pinned_thread_pool_get_type (), NULL);
+        gst_rtsp_server_set_thread_pool (server, pool);
+    } else {
+        pool = gst_rtsp_server_get_thread_pool (server);
+    }
+
+    gst_rtsp_thread_pool_set_max_threads (pool, rtsp_threads);
+    g_object_unref (pool);
+
+    return TRUE;
+}
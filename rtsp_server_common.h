@@ -0,0 +1,99 @@
+//
+// Helpers shared by the RTSP server binaries (rtsprestream, rtspstreamappsrc).
+//
+
+#ifndef RTSP_SERVER_COMMON_H
+#define RTSP_SERVER_COMMON_H
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+/*
+ * Per-client send backlog.
+ * Every client gets its own media (the factories are not shared), so the
+ * drop policy sits in front of that media's payloader. The backlog of a TCP
+ * interleaved client is everything its payloader produced that the client
+ * has not acknowledged yet, queued in the server or in the socket. While it
+ * is above the limit whole encoded frames are dropped; a keyframe is asked
+ * for upstream and sending resumes on it once the backlog has drained.
+ */
+
+/*
+ * Returns the option group with the backlog options, to be added to the
+ * binary's GOptionContext.
+ */
+GOptionGroup *client_backlog_get_option_group (void);
+
+/*
+ * Tracks clients of the server and starts the periodic counter report.
+ * @param server The RTSP server, before it is attached.
+ */
+void client_backlog_setup (GstRTSPServer * server);
+
+/*
+ * Installs the drop policy on a media, to be called from media-configure.
+ * @param media The media being configured.
+ * @param pay_name Name of the payloader element in the launch line.
+ */
+void client_backlog_attach (GstRTSPMedia * media, const gchar * pay_name);
+
+/*
+ * Shared memory egress (shm_egress.h) of the decoded frames. Every RTSP
+ * client gets a media of its own, so the frames are published by a
+ * separate pipeline running from startup instead: local consumers get
+ * frames whether or not RTSP clients are connected, and the socket stays
+ * up for the life of the process.
+ */
+
+/*
+ * Builds the egress pipeline, the source followed by the egress branch.
+ * The caller configures the source and sets the pipeline to PLAYING, errors
+ * are printed from a bus watch on the default main context.
+ * @param source_description Launch description of the raw video source,
+ * e.g. "appsrc name=src ! videoconvert"; it must pace itself, the egress
+ * doesn't sync.
+ * @return The pipeline, or NULL on failure or unless --shm-egress was
+ * given.
+ */
+GstElement *frame_egress_pipeline_new (const gchar * source_description);
+
+/*
+ * Playback of the ring buffer recording (dvr.h) made by rtsp2webrtc with
+ * --dvr-dir. The start= query parameter selects where playback starts:
+ *
+ *   rtsp://HOST:8554/dvr?start=1700000000   at this wall clock time (epoch seconds)
+ *   rtsp://HOST:8554/dvr?start=-60          one minute ago
+ *   rtsp://HOST:8554/dvr                    at the oldest recorded keyframe
+ *
+ * Playback then follows the recording in real time up to the live edge.
+ * The media is seekable, a PLAY with Range: npt=30- jumps to 30 seconds
+ * after the start.
+ */
+
+/*
+ * Mounts the playback factory on /dvr. Does nothing unless --dvr-dir was
+ * given.
+ * @param mounts The server's mount points.
+ */
+void dvr_playback_setup (GstRTSPMountPoints * mounts);
+
+/*
+ * Server threading.
+ * By default all client I/O runs on one GstRTSPThreadPool thread. The
+ * options set the pool size (-1 gives every client its own thread and
+ * GMainContext) and optionally pin the pool threads to a list of CPUs.
+ */
+
+/*
+ * Returns the option group with the threading options.
+ */
+GOptionGroup *server_threads_get_option_group (void);
+
+/*
+ * Applies the threading options to the server, before it is attached.
+ * @param server The RTSP server.
+ * @return FALSE if the options are invalid.
+ */
+gboolean server_threads_setup (GstRTSPServer * server);
+
+#endif //RTSP_SERVER_COMMON_H
@@ -0,0 +1,286 @@
+//
+// Connection storm benchmark for the RTSP server binaries.
+// Opens N clients at once against a server and measures the latency from
+// sending DESCRIBE until the PLAY response arrived, for every N of --levels.
+//
+
+#include <gst/gst.h>
+#include <gst/rtsp/rtsp.h>
+#include <gst/sdp/sdp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_URL "rtsp://127.0.0.1:8554/test"
+#define DEFAULT_LEVELS "1,100,1000"
+#define TIMEOUT_USEC (10 * G_USEC_PER_SEC)
+
+static gchar *url = (gchar *) DEFAULT_URL;
+static gchar *levels = (gchar *) DEFAULT_LEVELS;
+
+static GOptionEntry entries[] = {
+        {"url", 'u', 0, G_OPTION_ARG_STRING, &url,
+                "Stream to open (default: " DEFAULT_URL ")", "URL"},
+        {"levels", 'l', 0, G_OPTION_ARG_STRING, &levels,
+                "Comma separated numbers of concurrent clients (default: " DEFAULT_LEVELS ")", "N,..."},
+        {NULL}
+};
+
+/*
+ * One storm. All clients are released together, and stay connected until
+ * the last one is playing so the server really holds N sessions.
+ */
+typedef struct
+{
+    GMutex lock;
+    GCond cond;
+    gboolean go;
+    guint done;
+    guint n_clients;
+    gint64 *latency_us;         /* -1 when the client failed */
+} Storm;
+
+typedef struct
+{
+    Storm *storm;
+    guint index;
+} StormClient;
+
+/*
+ * Sends a request and waits for its response.
+ * @return The response or NULL on failure, to be freed by the caller.
+ */
+static GstRTSPMessage *
+rtsp_request (GstRTSPConnection * conn, GstRTSPMethod method, const gchar * uri,
+              guint cseq, const gchar * session, const gchar * transport)
+{
+    GstRTSPMessage *req = NULL, *resp = NULL;
+    gchar *cseq_str;
+
+    if (gst_rtsp_message_new_request (&req, method, uri) != GST_RTSP_OK)
+        return NULL;
+
+    cseq_str = g_strdup_printf ("%u", cseq);
+    gst_rtsp_message_add_header (req, GST_RTSP_HDR_CSEQ, cseq_str);
+    g_free (cseq_str);
+    if (method == GST_RTSP_DESCRIBE)
+        gst_rtsp_message_add_header (req, GST_RTSP_HDR_ACCEPT, "application/sdp");
+    if (session)
+        gst_rtsp_message_add_header (req, GST_RTSP_HDR_SESSION, session);
+    if (transport)
+        gst_rtsp_message_add_header (req, GST_RTSP_HDR_TRANSPORT, transport);
+
+    if (gst_rtsp_connection_send_usec (conn, req, TIMEOUT_USEC) != GST_RTSP_OK)
+        goto failed;
+    gst_rtsp_message_free (req);
+    req = NULL;
+
+    gst_rtsp_message_new (&resp);
+    if (gst_rtsp_connection_receive_usec (conn, resp, TIMEOUT_USEC) != GST_RTSP_OK
+        || resp->type_data.response.code != GST_RTSP_STS_OK)
+        goto failed;
+
+    return resp;
+
+failed:
+    if (req)
+        gst_rtsp_message_free (req);
+    if (resp)
+        gst_rtsp_message_free (resp);
+    return NULL;
+}
+
+/*
+ * Returns the SETUP url for the first stream in the SDP of a DESCRIBE
+ * response.
+ */
+static gchar *
+setup_uri_from_describe (GstRTSPMessage * resp)
+{
+    GstSDPMessage *sdp;
+    const GstSDPMedia *media;
+    const gchar *control;
+    guint8 *body;
+    guint size;
+    gchar *uri = NULL;
+
+    if (gst_rtsp_message_get_body (resp, &body, &size) != GST_RTSP_OK)
+        return NULL;
+
+    gst_sdp_message_new (&sdp);
+    if (gst_sdp_message_parse_buffer (body, size, sdp) == GST_SDP_OK
+        && gst_sdp_message_medias_len (sdp) > 0) {
+        media = gst_sdp_message_get_media (sdp, 0);
+        control = gst_sdp_media_get_attribute_val (media, "control");
+        if (!control)
+            uri = g_strdup (url);
+        else if (g_str_has_prefix (control, "rtsp://"))
+            uri = g_strdup (control);
+        else
+            uri = g_strdup_printf ("%s/%s", url, control);
+    }
+    gst_sdp_message_free (sdp);
+
+    return uri;
+}
+
+static gpointer
+storm_client_thread (gpointer user_data)
+{
+    StormClient *c = (StormClient *) user_data;
+    Storm *storm = c->storm;
+    GstRTSPUrl *rtsp_url = NULL;
+    GstRTSPConnection *conn = NULL;
+    GstRTSPMessage *resp;
+    gchar *setup_uri = NULL, *session = NULL;
+    const gchar *value;
+    gint64 start, latency = -1;
+
+    /* Connecting is not part of the measurement */
+    if (gst_rtsp_url_parse (url, &rtsp_url) != GST_RTSP_OK
+        || gst_rtsp_connection_create (rtsp_url, &conn) != GST_RTSP_OK
+        || gst_rtsp_connection_connect_usec (conn, TIMEOUT_USEC) != GST_RTSP_OK)
+        goto wait;
+
+    g_mutex_lock (&storm->lock);
+    while (!storm->go)
+        g_cond_wait (&storm->cond, &storm->lock);
+    g_mutex_unlock (&storm->lock);
+
+    start = g_get_monotonic_time ();
+
+    resp = rtsp_request (conn, GST_RTSP_DESCRIBE, url, 1, NULL, NULL);
+    if (!resp)
+        goto wait;
+    setup_uri = setup_uri_from_describe (resp);
+    gst_rtsp_message_free (resp);
+    if (!setup_uri)
+        goto wait;
+
+    resp = rtsp_request (conn, GST_RTSP_SETUP, setup_uri, 2, NULL,
+                         "RTP/AVP/TCP;unicast;interleaved=0-1");
+    if (!resp)
+        goto wait;
+    if (gst_rtsp_message_get_header (resp, GST_RTSP_HDR_SESSION, &value, 0) == GST_RTSP_OK)
+        session = g_strndup (value, strcspn (value, ";"));
+    gst_rtsp_message_free (resp);
+    if (!session)
+        goto wait;
+
+    resp = rtsp_request (conn, GST_RTSP_PLAY, url, 3, session, NULL);
+    if (!resp)
+        goto wait;
+    gst_rtsp_message_free (resp);
+
+    latency = g_get_monotonic_time () - start;
+
+wait:
+    g_mutex_lock (&storm->lock);
+    storm->latency_us[c->index] = latency;
+    storm->done++;
+    g_cond_broadcast (&storm->cond);
+    while (storm->done < storm->n_clients)
+        g_cond_wait (&storm->cond, &storm->lock);
+    g_mutex_unlock (&storm->lock);
+
+    if (conn)
+        gst_rtsp_connection_free (conn);
+    if (rtsp_url)
+        gst_rtsp_url_free (rtsp_url);
+    g_free (setup_uri);
+    g_free (session);
+
+    return NULL;
+}
+
+static int
+compare_gint64 (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+run_storm (guint n_clients)
+{
+    Storm storm;
+    StormClient *clients;
+    GThread **threads;
+    gint64 *ok;
+    guint i, n_ok = 0;
+
+    g_mutex_init (&storm.lock);
+    g_cond_init (&storm.cond);
+    storm.go = FALSE;
+    storm.done = 0;
+    storm.n_clients = n_clients;
+    storm.latency_us = g_new0 (gint64, n_clients);
+    clients = g_new0 (StormClient, n_clients);
+    threads = g_new0 (GThread *, n_clients);
+
+    for (i = 0; i < n_clients; i++) {
+        clients[i].storm = &storm;
+        clients[i].index = i;
+        threads[i] = g_thread_new ("storm", storm_client_thread, &clients[i]);
+    }
+
+    /* Let every client connect before the DESCRIBEs go out together */
+    g_usleep (G_USEC_PER_SEC);
+    g_mutex_lock (&storm.lock);
+    storm.go = TRUE;
+    g_cond_broadcast (&storm.cond);
+    g_mutex_unlock (&storm.lock);
+
+    for (i = 0; i < n_clients; i++)
+        g_thread_join (threads[i]);
+
+    ok = g_new0 (gint64, n_clients);
+    for (i = 0; i < n_clients; i++)
+        if (storm.latency_us[i] >= 0)
+            ok[n_ok++] = storm.latency_us[i];
+    qsort (ok, n_ok, sizeof (gint64), compare_gint64);
+
+    if (n_ok > 0)
+        g_print ("clients=%u ok=%u failed=%u describe->play ms: min=%.2f p50=%.2f p99=%.2f max=%.2f\n",
+                 n_clients, n_ok, n_clients - n_ok, ok[0] / 1000.0,
+                 ok[n_ok / 2] / 1000.0, ok[(n_ok * 99) / 100] / 1000.0,
+                 ok[n_ok - 1] / 1000.0);
+    else
+        g_print ("clients=%u ok=0 failed=%u\n", n_clients, n_clients);
+
+    g_free (ok);
+    g_free (threads);
+    g_free (clients);
+    g_free (storm.latency_us);
+    g_cond_clear (&storm.cond);
+    g_mutex_clear (&storm.lock);
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *optctx;
+    GError *error = NULL;
+    gchar **tokens;
+    guint i;
+
+    optctx = g_option_context_new ("- RTSP server connection storm benchmark");
+    g_option_context_add_main_entries (optctx, entries, NULL);
+    g_option_context_add_group (optctx, gst_init_get_option_group ());
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
+
+    tokens = g_strsplit (levels, ",", -1);
+    for (i = 0; tokens[i]; i++) {
+        guint n = (guint) g_ascii_strtoull (tokens[i], NULL, 10);
+        if (n > 0)
+            run_storm (n);
+    }
+    g_strfreev (tokens);
+
+    return 0;
+}
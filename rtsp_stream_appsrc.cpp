@@ -6,6 +6,13 @@
 
 #include <gst/rtsp-server/rtsp-server.h>
 
+#include "rtsp_server_common.h"
+#include "metrics.h"
+#include "shm_egress.h"
+#include "dvr.h"
+
+static MetricsCounter *frames_pushed;
+
 typedef struct
 {
     gboolean white;
@@ -36,22 +43,18 @@ need_data (GstElement * appsrc, guint unused, MyContext * ctx)
 
     g_signal_emit_by_name (appsrc, "push-buffer", buffer, &ret);
     gst_buffer_unref (buffer);
+    metrics_counter_add (frames_pushed, 1);
 }
 
-/* called when a new media pipeline is constructed. We can query the
- * pipeline and configure our appsrc */
+/* configures the appsrc 'mysrc' of bin, the context lives as long as owner */
 static void
-media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
-                 gpointer user_data)
+configure_appsrc (GstElement * bin, GObject * owner)
 {
-    GstElement *element, *appsrc;
+    GstElement *appsrc;
     MyContext *ctx;
 
-    /* get the element used for providing the streams of the media */
-    element = gst_rtsp_media_get_element (media);
-
     /* get our appsrc, we named it 'mysrc' with the name property */
-    appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), "mysrc");
+    appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (bin), "mysrc");
 
     /* this instructs appsrc that we will be dealing with timed buffer */
     gst_util_set_object_arg (G_OBJECT (appsrc), "format", "time");
@@ -67,13 +70,27 @@ media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
     ctx->white = FALSE;
     ctx->timestamp = 0;
     /* make sure ther datais freed when the media is gone */
-    g_object_set_data_full (G_OBJECT (media), "my-extra-data", ctx,
+    g_object_set_data_full (owner, "my-extra-data", ctx,
                             (GDestroyNotify) g_free);
 
     /* install the callback that will be called when a buffer is needed */
     g_signal_connect (appsrc, "need-data", (GCallback) need_data, ctx);
     gst_object_unref (appsrc);
+}
+
+/* called when a new media pipeline is constructed. We can query the
+ * pipeline and configure our appsrc */
+static void
+media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
+                 gpointer user_data)
+{
+    /* get the element used for providing the streams of the media */
+    GstElement *element = gst_rtsp_media_get_element (media);
+
+    configure_appsrc (element, G_OBJECT (media));
     gst_object_unref (element);
+
+    client_backlog_attach (media, "pay0");
 }
 
 int
@@ -83,13 +100,46 @@ main (int argc, char *argv[])
     GstRTSPServer *server;
     GstRTSPMountPoints *mounts;
     GstRTSPMediaFactory *factory;
-
-    gst_init (&argc, &argv);
+    GstElement *egress;
+    GOptionContext *optctx;
+    GError *error = NULL;
+
+    optctx = g_option_context_new ("- Test RTSP Server, appsrc");
+    g_option_context_add_group (optctx, gst_init_get_option_group ());
+    g_option_context_add_group (optctx, client_backlog_get_option_group ());
+    g_option_context_add_group (optctx, server_threads_get_option_group ());
+    g_option_context_add_group (optctx, metrics_get_option_group ());
+    g_option_context_add_group (optctx, shm_egress_get_option_group ());
+    g_option_context_add_group (optctx, dvr_get_option_group ());
+    if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+        g_printerr ("Error parsing options: %s\n", error->message);
+        g_option_context_free (optctx);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_option_context_free (optctx);
+
+    if (!metrics_setup ())
+        return -1;
+    frames_pushed = metrics_counter_new ("appsrc_frames_pushed_total", "Raw frames pushed into appsrc");
+
+    /* the same test stream for local consumers, paced by identity as the
+     * egress doesn't sync */
+    egress = frame_egress_pipeline_new ("appsrc name=mysrc is-live=true ! identity sync=true ! videoconvert");
+    if (shm_egress_enabled () && !egress)
+        return -1;
+    if (egress) {
+        configure_appsrc (egress, G_OBJECT (egress));
+        gst_element_set_state (egress, GST_STATE_PLAYING);
+    }
 
     loop = g_main_loop_new (NULL, FALSE);
 
     /* create a server instance */
     server = gst_rtsp_server_new ();
+    client_backlog_setup (server);
+    if (!server_threads_setup (server))
+        return -1;
 
     /* get the mount points for this server, every server has a default object
      * that be used to map uri mount points to media factories */
@@ -110,6 +160,7 @@ main (int argc, char *argv[])
 
     /* attach the test factory to the /test url */
     gst_rtsp_mount_points_add_factory (mounts, "/test", factory);
+    dvr_playback_setup (mounts);
 
     /* don't need the ref to the mounts anymore */
     g_object_unref (mounts);
@@ -10,6 +10,7 @@
 #include <gst/gstpromise.h>
 
 #include <gst/sdp/sdp.h>
+#include <gst/video/video.h>
 
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
@@ -18,8 +19,15 @@
 #include <libsoup/soup.h>
 #include <json-glib/json-glib.h>
 
+#include <glib-unix.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "metrics.h"
+#include "shm_egress.h"
+#include "cmaf_hls.h"
+#include "dvr.h"
+
 #ifndef __KMS_AGNOSTIC_CAPS_H__
 #define __KMS_AGNOSTIC_CAPS_H__
 
@@ -176,6 +184,8 @@ enum AppState {
 
 static GMainLoop *loop;
 static GstElement *pipe1, *webrtc1, *uridb1;
+/* The encoders and webrtcbin of the current call, behind rawtee */
+static GstElement *call_bin = NULL;
 
 static SoupWebsocketConnection *ws_conn = NULL;
 static enum AppState app_state = APP_STATE_UNKNOWN;
@@ -183,14 +193,151 @@ static const gchar *peer_id = NULL;
 static const gchar *server_url = "wss://webrtc.nirbheek.in:8443";
 static gboolean disable_ssl = FALSE;
 
+#define INGEST_URI "rtsp://127.0.0.1:8554/test"
+#define INGEST_BACKOFF_MIN_MS 250
+#define DEFAULT_INGEST_BACKOFF_MAX_MS 8000
+#define DEFAULT_INGEST_TIMEOUT_S 5
+
+/* RTSP ingest recovery. The uridecodebin is the only part of the pipeline
+ * that gets torn down when the camera goes away, everything from the
+ * ingest pad downwards (encoder, payloader, webrtcbin) keeps running */
+static GstPad *ingest_pad = NULL;
+static GstPad *slate_pad = NULL;
+static guint ingest_retry_id = 0;
+static guint ingest_watchdog_id = 0;
+static guint ingest_backoff_ms = INGEST_BACKOFF_MIN_MS;
+static gint ingest_live = FALSE;
+static gint ingest_buffers = 0;
+static gint ingest_buffers_seen = 0;
+static gint64 ingest_created_at = 0;
+static gboolean ingest_slate = FALSE;
+static gint ingest_backoff_max_ms = DEFAULT_INGEST_BACKOFF_MAX_MS;
+static gint ingest_timeout_s = DEFAULT_INGEST_TIMEOUT_S;
+
+/* Signalling reconnects while HLS or DVR keep the process up, with the
+ * backoff of the ingest */
+static guint signalling_retry_id = 0;
+static guint signalling_backoff_ms = INGEST_BACKOFF_MIN_MS;
+
+static MetricsCounter *ingest_frames_metric;
+static MetricsCounter *ingest_reconnects_metric;
+static MetricsGauge *ingest_live_metric;
+static MetricsGauge *layer_metric;
+static MetricsHistogram *rtt_metric;
+static const gdouble rtt_bounds[] = { 0.01, 0.025, 0.05, 0.1, 0.2, 0.5, 1.0 };
+
+#define MAX_LAYERS 3
+#define LAYER_STATS_INTERVAL_MS 1000
+#define LAYER_LOSS_DOWN 0.10
+#define LAYER_LOSS_UP 0.02
+#define LAYER_UP_SAMPLES 5
+
+/* Optional encoding ladder, built in call_bin for the one call this
+ * process serves. The decoded camera is scaled and encoded into every
+ * layer while the call runs; an input-selector in front of the payloader
+ * picks the layer sent, moved up or down from the loss reported in the
+ * peer's RTCP receiver reports */
+typedef struct
+{
+  gint width;
+  gint height;
+  gint bitrate;                 /* kbit/s */
+  GstPad *selpad;
+} EncodeLayer;
+
+static gchar *layers_spec = NULL;
+static EncodeLayer layers[MAX_LAYERS];
+static guint n_layers = 0;
+static guint cur_layer = 0;
+static guint layer_good_samples = 0;
+static guint layer_stats_id = 0;
+static GstElement *layersel1 = NULL;
+
+/* Startup. --fast-start trims everything between exec and the first
+ * registration that the gateway does not need: the registry rescan, the
+ * plugin presence check and the body logger on the signalling session.
+ * Marks come from the main thread and the preload thread */
+static gboolean fast_start = FALSE;
+static gboolean startup_profile = FALSE;
+static GMutex startup_lock;
+static gint64 startup_t0 = 0;
+static gint64 startup_last = 0;
+
 static GOptionEntry entries[] =
 {
   { "peer-id", 0, 0, G_OPTION_ARG_STRING, &peer_id, "String ID of the peer to connect to", "ID" },
   { "server", 0, 0, G_OPTION_ARG_STRING, &server_url, "Signalling server to connect to", "URL" },
   { "disable-ssl", 0, 0, G_OPTION_ARG_NONE, &disable_ssl, "Disable ssl", NULL },
+  { "ingest-slate", 0, 0, G_OPTION_ARG_NONE, &ingest_slate, "Show a test slate instead of freezing the last frame while the RTSP ingest reconnects", NULL },
+  { "ingest-backoff-max", 0, 0, G_OPTION_ARG_INT, &ingest_backoff_max_ms, "Upper bound of the RTSP ingest and signalling reconnect backoff in ms (default: 8000)", "MS" },
+  { "ingest-timeout", 0, 0, G_OPTION_ARG_INT, &ingest_timeout_s, "Reconnect the RTSP ingest when no frame arrived for this many seconds, 0 disables (default: 5)", "SECONDS" },
+  { "fast-start", 0, 0, G_OPTION_ARG_NONE, &fast_start, "Skip the registry rescan, the plugin checks and the signalling body log. Newly installed plugins are not picked up", NULL },
+  { "startup-profile", 0, 0, G_OPTION_ARG_NONE, &startup_profile, "Print the time spent in each startup phase", NULL },
+  { "layers", 0, 0, G_OPTION_ARG_STRING, &layers_spec, "Encoding ladder from highest to lowest, e.g. 1280x720@2000,640x360@800,320x180@250 (kbit/s)", "LAYERS" },
   { NULL },
 };
 
+static void
+startup_mark (const gchar * phase)
+{
+  gint64 now;
+
+  if (!startup_profile || !startup_t0)
+    return;
+
+  g_mutex_lock (&startup_lock);
+  now = g_get_monotonic_time ();
+  g_print ("[startup] %-24s %8.3f ms (+%.3f ms)\n", phase,
+      (now - startup_t0) / 1000.0, (now - startup_last) / 1000.0);
+  startup_last = now;
+  g_mutex_unlock (&startup_lock);
+}
+
+/* HLS and the recorder run off the ingest from startup and outlive the
+ * call */
+static gboolean
+recording_enabled (void)
+{
+  return cmaf_hls_enabled () || dvr_get_dir () != NULL;
+}
+
+static void call_stop (void);
+static void connect_to_websocket_server_async (void);
+
+static gboolean
+signalling_retry_cb (gpointer user_data)
+{
+  /* The previous connection is still closing */
+  if (ws_conn)
+    return G_SOURCE_CONTINUE;
+
+  signalling_retry_id = 0;
+  g_print ("Reconnecting to the signalling server\n");
+  connect_to_websocket_server_async ();
+  return G_SOURCE_REMOVE;
+}
+
+/* Errors can come from webrtcbin's threads, which can't stop their own
+ * element. The next call needs a new registration, so the signalling
+ * server is connected again, also when it was not reachable at all */
+static gboolean
+call_stop_idle (gpointer user_data)
+{
+  if (call_bin) {
+    call_stop ();
+    g_print ("Call ended, HLS and DVR keep running\n");
+  }
+  if (loop && !signalling_retry_id) {
+    g_print ("Reconnecting to the signalling server in %u ms\n",
+        signalling_backoff_ms);
+    signalling_retry_id = g_timeout_add (signalling_backoff_ms,
+        signalling_retry_cb, NULL);
+    signalling_backoff_ms = MIN (signalling_backoff_ms * 2,
+        (guint) ingest_backoff_max_ms);
+  }
+  return G_SOURCE_REMOVE;
+}
+
 static gboolean
 cleanup_and_quit_loop (const gchar * msg, enum AppState state)
 {
@@ -205,10 +352,12 @@ cleanup_and_quit_loop (const gchar * msg, enum AppState state)
       /* This will call us again */
       soup_websocket_connection_close (ws_conn, 1000, "");
     else
-      g_object_unref (ws_conn);
+      g_clear_object (&ws_conn);
   }
 
-  if (loop) {
+  if (loop && recording_enabled ()) {
+    g_idle_add (call_stop_idle, NULL);
+  } else if (loop) {
     g_main_loop_quit (loop);
     loop = NULL;
   }
@@ -422,16 +571,402 @@ uridecodebin_element_added (GstBin * bin,
   }
 }
 
+static void ingest_lost (const gchar * reason);
+
+/* The compressed stream for HLS and the recorder is taken before the
+ * decoder */
+static void
+uridecodebin_deep_element_added (GstBin * bin, GstBin * sub_bin,
+    GstElement * element, gpointer data)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+
+  if (factory && g_strcmp0 (GST_OBJECT_NAME (factory), "h264parse") == 0) {
+    g_print ("Tapping compressed video from %s\n", GST_OBJECT_NAME (element));
+    cmaf_hls_tap (element);
+    dvr_record_tap (element);
+  }
+}
+
+static void
+on_ingest_pad_added (GstElement * uridb, GstPad * pad, gpointer user_data)
+{
+  GstCaps *caps;
+  const gchar *name;
+  GstPadLinkReturn ret;
+
+  if (gst_pad_is_linked (ingest_pad))
+    return;
+
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps)
+    caps = gst_pad_query_caps (pad, NULL);
+  if (gst_caps_is_empty (caps)) {
+    g_print ("Ignoring ingest pad %s without caps\n", GST_PAD_NAME (pad));
+    gst_caps_unref (caps);
+    return;
+  }
+  name = gst_structure_get_name (gst_caps_get_structure (caps, 0));
+  if (!g_str_has_prefix (name, "video")) {
+    g_print ("Ignoring ingest pad %s with caps %s\n", GST_PAD_NAME (pad), name);
+    gst_caps_unref (caps);
+    return;
+  }
+  gst_caps_unref (caps);
+
+  ret = gst_pad_link (pad, ingest_pad);
+  if (ret != GST_PAD_LINK_OK)
+    g_printerr ("Failed to link ingest pad: %s\n", gst_pad_link_get_name (ret));
+}
+
+/* Creates a fresh uridecodebin for the camera and plugs it into the running
+ * pipeline. It picks up the pipeline clock and base time, so the timestamps
+ * continue where the previous ingest stopped */
 static gboolean
-start_pipeline (void)
+ingest_create (void)
 {
-  GstStateChangeReturn ret;
-  GError *error = NULL;
+  GstCaps *deco_caps;
 
-  pipe1 = gst_parse_launch ("uridecodebin name=uridb uri=rtsp://127.0.0.1:8554/test ! videoconvert ! queue ! x264enc ! rtph264pay ! queue ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! webrtcbin name=sendrecv", &error);
+  uridb1 = gst_element_factory_make ("uridecodebin", "uridb");
+  if (!uridb1)
+    return FALSE;
+  g_object_set (G_OBJECT (uridb1), "uri", INGEST_URI, NULL);
 
+  deco_caps = gst_caps_from_string (KMS_AGNOSTIC_NO_RTP_CAPS);
   //Disable transcoding
-  //pipe1 = gst_parse_launch ("uridecodebin name=uridb uri=rtsp://127.0.0.1:8554/test ! rtph264pay ! queue ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! webrtcbin name=sendrecv", &error);
+  //g_object_set (G_OBJECT (uridb1), "caps", deco_caps, NULL);
+  gst_caps_unref (deco_caps);
+
+  g_signal_connect (uridb1, "element-added",
+      G_CALLBACK (uridecodebin_element_added), NULL);
+  g_signal_connect (uridb1, "pad-added",
+      G_CALLBACK (on_ingest_pad_added), NULL);
+  if (cmaf_hls_enabled () || dvr_get_dir ())
+    g_signal_connect (uridb1, "deep-element-added",
+        G_CALLBACK (uridecodebin_deep_element_added), NULL);
+
+  ingest_created_at = g_get_monotonic_time ();
+  gst_bin_add (GST_BIN (pipe1), uridb1);
+  if (!gst_element_sync_state_with_parent (uridb1)) {
+    g_printerr ("Failed to start RTSP ingest\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+ingest_destroy (void)
+{
+  if (!uridb1)
+    return;
+
+  gst_element_set_state (uridb1, GST_STATE_NULL);
+  /* Removing it from the bin also unlinks it from the ingest pad and drops
+   * the last reference */
+  gst_bin_remove (GST_BIN (pipe1), uridb1);
+  uridb1 = NULL;
+}
+
+static gboolean
+ingest_retry_cb (gpointer user_data)
+{
+  ingest_retry_id = 0;
+  g_print ("Reconnecting RTSP ingest\n");
+  if (!ingest_create ())
+    ingest_lost ("restart failed");
+  return G_SOURCE_REMOVE;
+}
+
+/* Tears down the dead ingest and schedules a reconnect with exponential
+ * backoff. Must be called from the main loop */
+static void
+ingest_lost (const gchar * reason)
+{
+  if (ingest_retry_id || !pipe1)
+    return;
+
+  g_print ("RTSP ingest lost (%s), retrying in %u ms\n", reason,
+      ingest_backoff_ms);
+  g_atomic_int_set (&ingest_live, FALSE);
+  metrics_counter_add (ingest_reconnects_metric, 1);
+  metrics_gauge_set (ingest_live_metric, 0);
+  if (slate_pad) {
+    GstElement *sel = gst_pad_get_parent_element (slate_pad);
+    g_object_set (sel, "active-pad", slate_pad, NULL);
+    gst_object_unref (sel);
+  }
+
+  ingest_destroy ();
+  ingest_retry_id = g_timeout_add (ingest_backoff_ms, ingest_retry_cb, NULL);
+  ingest_backoff_ms = MIN (ingest_backoff_ms * 2, (guint) ingest_backoff_max_ms);
+}
+
+static gboolean
+ingest_lost_idle (gpointer user_data)
+{
+  ingest_lost ((const gchar *) user_data);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ingest_recovered_idle (gpointer user_data)
+{
+  /* Lost again before we got here */
+  if (!g_atomic_int_get (&ingest_live))
+    return G_SOURCE_REMOVE;
+
+  g_print ("RTSP ingest is live\n");
+  metrics_gauge_set (ingest_live_metric, 1);
+  ingest_backoff_ms = INGEST_BACKOFF_MIN_MS;
+  if (slate_pad) {
+    GstElement *sel = gst_pad_get_parent_element (ingest_pad);
+    g_object_set (sel, "active-pad", ingest_pad, NULL);
+    gst_object_unref (sel);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/* Catches a camera that stopped sending as well as a connect that hangs
+ * before the first frame, e.g. in the RTSP handshake */
+static gboolean
+ingest_watchdog_cb (gpointer user_data)
+{
+  gint buffers = g_atomic_int_get (&ingest_buffers);
+
+  if (g_atomic_int_get (&ingest_live)) {
+    if (buffers == ingest_buffers_seen)
+      ingest_lost ("stalled");
+  } else if (uridb1 && g_get_monotonic_time () - ingest_created_at >=
+      (gint64) ingest_timeout_s * G_USEC_PER_SEC) {
+    ingest_lost ("not live within timeout");
+  }
+  ingest_buffers_seen = buffers;
+  return G_SOURCE_CONTINUE;
+}
+
+/* Sits on the pad every ingest links to, it outlives the uridecodebins.
+ * EOS from the camera must never reach webrtcbin */
+static GstPadProbeReturn
+ingest_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER) {
+    g_atomic_int_inc (&ingest_buffers);
+    metrics_counter_add (ingest_frames_metric, 1);
+    if (!g_atomic_int_get (&ingest_live)) {
+      g_atomic_int_set (&ingest_live, TRUE);
+      g_idle_add (ingest_recovered_idle, NULL);
+    }
+  } else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS) {
+    g_idle_add (ingest_lost_idle, (gpointer) "end of stream");
+    return GST_PAD_PROBE_DROP;
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+pipeline_bus_cb (GstBus * bus, GstMessage * msg, gpointer user_data)
+{
+  switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_ERROR: {
+      GError *err;
+      gchar *debug;
+
+      /* Late messages from an ingest we already removed */
+      if (!gst_object_has_as_ancestor (GST_MESSAGE_SRC (msg),
+              GST_OBJECT (pipe1)))
+        break;
+
+      gst_message_parse_error (msg, &err, &debug);
+      g_printerr ("Error from %s: %s\n%s\n", GST_MESSAGE_SRC_NAME (msg),
+          err->message, debug ? debug : "");
+      if (uridb1 && gst_object_has_as_ancestor (GST_MESSAGE_SRC (msg),
+              GST_OBJECT (uridb1)))
+        ingest_lost (err->message);
+      else
+        cleanup_and_quit_loop ("ERROR: pipeline error", PEER_CALL_ERROR);
+      g_error_free (err);
+      g_free (debug);
+      break;
+    }
+    default:
+      break;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+parse_layers (const gchar * spec)
+{
+  gchar **tokens;
+  guint i;
+  gboolean ret = TRUE;
+
+  tokens = g_strsplit (spec, ",", -1);
+  n_layers = g_strv_length (tokens);
+  if (n_layers < 2 || n_layers > MAX_LAYERS) {
+    g_printerr ("--layers needs 2 to %d layers\n", MAX_LAYERS);
+    ret = FALSE;
+  }
+  for (i = 0; ret && i < n_layers; i++) {
+    EncodeLayer *l = &layers[i];
+    if (sscanf (tokens[i], "%dx%d@%d", &l->width, &l->height,
+            &l->bitrate) != 3 || l->width <= 0 || l->height <= 0
+        || l->bitrate <= 0) {
+      g_printerr ("Invalid layer '%s', expected WIDTHxHEIGHT@KBPS\n",
+          tokens[i]);
+      ret = FALSE;
+    }
+  }
+  g_strfreev (tokens);
+  if (!ret)
+    n_layers = 0;
+  return ret;
+}
+
+/* tee ! one scale+encode branch per layer ! layersel */
+static gchar *
+layers_description (void)
+{
+  GString *desc = g_string_new ("tee name=ladder ");
+  guint i;
+
+  for (i = 0; i < n_layers; i++)
+    g_string_append_printf (desc, "ladder. ! queue leaky=downstream "
+        "max-size-buffers=2 ! videoscale ! video/x-raw,width=%d,height=%d ! "
+        "x264enc tune=zerolatency key-int-max=60 bitrate=%d ! "
+        "capsfilter name=layer%u caps=video/x-h264,profile=constrained-baseline ! "
+        "layersel. ", layers[i].width, layers[i].height, layers[i].bitrate, i);
+  return g_string_free (desc, FALSE);
+}
+
+static void
+layer_switch (guint layer)
+{
+  if (layer == cur_layer)
+    return;
+
+  g_print ("Switching peer from layer %u (%dx%d) to %u (%dx%d)\n", cur_layer,
+      layers[cur_layer].width, layers[cur_layer].height, layer,
+      layers[layer].width, layers[layer].height);
+  cur_layer = layer;
+  layer_good_samples = 0;
+  metrics_gauge_set (layer_metric, layer);
+  g_object_set (layersel1, "active-pad", layers[layer].selpad, NULL);
+  /* The peer can't decode the new layer before its next IDR */
+  gst_pad_push_event (layers[layer].selpad,
+      gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE,
+          0));
+}
+
+static gboolean
+find_fraction_lost (GQuark field_id, const GValue * value, gpointer user_data)
+{
+  const GstStructure *s;
+  GstWebRTCStatsType type;
+  gdouble *loss = (gdouble *) user_data;
+  gdouble fraction, rtt;
+
+  if (!GST_VALUE_HOLDS_STRUCTURE (value))
+    return TRUE;
+  s = gst_value_get_structure (value);
+  if (gst_structure_get (s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL)
+      && type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP
+      && gst_structure_get_double (s, "fraction-lost", &fraction)) {
+    *loss = MAX (*loss, fraction);
+    if (gst_structure_get_double (s, "round-trip-time", &rtt))
+      metrics_histogram_observe (rtt_metric, rtt);
+  }
+  return TRUE;
+}
+
+/* Loss based estimate: step down on heavy loss, step up again after a few
+ * clean receiver reports. Runs on the main loop, which owns the layer
+ * state */
+static gboolean
+layer_loss_idle (gpointer user_data)
+{
+  gdouble loss = *(gdouble *) user_data;
+
+  if (!layersel1)
+    return G_SOURCE_REMOVE;
+
+  if (loss > LAYER_LOSS_DOWN) {
+    if (cur_layer + 1 < n_layers)
+      layer_switch (cur_layer + 1);
+    layer_good_samples = 0;
+  } else if (loss < LAYER_LOSS_UP) {
+    if (++layer_good_samples >= LAYER_UP_SAMPLES && cur_layer > 0)
+      layer_switch (cur_layer - 1);
+  } else {
+    layer_good_samples = 0;
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/* Called on webrtcbin's thread, only the loss is handed over */
+static void
+on_layer_stats (GstPromise * promise, gpointer user_data)
+{
+  const GstStructure *reply;
+  gdouble loss = -1.0;
+  gdouble *copy;
+
+  if (gst_promise_wait (promise) != GST_PROMISE_RESULT_REPLIED) {
+    gst_promise_unref (promise);
+    return;
+  }
+  reply = gst_promise_get_reply (promise);
+  gst_structure_foreach (reply, find_fraction_lost, &loss);
+  gst_promise_unref (promise);
+
+  /* No receiver report yet */
+  if (loss < 0)
+    return;
+
+  copy = g_new (gdouble, 1);
+  *copy = loss;
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, layer_loss_idle, copy, g_free);
+}
+
+static gboolean
+layer_stats_cb (gpointer user_data)
+{
+  GstPromise *promise;
+
+  if (app_state < PEER_CALL_STARTED)
+    return G_SOURCE_CONTINUE;
+
+  promise = gst_promise_new_with_change_func (on_layer_stats, NULL, NULL);
+  g_signal_emit_by_name (webrtc1, "get-stats", NULL, promise);
+  return G_SOURCE_CONTINUE;
+}
+
+/* The ingest part of the pipeline, up to the decoded frames in rawtee.
+ * With HLS or DVR it starts with the process, otherwise with the first
+ * call */
+static gboolean
+ingest_pipeline_start (void)
+{
+  GstStateChangeReturn ret;
+  GError *error = NULL;
+  GstElement *ingest;
+  GstBus *bus;
+  GString *desc;
+
+  /* The camera is plugged in by ingest_create() so it can be replaced
+   * without touching the rest of the pipeline. With a slate, an
+   * input-selector switches to a live test source while the camera is gone,
+   * otherwise the peer keeps the last decoded frame. rawtee feeds the shm
+   * egress and the call, and discards frames while neither exists */
+  desc = g_string_new (ingest_slate ?
+      "input-selector name=ingest sync-streams=false ! videoconvert" :
+      "videoconvert name=ingest");
+  g_string_append (desc, " ! tee name=rawtee allow-not-linked=true");
+  if (ingest_slate)
+    g_string_append (desc, " videotestsrc name=slate is-live=true pattern=smpte ! video/x-raw,width=320,height=240,framerate=5/1 ! ingest.");
+  pipe1 = gst_parse_launch (desc->str, &error);
+  g_string_free (desc, TRUE);
 
   if (error) {
     g_printerr ("Failed to parse launch: %s\n", error->message);
@@ -439,18 +974,111 @@ start_pipeline (void)
     goto err;
   }
 
-  uridb1 = gst_bin_get_by_name (GST_BIN (pipe1), "uridb");
-  GstCaps *deco_caps;
-  deco_caps = gst_caps_from_string (KMS_AGNOSTIC_NO_RTP_CAPS);
+  /* Decoded frames for local consumers */
+  if (shm_egress_enabled ()) {
+    GstElement *tee = gst_bin_get_by_name (GST_BIN (pipe1), "rawtee");
+    GstElement *egress = shm_egress_bin_new ();
+
+    if (!egress) {
+      gst_object_unref (tee);
+      goto err;
+    }
+    gst_bin_add (GST_BIN (pipe1), egress);
+    gst_element_link (tee, egress);
+    gst_object_unref (tee);
+  }
+
+  ingest = gst_bin_get_by_name (GST_BIN (pipe1), "ingest");
+  if (ingest_slate) {
+    /* The slate got sink_0 when the launch line was parsed */
+    slate_pad = gst_element_get_static_pad (ingest, "sink_0");
+    ingest_pad = gst_element_get_request_pad (ingest, "sink_%u");
+    g_object_set (ingest, "active-pad", slate_pad, NULL);
+  } else {
+    ingest_pad = gst_element_get_static_pad (ingest, "sink");
+  }
+  gst_object_unref (ingest);
+  gst_pad_add_probe (ingest_pad, (GstPadProbeType)
+      (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+      ingest_probe_cb, NULL, NULL);
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (pipe1));
+  gst_bus_add_watch (bus, pipeline_bus_cb, NULL);
+  gst_object_unref (bus);
+
+  g_print ("Starting ingest\n");
+  ret = gst_element_set_state (GST_ELEMENT (pipe1), GST_STATE_PLAYING);
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    goto err;
+
+  /* A camera that is down at startup is just the first reconnect */
+  if (!ingest_create ())
+    ingest_lost ("initial connect failed");
+  if (ingest_timeout_s > 0)
+    ingest_watchdog_id = g_timeout_add_seconds (ingest_timeout_s,
+        ingest_watchdog_cb, NULL);
+  return TRUE;
+
+err:
+  if (pipe1)
+    g_clear_object (&pipe1);
+  return FALSE;
+}
+
+/* Attaches the encoders and webrtcbin of a call to the running ingest */
+static gboolean
+start_pipeline (void)
+{
+  GError *error = NULL;
+  GstElement *tee;
+  GString *desc;
+  guint i;
+
+  if (!pipe1 && !ingest_pipeline_start ())
+    return FALSE;
+
+  if (n_layers > 0) {
+    gchar *ladder = layers_description ();
+    desc = g_string_new (ladder);
+    g_string_append (desc, " input-selector name=layersel sync-streams=false ! rtph264pay config-interval=-1");
+    g_free (ladder);
+  } else {
+    desc = g_string_new ("queue ! x264enc ! rtph264pay");
+  }
+  g_string_append (desc, " ! queue ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! webrtcbin name=sendrecv");
+  call_bin = gst_parse_bin_from_description (desc->str, TRUE, &error);
+  g_string_free (desc, TRUE);
+
   //Disable transcoding
-  //g_object_set (G_OBJECT (uridb1), "caps", deco_caps, NULL);
-  gst_caps_unref (deco_caps);
+  //pipe1 = gst_parse_launch ("uridecodebin name=uridb uri=rtsp://127.0.0.1:8554/test ! rtph264pay ! queue ! application/x-rtp,media=video,encoding-name=H264,payload=96 ! webrtcbin name=sendrecv", &error);
 
-  webrtc1 = gst_bin_get_by_name (GST_BIN (pipe1), "sendrecv");
-  g_assert_nonnull (webrtc1);
+  if (!call_bin) {
+    g_printerr ("Failed to parse launch: %s\n", error ? error->message : "?");
+    g_clear_error (&error);
+    return FALSE;
+  }
+  g_clear_error (&error);
+  gst_bin_add (GST_BIN (pipe1), call_bin);
+
+  if (n_layers > 0) {
+    layersel1 = gst_bin_get_by_name (GST_BIN (call_bin), "layersel");
+    for (i = 0; i < n_layers; i++) {
+      gchar *name = g_strdup_printf ("layer%u", i);
+      GstElement *caps = gst_bin_get_by_name (GST_BIN (call_bin), name);
+      GstPad *srcpad = gst_element_get_static_pad (caps, "src");
+      layers[i].selpad = gst_pad_get_peer (srcpad);
+      gst_object_unref (srcpad);
+      gst_object_unref (caps);
+      g_free (name);
+    }
+    cur_layer = 0;
+    g_object_set (layersel1, "active-pad", layers[0].selpad, NULL);
+    layer_stats_id = g_timeout_add (LAYER_STATS_INTERVAL_MS, layer_stats_cb,
+        NULL);
+  }
 
-  g_signal_connect (uridb1, "element-added",
-      G_CALLBACK (uridecodebin_element_added), NULL);
+  webrtc1 = gst_bin_get_by_name (GST_BIN (call_bin), "sendrecv");
+  g_assert_nonnull (webrtc1);
 
   /* This is the gstwebrtc entry point where we create the offer and so on. It
    * will be called when the pipeline goes to PLAYING. */
@@ -461,28 +1089,80 @@ start_pipeline (void)
    * added by us too, see on_server_message() */
   g_signal_connect (webrtc1, "on-ice-candidate",
       G_CALLBACK (send_ice_candidate_message), NULL);
-  /* Incoming streams will be exposed via this signal */
+  /* Incoming streams will be exposed via this signal, their decoders go
+   * away with the call */
   g_signal_connect (webrtc1, "pad-added", G_CALLBACK (on_incoming_stream),
-      pipe1);
-  /* Lifetime is the same as the pipeline itself */
+      call_bin);
+  /* Lifetime is the same as the call bin itself */
   gst_object_unref (webrtc1);
 
-  g_print ("Starting pipeline\n");
-  ret = gst_element_set_state (GST_ELEMENT (pipe1), GST_STATE_PLAYING);
-  if (ret == GST_STATE_CHANGE_FAILURE)
-    goto err;
+  tee = gst_bin_get_by_name (GST_BIN (pipe1), "rawtee");
+  if (!gst_element_link (tee, call_bin)) {
+    gst_object_unref (tee);
+    g_printerr ("Failed to link the call to the ingest\n");
+    call_stop ();
+    return FALSE;
+  }
+  gst_object_unref (tee);
+
+  g_print ("Starting call\n");
+  if (!gst_element_sync_state_with_parent (call_bin)) {
+    call_stop ();
+    return FALSE;
+  }
 
   g_print ("Started pipeline\n");
   return TRUE;
+}
 
-err:
-  if (pipe1)
-    g_clear_object (&pipe1);
-  if (webrtc1)
-    webrtc1 = NULL;
-  return FALSE;
+/* Detaches the call from rawtee before stopping it, a flushing branch
+ * would otherwise stop the ingest's streaming thread too */
+static void
+call_stop (void)
+{
+  GstPad *sinkpad, *teepad;
+  guint i;
+
+  if (!call_bin)
+    return;
+
+  if (layer_stats_id) {
+    g_source_remove (layer_stats_id);
+    layer_stats_id = 0;
+  }
+  for (i = 0; i < n_layers; i++)
+    gst_clear_object (&layers[i].selpad);
+  gst_clear_object (&layersel1);
+
+  sinkpad = gst_element_get_static_pad (call_bin, "sink");
+  teepad = sinkpad ? gst_pad_get_peer (sinkpad) : NULL;
+  if (teepad) {
+    GstElement *tee = gst_pad_get_parent_element (teepad);
+
+    gst_pad_unlink (teepad, sinkpad);
+    gst_element_release_request_pad (tee, teepad);
+    gst_object_unref (tee);
+    gst_object_unref (teepad);
+  }
+  if (sinkpad)
+    gst_object_unref (sinkpad);
+
+  gst_element_set_state (call_bin, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (pipe1), call_bin);
+  call_bin = NULL;
+  webrtc1 = NULL;
 }
 
+/* With HLS or DVR the process outlives the call, it stops on SIGINT or
+ * SIGTERM */
+static gboolean
+interrupted_cb (gpointer user_data)
+{
+  g_print ("Interrupted, stopping\n");
+  if (loop)
+    g_main_loop_quit (loop);
+  return G_SOURCE_CONTINUE;
+}
 
 static gboolean
 setup_call (void)
@@ -567,6 +1247,7 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
     }
     app_state = SERVER_REGISTERED;
     g_print ("Registered with server\n");
+    startup_mark ("registered");
     /* Ask signalling server to connect us with a specific peer */
     if (!setup_call ()) {
       cleanup_and_quit_loop ("ERROR: Failed to setup call", PEER_CALL_ERROR);
@@ -581,6 +1262,7 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
     }
 
     app_state = PEER_CONNECTED;
+    signalling_backoff_ms = INGEST_BACKOFF_MIN_MS;
     /* Start negotiation (exchange SDP and ICE candidates) */
     if (!start_pipeline ())
       cleanup_and_quit_loop ("ERROR: failed to start pipeline",
@@ -708,6 +1390,7 @@ on_server_connected (SoupSession * session, GAsyncResult * res,
 
   app_state = SERVER_CONNECTED;
   g_print ("Connected to signalling server\n");
+  startup_mark ("connected");
 
   g_signal_connect (ws_conn, "closed", G_CALLBACK (on_server_closed), NULL);
   g_signal_connect (ws_conn, "message", G_CALLBACK (on_server_message), NULL);
@@ -732,9 +1415,13 @@ connect_to_websocket_server_async (void)
       //SOUP_SESSION_SSL_CA_FILE, "/etc/ssl/certs/ca-bundle.crt",
       SOUP_SESSION_HTTPS_ALIASES, https_aliases, NULL);
 
-  logger = soup_logger_new (SOUP_LOGGER_LOG_BODY, -1);
-  soup_session_add_feature (session, SOUP_SESSION_FEATURE (logger));
-  g_object_unref (logger);
+  /* Only the handshake goes through the logger, the websocket frames
+   * after it are not logged anyway */
+  if (!fast_start) {
+    logger = soup_logger_new (SOUP_LOGGER_LOG_BODY, -1);
+    soup_session_add_feature (session, SOUP_SESSION_FEATURE (logger));
+    g_object_unref (logger);
+  }
 
   message = soup_message_new (SOUP_METHOD_GET, server_url);
 
@@ -743,6 +1430,8 @@ connect_to_websocket_server_async (void)
   /* Once connected, we will register */
   soup_session_websocket_connect_async (session, message, NULL, NULL, NULL,
       (GAsyncReadyCallback) on_server_connected, message);
+  /* The pending connect holds its own ref, every reconnect has a new one */
+  g_object_unref (session);
   app_state = SERVER_CONNECTING;
 }
 
@@ -770,21 +1459,93 @@ check_plugins (void)
   return ret;
 }
 
+/* Loads the element factories start_pipeline() will need while the
+ * websocket handshake is in flight, so the dlopen() cost is off the
+ * critical path when the peer answers */
+static gpointer
+preload_features_thread (gpointer user_data)
+{
+  int i;
+  GstRegistry *registry;
+  const gchar *features[] = { "uridecodebin", "rtspsrc", "videoconvert",
+      "queue", "x264enc", "rtph264pay", "webrtcbin", "input-selector", "tee",
+      "videoscale", "videotestsrc", NULL};
+
+  registry = gst_registry_get ();
+  for (i = 0; features[i]; i++) {
+    GstPluginFeature *feature, *loaded;
+
+    feature = gst_registry_lookup_feature (registry, features[i]);
+    if (!feature) {
+      g_print ("Element '%s' not found\n", features[i]);
+      continue;
+    }
+    loaded = gst_plugin_feature_load (feature);
+    if (loaded)
+      gst_object_unref (loaded);
+    gst_object_unref (feature);
+  }
+  startup_mark ("features preloaded");
+  return NULL;
+}
+
 int
 main (int argc, char *argv[])
 {
   GOptionContext *context;
   GError *error = NULL;
+  int i;
+
+  startup_t0 = startup_last = g_get_monotonic_time ();
+
+  /* gst_init() runs inside the option parsing, anything that changes how it
+   * scans the registry has to be known before that */
+  for (i = 1; i < argc; i++) {
+    if (g_strcmp0 (argv[i], "--fast-start") == 0) {
+      g_setenv ("GST_REGISTRY_UPDATE", "no", FALSE);
+      gst_registry_fork_set_enabled (FALSE);
+    }
+  }
 
   context = g_option_context_new ("- gstreamer webrtc sendrecv demo");
   g_option_context_add_main_entries (context, entries, NULL);
   g_option_context_add_group (context, gst_init_get_option_group ());
+  g_option_context_add_group (context, metrics_get_option_group ());
+  g_option_context_add_group (context, shm_egress_get_option_group ());
+  g_option_context_add_group (context, cmaf_hls_get_option_group ());
+  g_option_context_add_group (context, dvr_get_option_group ());
   if (!g_option_context_parse (context, &argc, &argv, &error)) {
     g_printerr ("Error initializing: %s\n", error->message);
     return -1;
   }
+  g_option_context_free (context);
 
-  if (!check_plugins ())
+  if (!metrics_setup ())
+    return -1;
+  ingest_frames_metric = metrics_counter_new ("ingest_frames_total",
+      "Decoded frames from the RTSP ingest");
+  ingest_reconnects_metric = metrics_counter_new ("ingest_reconnects_total",
+      "Times the RTSP ingest was lost and restarted");
+  ingest_live_metric = metrics_gauge_new ("ingest_live",
+      "1 while the RTSP ingest delivers frames");
+  layer_metric = metrics_gauge_new ("webrtc_layer",
+      "Encoding layer sent to the peer, 0 is the highest");
+  rtt_metric = metrics_histogram_new ("webrtc_rtt_seconds",
+      "Round trip time from the peer's receiver reports (with --layers)",
+      rtt_bounds, G_N_ELEMENTS (rtt_bounds));
+  if (!cmaf_hls_start ())
+    return -1;
+  if (!dvr_record_start ())
+    return -1;
+  startup_mark ("options and gst_init");
+
+  if (fast_start)
+    g_thread_unref (g_thread_new ("preload", preload_features_thread, NULL));
+  else if (!check_plugins ())
+    return -1;
+  startup_mark ("plugin check");
+
+  if (layers_spec && !parse_layers (layers_spec))
     return -1;
 
   if (!peer_id) {
@@ -804,16 +1565,40 @@ main (int argc, char *argv[])
 
   loop = g_main_loop_new (NULL, FALSE);
 
+  /* The ingest feeds HLS and the recorder whether or not a call is up */
+  if (recording_enabled ()) {
+    g_unix_signal_add (SIGINT, interrupted_cb, NULL);
+    g_unix_signal_add (SIGTERM, interrupted_cb, NULL);
+    if (!ingest_pipeline_start ())
+      return -1;
+    startup_mark ("ingest started");
+  }
+
   connect_to_websocket_server_async ();
+  startup_mark ("connecting");
 
   g_main_loop_run (loop);
   g_main_loop_unref (loop);
 
+  if (signalling_retry_id)
+    g_source_remove (signalling_retry_id);
+  if (ingest_retry_id)
+    g_source_remove (ingest_retry_id);
+  if (ingest_watchdog_id)
+    g_source_remove (ingest_watchdog_id);
+  if (ingest_pad)
+    gst_object_unref (ingest_pad);
+  call_stop ();
+  if (slate_pad)
+    gst_object_unref (slate_pad);
+
   if (pipe1) {
     gst_element_set_state (GST_ELEMENT (pipe1), GST_STATE_NULL);
     g_print ("Pipeline stopped\n");
     gst_object_unref (pipe1);
   }
+  cmaf_hls_stop ();
+  dvr_record_stop ();
 
   return 0;
 }
\ No newline at end of file
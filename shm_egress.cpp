@@ -0,0 +1,105 @@
+//
+// Shared memory egress of decoded frames, see shm_egress.h.
+//
+
+#include "shm_egress.h"
+#include "metrics.h"
+
+#define DEFAULT_SHM_EGRESS_FRAMES 2
+#define DEFAULT_SHM_EGRESS_SIZE_MB 64
+
+static gchar *shm_egress_path = NULL;
+static gint shm_egress_frames = DEFAULT_SHM_EGRESS_FRAMES;
+static gint shm_egress_size_mb = DEFAULT_SHM_EGRESS_SIZE_MB;
+
+static GOptionEntry shm_egress_entries[] = {
+        {"shm-egress", 0, 0, G_OPTION_ARG_FILENAME, &shm_egress_path,
+                "Publish decoded frames to local consumers through shmsink on this socket path", "PATH"},
+        {"shm-egress-frames", 0, 0, G_OPTION_ARG_INT, &shm_egress_frames,
+                "Frames held for slow consumers before the oldest is dropped (default: 2)", "N"},
+        {"shm-egress-size", 0, 0, G_OPTION_ARG_INT, &shm_egress_size_mb,
+                "Size of the shared memory area in MB, should hold a few frames per consumer (default: 64)", "MB"},
+        {NULL}
+};
+
+static MetricsCounter *published_metric = NULL;
+static MetricsCounter *dropped_metric = NULL;
+
+GOptionGroup *
+shm_egress_get_option_group (void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new ("shm-egress", "Shared memory frame egress options",
+                                "Show shared memory frame egress options", NULL, NULL);
+    g_option_group_add_entries (group, shm_egress_entries);
+    return group;
+}
+
+gboolean
+shm_egress_enabled (void)
+{
+    return shm_egress_path != NULL;
+}
+
+/* The leaky queue is about to drop the oldest frame */
+static void
+queue_overrun_cb (GstElement * queue, gpointer user_data)
+{
+    metrics_counter_add (dropped_metric, 1);
+}
+
+static GstPadProbeReturn
+published_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    metrics_counter_add (published_metric, 1);
+    return GST_PAD_PROBE_OK;
+}
+
+GstElement *
+shm_egress_bin_new (void)
+{
+    GstElement *bin, *queue, *pay;
+    GError *error = NULL;
+    gchar *desc;
+    GstPad *pad;
+
+    if (!shm_egress_path)
+        return NULL;
+    if (!published_metric) {
+        published_metric = metrics_counter_new ("shm_egress_frames_total",
+                                                "Frames written to the shared memory egress");
+        dropped_metric = metrics_counter_new ("shm_egress_dropped_total",
+                                              "Frames dropped because shared memory consumers fell behind");
+    }
+
+    /* The queue only leaks, it never blocks the tee; shmsink blocks its own
+     * thread alone while the area is full, for all consumers */
+    desc = g_strdup_printf ("queue name=shmqueue leaky=downstream max-size-buffers=%d max-size-bytes=0 "
+                            "max-size-time=0 ! gdppay name=shmpay ! shmsink socket-path=\"%s\" "
+                            "shm-size=%" G_GUINT64_FORMAT " wait-for-connection=false sync=false async=false",
+                            MAX (shm_egress_frames, 1), shm_egress_path,
+                            (guint64) MAX (shm_egress_size_mb, 1) * 1024 * 1024);
+    bin = gst_parse_bin_from_description (desc, TRUE, &error);
+    g_free (desc);
+    if (!bin) {
+        g_printerr ("Can't create shared memory egress: %s\n", error ? error->message : "?");
+        g_clear_error (&error);
+        return NULL;
+    }
+    g_clear_error (&error);
+
+    queue = gst_bin_get_by_name (GST_BIN (bin), "shmqueue");
+    g_signal_connect (queue, "overrun", G_CALLBACK (queue_overrun_cb), NULL);
+    gst_object_unref (queue);
+
+    /* Past the queue, so dropped frames are not counted; gdppay's own caps
+     * and event packets are not frames either */
+    pay = gst_bin_get_by_name (GST_BIN (bin), "shmpay");
+    pad = gst_element_get_static_pad (pay, "sink");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, published_probe_cb, NULL, NULL);
+    gst_object_unref (pad);
+    gst_object_unref (pay);
+
+    return bin;
+}
@@ -0,0 +1,47 @@
+//
+// Shared memory egress of decoded frames for local consumers, used by
+// rtsp2webrtc and the RTSP server binaries.
+//
+
+#ifndef SHM_EGRESS_H
+#define SHM_EGRESS_H
+
+#include <gst/gst.h>
+
+/*
+ * Frames are published once through shmsink and any number of local
+ * processes map them from the same shared memory area:
+ *
+ *   gst-launch-1.0 shmsrc socket-path=/tmp/cam.shm is-live=true ! gdpdepay ! videoconvert ! ...
+ *
+ * gdppay carries the caps and every buffer's timestamps, duration, offset
+ * (frame number) and flags along with the frame. The branch sits behind a
+ * leaky queue, so consumers never stall the pipeline it taps.
+ *
+ * Consumers are not isolated from each other though. A frame's memory in
+ * the area is only reused once every consumer released it, and shmsink
+ * blocks while the area is full. One stuck consumer that holds its frames
+ * therefore stops publishing for all of them until it releases them or
+ * disconnects; meanwhile the queue drops frames. --shm-egress-size only
+ * delays that point.
+ */
+
+/*
+ * Returns the option group with the egress options.
+ */
+GOptionGroup *shm_egress_get_option_group (void);
+
+/*
+ * @return TRUE if --shm-egress was given.
+ */
+gboolean shm_egress_enabled (void);
+
+/*
+ * Creates the egress branch (leaky queue, gdppay, shmsink) as a bin with
+ * a sink pad, to be linked to a tee. Only one branch may exist per socket
+ * path at a time.
+ * @return The bin or NULL on failure.
+ */
+GstElement *shm_egress_bin_new (void);
+
+#endif //SHM_EGRESS_H